@@ -0,0 +1,143 @@
+#include "bundle.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <string.h>
+
+#define FLUSH_BATCH 64
+
+#define BUNDLE_START (sizeof(struct header) + sizeof(struct bundle_entry))
+
+/** Largest bundle that fits the link and the receive buffers of our peers */
+static size_t bundle_limit(interface *iface) {
+	size_t limit = iface->mtu > DATAGRAM_OVERHEAD ? iface->mtu - DATAGRAM_OVERHEAD : 0;
+
+	return limit < RX_BUFFER_SIZE ? limit : RX_BUFFER_SIZE;
+}
+
+/** Prepares the message for the bundle of a neighbour and empties the bundle */
+static void bundle_take(struct context *ctx, struct neighbour *neighbour, struct mmsghdr *msg, struct iovec *iov) {
+	// a single packet goes out as a plain datagram every version understands
+	if (neighbour->bundle_count == 1) {
+		iov->iov_base = neighbour->bundle + BUNDLE_START;
+		iov->iov_len = neighbour->bundle_len - BUNDLE_START;
+	} else {
+		iov->iov_base = neighbour->bundle;
+		iov->iov_len = neighbour->bundle_len;
+
+		ctx->stats.bundles_tx++;
+		ctx->stats.bundled_tx += neighbour->bundle_count;
+	}
+
+	*msg = (struct mmsghdr){
+		.msg_hdr = {
+			.msg_name = &neighbour->address,
+			.msg_namelen = sizeof(struct sockaddr_in6),
+			.msg_iov = iov,
+			.msg_iovlen = 1,
+		},
+	};
+
+	neighbour->bundle_len = 0;
+	neighbour->bundle_count = 0;
+}
+
+static void bundle_flush_neighbour(struct context *ctx, interface *iface, struct neighbour *neighbour) {
+	struct mmsghdr msg;
+	struct iovec iov;
+
+	if (!neighbour->bundle_count)
+		return;
+
+	bundle_take(ctx, neighbour, &msg, &iov);
+	send_batch(ctx, iface, &msg, 1);
+}
+
+/**
+ * bundle_flush - send all bundles that are waiting
+ * @ctx: the mmfd context
+ */
+void bundle_flush(struct context *ctx) {
+	struct mmsghdr msgs[FLUSH_BATCH];
+	struct iovec iovs[FLUSH_BATCH];
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+		unsigned int n = 0;
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+
+			if (!neighbour->bundle_count)
+				continue;
+
+			bundle_take(ctx, neighbour, &msgs[n], &iovs[n]);
+
+			if (++n == FLUSH_BATCH) {
+				send_batch(ctx, iface, msgs, n);
+				n = 0;
+			}
+		}
+
+		if (n)
+			send_batch(ctx, iface, msgs, n);
+	}
+}
+
+static void bundle_flush_task(__attribute__ ((unused)) void *d) {
+	ctx.bundle_flush_pending = false;
+	bundle_flush(&ctx);
+}
+
+/**
+ * bundle_add - queue a packet for a neighbour
+ * @ctx: the mmfd context
+ * @iface: the interface the neighbour is reachable on
+ * @neighbour: the neighbour
+ * @iov: the header and the packet
+ *
+ * Return: true if the packet was queued, false if it is too big to share a
+ * datagram and has to be sent on its own
+ */
+bool bundle_add(struct context *ctx, interface *iface, struct neighbour *neighbour, struct iovec *iov) {
+	size_t len = iov[0].iov_len + iov[1].iov_len;
+	size_t limit = bundle_limit(iface);
+
+	if (BUNDLE_START + len > limit) {
+		// keep the order of packets to this neighbour
+		bundle_flush_neighbour(ctx, iface, neighbour);
+		return false;
+	}
+
+	if (neighbour->bundle_len + sizeof(struct bundle_entry) + len > limit)
+		bundle_flush_neighbour(ctx, iface, neighbour);
+
+	if (!neighbour->bundle)
+		neighbour->bundle = mmfd_alloc(RX_BUFFER_SIZE);
+
+	if (!neighbour->bundle_len) {
+		struct header hdr = { .nonce = BUNDLE_MAGIC };
+
+		memcpy(neighbour->bundle, &hdr, sizeof(hdr));
+		neighbour->bundle_len = sizeof(hdr);
+	}
+
+	struct bundle_entry entry = { .len = htons(len) };
+	uint8_t *p = neighbour->bundle + neighbour->bundle_len;
+
+	memcpy(p, &entry, sizeof(entry));
+	p += sizeof(entry);
+	memcpy(p, iov[0].iov_base, iov[0].iov_len);
+	memcpy(p + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+	neighbour->bundle_len += sizeof(entry) + len;
+	neighbour->bundle_count++;
+
+	// one timer covers all neighbours, it sends whatever has been queued
+	if (!ctx->bundle_flush_pending) {
+		ctx->bundle_flush_pending = true;
+		post_task_us(&ctx->taskqueue_ctx, ctx->aggregation_us, bundle_flush_task, NULL, NULL);
+	}
+
+	return true;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "mmfd.h"
+
+/**
+ * Aggregation of small packets.
+ *
+ * Packets for the same neighbour are collected for up to aggregation_us
+ * microseconds, or until no further packet fits into one datagram on the
+ * link, and are then sent as a single bundle.
+ */
+
+bool bundle_add(struct context *ctx, interface *iface, struct neighbour *neighbour, struct iovec *iov);
+void bundle_flush(struct context *ctx);
@@ -0,0 +1,179 @@
+#include "dupfilter.h"
+#include "util.h"
+
+#include <linux/bpf.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BPF_LOG_SIZE 4096
+
+/* offset of the nonce as seen by a socket filter: behind the UDP header */
+#define NONCE_OFFSET 8
+
+#define INSN(CODE, DST, SRC, OFF, IMM) \
+	((struct bpf_insn){ .code = (CODE), .dst_reg = (DST), .src_reg = (SRC), .off = (OFF), .imm = (IMM) })
+
+#define MOV64_REG(DST, SRC)      INSN(BPF_ALU64 | BPF_MOV | BPF_X, DST, SRC, 0, 0)
+#define MOV64_IMM(DST, IMM)      INSN(BPF_ALU64 | BPF_MOV | BPF_K, DST, 0, 0, IMM)
+#define ADD64_IMM(DST, IMM)      INSN(BPF_ALU64 | BPF_ADD | BPF_K, DST, 0, 0, IMM)
+#define ST_MEM_W(DST, OFF, IMM)  INSN(BPF_ST | BPF_MEM | BPF_W, DST, 0, OFF, IMM)
+#define ATOMIC_ADD64(DST, SRC)   INSN(BPF_STX | BPF_ATOMIC | BPF_DW, DST, SRC, 0, BPF_ADD)
+#define LD_MAP_FD(DST, FD)       INSN(BPF_LD | BPF_DW | BPF_IMM, DST, BPF_PSEUDO_MAP_FD, 0, FD), INSN(0, 0, 0, 0, 0)
+#define JEQ_IMM(DST, IMM, OFF)   INSN(BPF_JMP | BPF_JEQ | BPF_K, DST, 0, OFF, IMM)
+#define JNE_IMM(DST, IMM, OFF)   INSN(BPF_JMP | BPF_JNE | BPF_K, DST, 0, OFF, IMM)
+#define CALL(FUNC)               INSN(BPF_JMP | BPF_CALL, 0, 0, 0, FUNC)
+#define EXIT()                   INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+static int sys_bpf(enum bpf_cmd cmd, union bpf_attr *attr) {
+	return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+static int create_map(enum bpf_map_type type, size_t key_size, size_t value_size, size_t entries) {
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = type;
+	attr.key_size = key_size;
+	attr.value_size = value_size;
+	attr.max_entries = entries;
+
+	return sys_bpf(BPF_MAP_CREATE, &attr);
+}
+
+static int load_program(int map_fd, int stats_fd) {
+	struct bpf_insn prog[] = {
+		MOV64_REG(BPF_REG_6, BPF_REG_1),
+
+		// copy the nonce onto the stack, accept anything too short to have one
+		MOV64_REG(BPF_REG_1, BPF_REG_6),
+		MOV64_IMM(BPF_REG_2, NONCE_OFFSET),
+		MOV64_REG(BPF_REG_3, BPF_REG_10),
+		ADD64_IMM(BPF_REG_3, -8),
+		MOV64_IMM(BPF_REG_4, 8),
+		CALL(BPF_FUNC_skb_load_bytes),
+		JNE_IMM(BPF_REG_0, 0, 17),
+
+		// accept unknown nonces
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -8),
+		LD_MAP_FD(BPF_REG_1, map_fd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, 11),
+
+		// count and drop duplicates
+		ST_MEM_W(BPF_REG_10, -12, 0),
+		MOV64_REG(BPF_REG_2, BPF_REG_10),
+		ADD64_IMM(BPF_REG_2, -12),
+		LD_MAP_FD(BPF_REG_1, stats_fd),
+		CALL(BPF_FUNC_map_lookup_elem),
+		JEQ_IMM(BPF_REG_0, 0, 2),
+		MOV64_IMM(BPF_REG_1, 1),
+		ATOMIC_ADD64(BPF_REG_0, BPF_REG_1),
+		MOV64_IMM(BPF_REG_0, 0),
+		EXIT(),
+
+		// keep the whole datagram
+		MOV64_IMM(BPF_REG_0, -1),
+		EXIT(),
+	};
+
+	char log[BPF_LOG_SIZE] = "";
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+	attr.insns = (uint64_t)(uintptr_t)prog;
+	attr.insn_cnt = sizeof(prog) / sizeof(prog[0]);
+	attr.license = (uint64_t)(uintptr_t)"GPL";
+	attr.log_buf = (uint64_t)(uintptr_t)log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+
+	int fd = sys_bpf(BPF_PROG_LOAD, &attr);
+	if (fd < 0 && *log)
+		log_debug("eBPF verifier: %s\n", log);
+
+	return fd;
+}
+
+/**
+ * dupfilter_init - create the nonce map and load the filter program
+ * @filter: the filter to initialize
+ * @entries: number of nonces the kernel remembers
+ *
+ * Return: true on success, false if eBPF is not available
+ */
+bool dupfilter_init(dupfilter_ctx *filter, size_t entries) {
+	filter->map_fd = filter->stats_fd = filter->prog_fd = -1;
+
+	filter->map_fd = create_map(BPF_MAP_TYPE_LRU_HASH, sizeof(uint64_t), sizeof(uint8_t), entries);
+	if (filter->map_fd < 0)
+		goto error;
+
+	filter->stats_fd = create_map(BPF_MAP_TYPE_ARRAY, sizeof(uint32_t), sizeof(uint64_t), 1);
+	if (filter->stats_fd < 0)
+		goto error;
+
+	filter->prog_fd = load_program(filter->map_fd, filter->stats_fd);
+	if (filter->prog_fd < 0)
+		goto error;
+
+	return true;
+
+error:
+	log_error("eBPF duplicate filter unavailable, filtering in userspace: %s\n", strerror(errno));
+
+	if (filter->stats_fd >= 0)
+		close(filter->stats_fd);
+	if (filter->map_fd >= 0)
+		close(filter->map_fd);
+
+	filter->map_fd = filter->stats_fd = filter->prog_fd = -1;
+	return false;
+}
+
+void dupfilter_attach(dupfilter_ctx *filter, int fd) {
+	if (!dupfilter_enabled(filter))
+		return;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_BPF, &filter->prog_fd, sizeof(filter->prog_fd)))
+		log_error("could not attach eBPF duplicate filter, filtering in userspace: %s\n", strerror(errno));
+}
+
+void dupfilter_add(dupfilter_ctx *filter, uint64_t nonce) {
+	if (!dupfilter_enabled(filter))
+		return;
+
+	uint8_t value = 1;
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = filter->map_fd;
+	attr.key = (uint64_t)(uintptr_t)&nonce;
+	attr.value = (uint64_t)(uintptr_t)&value;
+	attr.flags = BPF_ANY;
+
+	if (sys_bpf(BPF_MAP_UPDATE_ELEM, &attr))
+		log_debug("could not add nonce " FMT_NONCE " to eBPF duplicate filter: %s\n", nonce, strerror(errno));
+}
+
+uint64_t dupfilter_dropped(dupfilter_ctx *filter) {
+	if (!dupfilter_enabled(filter))
+		return 0;
+
+	uint32_t key = 0;
+	uint64_t value = 0;
+	union bpf_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = filter->stats_fd;
+	attr.key = (uint64_t)(uintptr_t)&key;
+	attr.value = (uint64_t)(uintptr_t)&value;
+
+	sys_bpf(BPF_MAP_LOOKUP_ELEM, &attr);
+
+	return value;
+}
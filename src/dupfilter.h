@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * In-kernel duplicate filter.
+ *
+ * An eBPF socket filter on every intercom socket looks up the nonce of each
+ * arriving datagram in an LRU hash map. mmfd fills the map with every nonce
+ * it accepts, so further copies of a packet are dropped before they are
+ * copied to userspace. Without eBPF support all fds stay at -1 and every
+ * packet takes the normal userspace path.
+ */
+typedef struct {
+	int map_fd;   /**< LRU hash map of known nonces */
+	int stats_fd; /**< array map holding the number of dropped packets */
+	int prog_fd;
+} dupfilter_ctx;
+
+bool dupfilter_init(dupfilter_ctx *filter, size_t entries);
+void dupfilter_attach(dupfilter_ctx *filter, int fd);
+void dupfilter_add(dupfilter_ctx *filter, uint64_t nonce);
+uint64_t dupfilter_dropped(dupfilter_ctx *filter);
+
+static inline bool dupfilter_enabled(dupfilter_ctx *filter) {
+	return filter->prog_fd >= 0;
+}
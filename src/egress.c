@@ -0,0 +1,238 @@
+#include "egress.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <linux/ipv6.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *class_names[EGRESS_CLASSES] = { "high", "normal", "low" };
+static const unsigned int default_weights[EGRESS_CLASSES] = { 8, 4, 1 };
+
+const char *egress_class_name(enum egress_class_id class) {
+	return class_names[class];
+}
+
+static uint64_t now_us(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ull + t.tv_nsec / 1000;
+}
+
+/**
+ * egress_configure - pick the scheduler
+ * @egress: the context
+ * @spec: strict or weighted[:<high>,<normal>,<low>]
+ *
+ * Return: false if @spec cannot be parsed
+ */
+bool egress_configure(egress_ctx *egress, const char *spec) {
+	unsigned int w[EGRESS_CLASSES];
+
+	if (!strcmp(spec, "strict")) {
+		egress->weighted = false;
+	} else if (!strcmp(spec, "weighted")) {
+		egress->weighted = true;
+		memcpy(w, default_weights, sizeof(w));
+	} else if (sscanf(spec, "weighted:%u,%u,%u", &w[0], &w[1], &w[2]) == 3 && w[0] && w[1] && w[2]) {
+		egress->weighted = true;
+	} else {
+		return false;
+	}
+
+	for (size_t i = 0; i < EGRESS_CLASSES; i++)
+		egress->classes[i].weight = egress->weighted ? w[i] : default_weights[i];
+
+	egress->enabled = true;
+	return true;
+}
+
+/**
+ * egress_add_rule - put the groups under a prefix into a class
+ * @egress: the context
+ * @spec: <prefix>[/<length>]=high|normal|low
+ *
+ * Return: false if @spec cannot be parsed
+ */
+bool egress_add_rule(egress_ctx *egress, const char *spec) {
+	const char *eq = strchr(spec, '=');
+	struct egress_rule rule = {};
+
+	if (!eq || !parse_prefix(spec, eq - spec, &rule.prefix, &rule.prefix_len))
+		return false;
+
+	for (rule.class = 0; rule.class < EGRESS_CLASSES; rule.class++) {
+		if (!strcmp(eq + 1, class_names[rule.class])) {
+			VECTOR_ADD(egress->rules, rule);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * egress_init - set up the queues
+ * @egress: the context, egress_configure() enables it
+ * @depth: packets per class
+ * @slot_size: largest header and packet that is queued
+ */
+void egress_init(egress_ctx *egress, size_t depth, size_t slot_size) {
+	if (!egress->enabled)
+		return;
+
+	egress->depth = depth;
+	egress->slot_size = slot_size;
+	egress->current = 0;
+	egress->credit = egress->classes[0].weight;
+
+	for (size_t i = 0; i < EGRESS_CLASSES; i++) {
+		struct egress_class *c = &egress->classes[i];
+
+		c->ring = mmfd_new0_array(depth, struct egress_packet);
+		c->slots = mmfd_alloc(depth * slot_size);
+
+		for (size_t j = 0; j < depth; j++)
+			c->ring[j].data = c->slots + j * slot_size;
+	}
+}
+
+/** Longest matching group prefix first, then the DSCP of the traffic class */
+static enum egress_class_id egress_classify(egress_ctx *egress, const uint8_t *packet, size_t len) {
+	const struct ipv6hdr *hdr = (const struct ipv6hdr *)packet;
+	struct egress_rule *best = NULL;
+
+	if (len < sizeof(*hdr))
+		return EGRESS_NORMAL;
+
+	for (size_t i = 0; i < VECTOR_LEN(egress->rules); i++) {
+		struct egress_rule *rule = &VECTOR_INDEX(egress->rules, i);
+
+		if ((!best || rule->prefix_len > best->prefix_len) && prefix_match(&hdr->daddr, &rule->prefix, rule->prefix_len))
+			best = rule;
+	}
+
+	if (best)
+		return best->class;
+
+	uint8_t dscp = (hdr->priority << 2) | (hdr->flow_lbl[0] >> 6);
+
+	// CS5 and above, which includes EF and network control, and the
+	// lower effort classes LE and CS1
+	if (dscp >= 40)
+		return EGRESS_HIGH;
+
+	if (dscp == 1 || dscp == 8)
+		return EGRESS_LOW;
+
+	return EGRESS_NORMAL;
+}
+
+/**
+ * egress_enqueue - queue a packet for forward_packet()
+ * @ctx: the mmfd context
+ * @packet: the IPv6 packet, it is copied
+ * @len: its length
+ * @hdr: the mmfd header, it is copied
+ * @hdrlen: its length
+ * @src_addr: the neighbour the packet came from, NULL for local packets
+ * @legacy_only: passed on to forward_packet()
+ * @hop_limit: passed on to forward_packet()
+ *
+ * Return: false if the queue of its class is full and it was dropped
+ */
+bool egress_enqueue(struct context *ctx, uint8_t *packet, size_t len, struct header *hdr, size_t hdrlen,
+		    struct sockaddr_in6 *src_addr, bool legacy_only, uint8_t hop_limit) {
+	egress_ctx *egress = &ctx->egress;
+
+	// nothing bigger comes from the tun device or a neighbour
+	if (hdrlen + len > egress->slot_size) {
+		egress->draining = true;
+		forward_packet(ctx, packet, len, hdr, hdrlen, src_addr, legacy_only, hop_limit);
+		egress->draining = false;
+		return true;
+	}
+
+	struct egress_class *c = &egress->classes[egress_classify(egress, packet, len)];
+
+	if (c->len == egress->depth) {
+		c->dropped++;
+		return false;
+	}
+
+	struct egress_packet *p = &c->ring[(c->head + c->len) % egress->depth];
+
+	memcpy(p->data, hdr, hdrlen);
+	memcpy(p->data + hdrlen, packet, len);
+	p->hdrlen = hdrlen;
+	p->len = len;
+	p->has_src = src_addr != NULL;
+	if (src_addr)
+		p->src = *src_addr;
+	p->legacy_only = legacy_only;
+	p->hop_limit = hop_limit;
+	p->enqueued = now_us();
+
+	c->len++;
+	c->enqueued++;
+	egress->backlog++;
+
+	if (c->len > c->max_len)
+		c->max_len = c->len;
+
+	return true;
+}
+
+static void egress_send(struct context *ctx, struct egress_class *c, uint64_t now) {
+	egress_ctx *egress = &ctx->egress;
+	struct egress_packet *p = &c->ring[c->head];
+	uint64_t latency = now - p->enqueued;
+
+	c->head = (c->head + 1) % egress->depth;
+	c->len--;
+	c->sent++;
+	c->latency_sum += latency;
+	if (latency > c->latency_max)
+		c->latency_max = latency;
+	egress->backlog--;
+
+	forward_packet(ctx, p->data + p->hdrlen, p->len, (struct header *)p->data, p->hdrlen,
+		       p->has_src ? &p->src : NULL, p->legacy_only, p->hop_limit);
+}
+
+/** Picks the class to send from next, there has to be a backlog */
+static struct egress_class *egress_next(egress_ctx *egress) {
+	if (!egress->weighted) {
+		for (size_t i = 0; ; i++) {
+			if (egress->classes[i].len)
+				return &egress->classes[i];
+		}
+	}
+
+	while (!egress->credit || !egress->classes[egress->current].len) {
+		egress->current = (egress->current + 1) % EGRESS_CLASSES;
+		egress->credit = egress->classes[egress->current].weight;
+	}
+
+	egress->credit--;
+	return &egress->classes[egress->current];
+}
+
+/**
+ * egress_flush - forward the queued packets of this turn of the event loop
+ * @ctx: the mmfd context
+ */
+void egress_flush(struct context *ctx) {
+	egress_ctx *egress = &ctx->egress;
+	uint64_t now = now_us();
+
+	egress->draining = true;
+
+	for (unsigned int budget = EGRESS_BUDGET; budget && egress->backlog; budget--)
+		egress_send(ctx, egress_next(egress), now);
+
+	egress->draining = false;
+}
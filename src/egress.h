@@ -0,0 +1,95 @@
+#pragma once
+
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define EGRESS_CLASSES 3
+#define EGRESS_DEPTH 256     /* packets waiting per class at most */
+#define EGRESS_BUDGET 64     /* packets forwarded per turn of the event loop */
+
+enum egress_class_id {
+	EGRESS_HIGH,
+	EGRESS_NORMAL,
+	EGRESS_LOW,
+};
+
+struct context;
+struct header;
+
+/** A class for the groups under a prefix, overrides the traffic class */
+struct egress_rule {
+	struct in6_addr prefix;
+	uint8_t prefix_len;
+	enum egress_class_id class;
+};
+
+/** A packet waiting to be forwarded */
+struct egress_packet {
+	uint8_t *data;              /**< the mmfd header followed by the packet */
+	uint16_t hdrlen;
+	uint16_t len;               /**< of the packet */
+	struct sockaddr_in6 src;    /**< the neighbour it came from, valid if has_src */
+	bool has_src;
+	bool legacy_only;
+	uint8_t hop_limit;
+	uint64_t enqueued;          /**< microseconds, CLOCK_MONOTONIC */
+};
+
+struct egress_class {
+	struct egress_packet *ring; /**< depth packets */
+	uint8_t *slots;
+	size_t head;
+	size_t len;
+	unsigned int weight;        /**< packets per round with the weighted scheduler */
+
+	size_t max_len;             /**< deepest the queue has been */
+	uint64_t enqueued;
+	uint64_t sent;
+	uint64_t dropped;           /**< packets that found the queue full */
+	uint64_t latency_sum;       /**< microseconds spent queued by the sent packets */
+	uint64_t latency_max;
+};
+
+/**
+ * Priority egress scheduler.
+ *
+ * Instead of being sent right away, packets for the neighbours are sorted
+ * into classes by the DSCP of their traffic class or by group prefix.
+ * At the end of every turn of the event loop up to EGRESS_BUDGET of them
+ * are forwarded, either strictly by priority or round robin with a weight
+ * per class. Packets that do not fit into the budget wait for the next
+ * turn, which comes right away while any are left. Hellos and
+ * retransmissions bypass the queues.
+ */
+typedef struct {
+	bool enabled;
+	bool weighted;              /**< weighted round robin instead of strict priority */
+	bool draining;              /**< forward_packet() is called by the scheduler */
+	size_t depth;
+	size_t slot_size;
+	struct egress_class classes[EGRESS_CLASSES];
+	VECTOR(struct egress_rule) rules;
+	size_t backlog;             /**< packets waiting in all classes */
+	unsigned int current;       /**< class the weighted scheduler serves */
+	unsigned int credit;        /**< packets it may still take from it this round */
+} egress_ctx;
+
+bool egress_configure(egress_ctx *egress, const char *spec);
+bool egress_add_rule(egress_ctx *egress, const char *spec);
+void egress_init(egress_ctx *egress, size_t depth, size_t slot_size);
+bool egress_enqueue(struct context *ctx, uint8_t *packet, size_t len, struct header *hdr, size_t hdrlen,
+		    struct sockaddr_in6 *src_addr, bool legacy_only, uint8_t hop_limit);
+void egress_flush(struct context *ctx);
+const char *egress_class_name(enum egress_class_id class);
+
+static inline bool egress_enabled(egress_ctx *egress) {
+	return egress->enabled;
+}
+
+static inline bool egress_backlog(egress_ctx *egress) {
+	return egress->backlog > 0;
+}
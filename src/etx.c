@@ -0,0 +1,264 @@
+#include "etx.h"
+#include "mmfd.h"
+#include "intercom.h"
+#include "util.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#define ETX_MASK ((1u << ETX_WINDOW) - 1)
+
+void etx_init(etx_ctx *etx) {
+	obtainrandom(&etx->seq, sizeof(etx->seq), 0);
+}
+
+/** True once enough hellos of the neighbour were counted to judge its link */
+bool etx_known(const struct neighbour *neighbour) {
+	return neighbour->etx.measured && neighbour->etx.span + neighbour->etx.missed >= ETX_MIN_HELLOS;
+}
+
+/**
+ * etx_rx - ratio of the hellos of a neighbour that arrived
+ * @neighbour: the neighbour
+ *
+ * Hello intervals without any hello count as lost ones, so a link that
+ * went quiet looks bad before the neighbour times out.
+ *
+ * Return: the ratio of ETX_SCALE, ETX_SCALE if it is not known
+ */
+uint8_t etx_rx(const struct neighbour *neighbour) {
+	const struct etx_link *link = &neighbour->etx;
+
+	if (!etx_known(neighbour))
+		return ETX_SCALE;
+
+	unsigned int span = link->span + link->missed < ETX_WINDOW ? link->span + link->missed : ETX_WINDOW;
+	uint32_t window = link->missed < ETX_WINDOW ? (link->window << link->missed) & ETX_MASK : 0;
+
+	return __builtin_popcount(window) * ETX_SCALE / span;
+}
+
+/** Product of the delivery ratios in both directions, of ETX_SCALE */
+uint8_t etx_quality(const struct neighbour *neighbour) {
+	if (!etx_known(neighbour))
+		return ETX_SCALE;
+
+	return etx_rx(neighbour) * neighbour->etx.tx / ETX_SCALE;
+}
+
+/**
+ * etx_fill - number our hello and add what we know about the links to the listed neighbours
+ * @ctx: the mmfd context
+ * @links: put behind the hello
+ * @neighbours: the neighbours listed in the hello
+ * @count: their number
+ *
+ * A node reached on several interfaces is listed once, with its best link.
+ *
+ * Return: length of @links
+ */
+size_t etx_fill(struct context *ctx, struct hello_links *links, const struct hello_neighbour *neighbours, size_t count) {
+	links->seq = htons(ctx->etx.seq++);
+	memset(links->links, 0, count * sizeof(struct hello_link));
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+			uint32_t id = htonl(neighbour->node_id);
+			size_t k;
+
+			if (!neighbour->has_id)
+				continue;
+
+			for (k = 0; k < count && neighbours[k].node_id != id; k++);
+
+			if (k == count)
+				continue;
+
+			uint8_t rx = etx_rx(neighbour), quality = etx_quality(neighbour);
+
+			if (rx > links->links[k].rx)
+				links->links[k].rx = rx;
+			if (quality > links->links[k].quality)
+				links->links[k].quality = quality;
+		}
+	}
+
+	return sizeof(*links) + count * sizeof(struct hello_link);
+}
+
+/**
+ * etx_read - count a hello of a neighbour and take over the link qualities it advertised
+ * @ctx: the mmfd context
+ * @neighbour: the sender
+ * @neighbours: the neighbours listed in the hello
+ * @count: their number
+ * @buffer: the links behind the groups, NULL if the hello has none
+ * @len: length of @buffer
+ */
+void etx_read(struct context *ctx, struct neighbour *neighbour, const struct hello_neighbour *neighbours, size_t count,
+	      const uint8_t *buffer, size_t len) {
+	const struct hello_links *links = (const struct hello_links *)buffer;
+	struct etx_link *link = &neighbour->etx;
+
+	if (!buffer || len < sizeof(*links) + count * sizeof(struct hello_link)) {
+		if (link->measured || VECTOR_LEN(link->two_hop))
+			ctx->etx.changed = true;
+
+		link->measured = false;
+		link->bypassed = false;
+		VECTOR_RESIZE(link->two_hop, 0);
+		return;
+	}
+
+	uint8_t quality = etx_quality(neighbour);
+
+	uint16_t seq = ntohs(links->seq);
+	uint16_t gap = seq - link->seq;
+
+	// a gap wider than the window means it restarted, it would have
+	// timed out long before losing that many hellos
+	if (!link->measured || gap > ETX_WINDOW) {
+		link->window = 1;
+		link->span = 1;
+	} else if (gap) {
+		link->window = ((link->window << gap) | 1) & ETX_MASK;
+		link->span = link->span + gap < ETX_WINDOW ? link->span + gap : ETX_WINDOW;
+	}
+
+	link->measured = true;
+	link->heard = true;
+	link->missed = 0;
+	link->seq = seq;
+	link->tx = 0;
+
+	if (VECTOR_LEN(link->two_hop) != count)
+		ctx->etx.changed = true;
+
+	VECTOR_RESIZE(link->two_hop, count);
+
+	for (size_t i = 0; i < count; i++) {
+		if (VECTOR_INDEX(link->two_hop, i) != links->links[i].quality)
+			ctx->etx.changed = true;
+
+		VECTOR_INDEX(link->two_hop, i) = links->links[i].quality;
+
+		if (ntohl(neighbours[i].node_id) == ctx->origin_id)
+			link->tx = links->links[i].rx;
+	}
+
+	if (etx_quality(neighbour) != quality)
+		ctx->etx.changed = true;
+}
+
+/**
+ * etx_age - count a hello interval
+ * @ctx: the mmfd context
+ *
+ * Called once per HELLO_INTERVAL, neighbours that did not send a hello
+ * since the last call missed one. Bypassed links are decided again if a
+ * quality changed since the last call, rather than on every hello.
+ */
+void etx_age(struct context *ctx) {
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct etx_link *link = &VECTOR_INDEX(iface->neighbours, j)->etx;
+
+			if (!link->heard && link->measured) {
+				link->missed++;
+				ctx->etx.changed = true;
+			}
+			link->heard = false;
+		}
+	}
+
+	if (ctx->etx.changed)
+		etx_update(ctx);
+}
+
+/** True if a neighbour other than @poor has a good link to us and to the node of @poor */
+static bool etx_better_path(struct context *ctx, const struct neighbour *poor) {
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+
+			// with mpr only our relays pass our packets on
+			if (!neighbour->has_id || neighbour->node_id == poor->node_id || (ctx->mpr && !neighbour->mpr) ||
+			    !etx_known(neighbour) || etx_quality(neighbour) < ctx->etx.threshold)
+				continue;
+
+			for (size_t k = 0; k < VECTOR_LEN(neighbour->etx.two_hop) && k < VECTOR_LEN(neighbour->two_hop); k++) {
+				if (VECTOR_INDEX(neighbour->two_hop, k) == poor->node_id &&
+				    VECTOR_INDEX(neighbour->etx.two_hop, k) >= ctx->etx.threshold)
+					return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+/**
+ * etx_update - decide again which neighbours are bypassed
+ * @ctx: the mmfd context
+ *
+ * The neighbour with the better path judges its own link by the quality it
+ * advertises, so it never bypasses the node itself because of us.
+ */
+void etx_update(struct context *ctx) {
+	if (!etx_enabled(&ctx->etx))
+		return;
+
+	ctx->etx.changed = false;
+	ctx->etx.bypassing = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+			bool bypassed = neighbour->has_id && etx_known(neighbour) &&
+					etx_quality(neighbour) < ctx->etx.threshold && etx_better_path(ctx, neighbour);
+
+			if (bypassed != neighbour->etx.bypassed)
+				log_verbose("%s link to %s%%%s, quality %u of %u\n", bypassed ? "bypassing" : "using",
+					    print_ip(&neighbour->address.sin6_addr), neighbour->ifname,
+					    etx_quality(neighbour), ETX_SCALE);
+
+			neighbour->etx.bypassed = bypassed;
+			ctx->etx.bypassing += bypassed;
+		}
+	}
+}
+
+/**
+ * etx_forget - account for a neighbour that is gone
+ * @ctx: the mmfd context
+ *
+ * It may have been the better path to a bypassed neighbour, so those get
+ * copies again until the next etx_age() decides anew.
+ */
+void etx_forget(struct context *ctx) {
+	if (!etx_enabled(&ctx->etx))
+		return;
+
+	ctx->etx.changed = true;
+
+	if (!ctx->etx.bypassing)
+		return;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++)
+			VECTOR_INDEX(iface->neighbours, j)->etx.bypassed = false;
+	}
+
+	ctx->etx.bypassing = 0;
+}
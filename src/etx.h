@@ -0,0 +1,76 @@
+#pragma once
+
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ETX_WINDOW 16         /* hellos a delivery ratio is measured over */
+#define ETX_MIN_HELLOS 3      /* hellos needed before a link is judged */
+#define ETX_SCALE 255         /* a delivery ratio of 1 */
+
+struct context;
+struct neighbour;
+struct hello_neighbour;
+
+/* Delivery ratios of the link to a neighbour as the sender of a hello sees it */
+struct __attribute__((__packed__)) hello_link {
+	uint8_t rx;       /**< ratio of the hellos of the neighbour the sender receives */
+	uint8_t quality;  /**< rx times the ratio of its own hellos the neighbour receives */
+};
+
+/* Follows the groups of a hello with HELLO_LINKS in its flags, or the neighbours if there are none */
+struct __attribute__((__packed__)) hello_links {
+	uint16_t seq;                /**< counts the hellos of the sender, network byte order */
+	struct hello_link links[];   /**< one per neighbour listed in the hello */
+};
+
+/** What a neighbour's hellos tell about the link to it */
+struct etx_link {
+	bool measured;           /**< it numbers its hellos */
+	bool heard;              /**< a hello arrived since the last etx_age() */
+	uint16_t seq;            /**< of its last hello */
+	uint32_t window;         /**< bit i is set if hello seq - i arrived */
+	unsigned int span;       /**< hellos the window covers, up to ETX_WINDOW */
+	unsigned int missed;     /**< hello intervals that passed without one */
+	uint8_t tx;              /**< ratio of our hellos it receives */
+	VECTOR(uint8_t) two_hop; /**< its quality to each node in neighbour->two_hop */
+	bool bypassed;           /**< its link is poor and another neighbour reaches it well */
+};
+
+/**
+ * Link quality from hello sequence numbers.
+ *
+ * Every hello carries a sequence number, so the receiver learns which
+ * share of the last ETX_WINDOW hellos of a neighbour arrived. It sends
+ * that ratio back in its own hellos, which gives the sender the ratio in
+ * the other direction, and the expected transmission count of the link
+ * is one over their product. With -x a neighbour whose quality is below
+ * the threshold gets no copies of forwarded packets as long as another
+ * neighbour with a good link advertises a good link to it. That is
+ * decided again once per hello interval, if any quality changed.
+ */
+typedef struct {
+	bool enabled;
+	uint8_t threshold;    /**< quality below which a link is bypassed, of ETX_SCALE */
+	uint16_t seq;         /**< of our next hello */
+	bool changed;         /**< a link quality changed since the last etx_update() */
+	size_t bypassing;     /**< neighbours bypassed by the last etx_update() */
+	uint64_t bypassed;    /**< copies not sent over poor links */
+} etx_ctx;
+
+void etx_init(etx_ctx *etx);
+size_t etx_fill(struct context *ctx, struct hello_links *links, const struct hello_neighbour *neighbours, size_t count);
+void etx_read(struct context *ctx, struct neighbour *neighbour, const struct hello_neighbour *neighbours, size_t count,
+	      const uint8_t *buffer, size_t len);
+void etx_age(struct context *ctx);
+void etx_update(struct context *ctx);
+void etx_forget(struct context *ctx);
+bool etx_known(const struct neighbour *neighbour);
+uint8_t etx_rx(const struct neighbour *neighbour);
+uint8_t etx_quality(const struct neighbour *neighbour);
+
+static inline bool etx_enabled(etx_ctx *etx) {
+	return etx->enabled;
+}
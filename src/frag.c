@@ -0,0 +1,233 @@
+#include "frag.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "timespec.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* The counters of worker threads are read by the main thread */
+#define FRAG_COUNT(frag, field, n) __atomic_store_n(&(frag)->field, (frag)->field + (n), __ATOMIC_RELAXED)
+
+/** Prepares a context, ids start at a random value */
+void frag_init(frag_ctx *frag) {
+	memset(frag, 0, sizeof(*frag));
+	obtainrandom(&frag->next_id, sizeof(frag->next_id), 0);
+}
+
+/**
+ * frag_split - split a datagram up into fragments
+ * @frag: the context
+ * @iov: the datagram
+ * @iovlen: number of elements in @iov
+ * @room: largest datagram the link takes
+ *
+ * The fragments are in frag->iovs, each one made of two elements. They
+ * stay valid until the next call.
+ *
+ * Return: number of fragments, 0 if the datagram cannot be split up
+ */
+unsigned int frag_split(frag_ctx *frag, const struct iovec *iov, size_t iovlen, size_t room) {
+	size_t total = 0;
+
+	for (size_t i = 0; i < iovlen; i++)
+		total += iov[i].iov_len;
+
+	if (room <= sizeof(struct frag_header) || total > FRAG_MAX_DATAGRAM)
+		return 0;
+
+	size_t piece = room - sizeof(struct frag_header);
+	size_t count = (total + piece - 1) / piece;
+
+	if (count > FRAG_MAX_FRAGMENTS)
+		return 0;
+
+	if (!frag->scratch)
+		frag->scratch = mmfd_alloc(FRAG_MAX_DATAGRAM);
+
+	size_t offset = 0;
+
+	for (size_t i = 0; i < iovlen; i++) {
+		memcpy(frag->scratch + offset, iov[i].iov_base, iov[i].iov_len);
+		offset += iov[i].iov_len;
+	}
+
+	uint32_t id = htonl(frag->next_id++);
+
+	for (size_t i = 0; i < count; i++) {
+		offset = i * piece;
+
+		frag->headers[i] = (struct frag_header){
+			.nonce = FRAG_MAGIC,
+			.id = id,
+			.offset = htons(offset),
+			.total = htons(total),
+			.index = i,
+			.count = count,
+		};
+
+		frag->iovs[i][0] = (struct iovec){
+			.iov_base = &frag->headers[i],
+			.iov_len = sizeof(struct frag_header),
+		};
+		frag->iovs[i][1] = (struct iovec){
+			.iov_base = frag->scratch + offset,
+			.iov_len = total - offset < piece ? total - offset : piece,
+		};
+	}
+
+	FRAG_COUNT(frag, fragmented, 1);
+	FRAG_COUNT(frag, fragments_tx, count);
+
+	return count;
+}
+
+static void frag_free(struct frag_entry *entry) {
+	free(entry->data);
+	entry->data = NULL;
+}
+
+/**
+ * frag_expire - give up on datagrams that did not arrive in time
+ * @frag: the context
+ */
+void frag_expire(frag_ctx *frag) {
+	uint64_t now = monotonic_ms();
+
+	for (size_t i = 0; i < FRAG_REASSEMBLIES; i++) {
+		struct frag_entry *entry = &frag->entries[i];
+
+		if (entry->data && now - entry->started > FRAG_TIMEOUT) {
+			frag_free(entry);
+			FRAG_COUNT(frag, timeouts, 1);
+		}
+	}
+}
+
+static bool same_source(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+	return a->sin6_scope_id == b->sin6_scope_id && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+/** Finds the entry of a datagram or takes a free one, or else the oldest */
+static struct frag_entry *frag_lookup(frag_ctx *frag, const struct sockaddr_in6 *src, uint32_t id, uint16_t total, uint8_t count) {
+	struct frag_entry *oldest = NULL, *free_entry = NULL;
+
+	for (size_t i = 0; i < FRAG_REASSEMBLIES; i++) {
+		struct frag_entry *entry = &frag->entries[i];
+
+		if (!entry->data) {
+			if (!free_entry)
+				free_entry = entry;
+			continue;
+		}
+
+		if (entry->id == id && entry->total == total && entry->count == count && same_source(&entry->src, src))
+			return entry;
+
+		if (!oldest || entry->started < oldest->started)
+			oldest = entry;
+	}
+
+	struct frag_entry *entry = free_entry;
+
+	if (!entry) {
+		entry = oldest;
+		frag_free(entry);
+		FRAG_COUNT(frag, evicted, 1);
+	}
+
+	*entry = (struct frag_entry){
+		.src = *src,
+		.id = id,
+		.total = total,
+		.count = count,
+		.started = monotonic_ms(),
+		.data = mmfd_alloc(total),
+	};
+
+	return entry;
+}
+
+/**
+ * frag_input - take a fragment received from a neighbour
+ * @frag: the context
+ * @src: the neighbour
+ * @buf: the fragment
+ * @len: its length
+ * @datagram_len: set to the length of the reassembled datagram
+ *
+ * Return: the reassembled datagram, valid until the next call, or NULL
+ * while fragments are missing
+ */
+uint8_t *frag_input(frag_ctx *frag, const struct sockaddr_in6 *src, const uint8_t *buf, size_t len, size_t *datagram_len) {
+	struct frag_header fh;
+
+	free(frag->done);
+	frag->done = NULL;
+
+	FRAG_COUNT(frag, fragments_rx, 1);
+	frag_expire(frag);
+
+	if (len < sizeof(fh)) {
+		FRAG_COUNT(frag, invalid, 1);
+		return NULL;
+	}
+
+	memcpy(&fh, buf, sizeof(fh));
+
+	size_t offset = ntohs(fh.offset);
+	size_t total = ntohs(fh.total);
+	size_t piece = len - sizeof(fh);
+
+	if (!fh.count || fh.count > FRAG_MAX_FRAGMENTS || fh.index >= fh.count ||
+	    total < sizeof(uint64_t) || offset + piece > total) {
+		FRAG_COUNT(frag, invalid, 1);
+		return NULL;
+	}
+
+	bool last = fh.index == fh.count - 1;
+
+	// the pieces have to cover the datagram exactly, the buffer it is
+	// put together in is not cleared
+	if (last ? offset + piece != total : !piece || offset != fh.index * piece || (fh.count - 1) * piece >= total) {
+		FRAG_COUNT(frag, invalid, 1);
+		return NULL;
+	}
+
+	struct frag_entry *entry = frag_lookup(frag, src, ntohl(fh.id), total, fh.count);
+	uint64_t bit = 1ull << fh.index;
+
+	if (entry->received & bit)
+		return NULL;
+
+	if (!last && entry->piece && entry->piece != piece) {
+		FRAG_COUNT(frag, invalid, 1);
+		return NULL;
+	}
+
+	memcpy(entry->data + offset, buf + sizeof(fh), piece);
+	entry->received |= bit;
+
+	if (last)
+		entry->last_offset = offset;
+	else
+		entry->piece = piece;
+
+	if (entry->received != (fh.count == 64 ? ~0ull : (1ull << fh.count) - 1))
+		return NULL;
+
+	if (entry->last_offset != (fh.count - 1) * entry->piece) {
+		frag_free(entry);
+		FRAG_COUNT(frag, invalid, 1);
+		return NULL;
+	}
+
+	FRAG_COUNT(frag, reassembled, 1);
+
+	frag->done = entry->data;
+	entry->data = NULL;
+	*datagram_len = total;
+
+	return frag->done;
+}
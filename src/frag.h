@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#define FRAG_MAX_FRAGMENTS 64
+#define FRAG_MAX_DATAGRAM 65535
+#define FRAG_REASSEMBLIES 32       /* datagrams reassembled at the same time */
+#define FRAG_TIMEOUT 1000          /* milliseconds */
+
+/* A datagram that is too big for a link is sent as fragments. Each one is
+ * a frag_header followed by a piece of the datagram, which is put back
+ * together and handled as if it had been received in one piece. All pieces
+ * but the last are of the same length and at index times that length, the
+ * last one ends at total. */
+struct __attribute__((__packed__)) frag_header {
+	uint64_t nonce;    /**< FRAG_MAGIC */
+	uint32_t id;       /**< network byte order */
+	uint16_t offset;   /**< of the piece in the datagram, network byte order */
+	uint16_t total;    /**< length of the datagram, network byte order */
+	uint8_t index;
+	uint8_t count;
+};
+
+/** A datagram being reassembled */
+struct frag_entry {
+	struct sockaddr_in6 src;
+	uint32_t id;
+	uint16_t total;
+	uint8_t count;
+	uint16_t piece;     /**< length of every fragment but the last, 0 until one arrived */
+	uint16_t last_offset;
+	uint64_t received;  /**< bitmap of the fragments that arrived */
+	uint64_t started;   /**< monotonic_ms() of the first fragment */
+	uint8_t *data;      /**< NULL if the entry is free */
+};
+
+/**
+ * Fragmentation below the link MTU.
+ *
+ * Every thread that sends or receives data has its own context. The
+ * reassembly table is bounded to FRAG_REASSEMBLIES datagrams, the oldest
+ * one makes room for a new one and incomplete datagrams are given up
+ * after FRAG_TIMEOUT.
+ */
+typedef struct {
+	uint32_t next_id;
+	uint8_t *scratch;                            /**< the datagram being split up */
+	struct frag_header headers[FRAG_MAX_FRAGMENTS];
+	struct iovec iovs[FRAG_MAX_FRAGMENTS][2];    /**< header and piece of each fragment */
+
+	struct frag_entry entries[FRAG_REASSEMBLIES];
+	uint8_t *done;                               /**< last reassembled datagram */
+
+	uint64_t fragmented;    /**< datagrams split up */
+	uint64_t fragments_tx;
+	uint64_t fragments_rx;
+	uint64_t reassembled;
+	uint64_t timeouts;
+	uint64_t evicted;       /**< incomplete datagrams dropped for a new one */
+	uint64_t invalid;
+} frag_ctx;
+
+void frag_init(frag_ctx *frag);
+unsigned int frag_split(frag_ctx *frag, const struct iovec *iov, size_t iovlen, size_t room);
+uint8_t *frag_input(frag_ctx *frag, const struct sockaddr_in6 *src, const uint8_t *buf, size_t len, size_t *datagram_len);
+void frag_expire(frag_ctx *frag);
@@ -0,0 +1,168 @@
+#include "gossip.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static size_t gossip_bucket(gossip_ctx *gossip, uint64_t key) {
+	return hash64(key ^ gossip->seed) & gossip->mask;
+}
+
+static void gossip_resize(gossip_ctx *gossip, size_t buckets) {
+	struct gossip_pending **old = gossip->buckets;
+	size_t old_buckets = old ? gossip->mask + 1 : 0;
+
+	gossip->buckets = mmfd_new0_array(buckets, struct gossip_pending *);
+	gossip->mask = buckets - 1;
+
+	for (size_t i = 0; i < old_buckets; i++) {
+		struct gossip_pending *next;
+		for (struct gossip_pending *p = old[i]; p; p = next) {
+			next = p->next;
+
+			size_t b = gossip_bucket(gossip, p->key);
+			p->next = gossip->buckets[b];
+			gossip->buckets[b] = p;
+		}
+	}
+
+	free(old);
+}
+
+static struct gossip_pending *gossip_find(gossip_ctx *gossip, uint64_t key) {
+	for (struct gossip_pending *p = gossip->buckets[gossip_bucket(gossip, key)]; p; p = p->next) {
+		if (p->key == key)
+			return p;
+	}
+
+	return NULL;
+}
+
+/**
+ * gossip_init - set up counter-based flooding
+ * @gossip: the context to initialize
+ * @threshold: number of copies that cancel a relay, 0 disables it
+ * @jitter_min: shortest relay delay in milliseconds
+ * @jitter_max: longest relay delay in milliseconds
+ */
+void gossip_init(gossip_ctx *gossip, unsigned int threshold, unsigned int jitter_min, unsigned int jitter_max) {
+	memset(gossip, 0, sizeof(*gossip));
+	obtainrandom(&gossip->seed, sizeof(gossip->seed), 0);
+
+	gossip->threshold = threshold;
+	gossip->jitter_min = jitter_min;
+	gossip->jitter_max = jitter_max < jitter_min ? jitter_min : jitter_max;
+
+	gossip_resize(gossip, GOSSIP_MIN_BUCKETS);
+}
+
+static void gossip_relay_task(void *d) {
+	struct gossip_pending *p = d;
+
+	if (p->cancelled)
+		return;
+
+	forward_packet(&ctx, p->data + p->hdrlen, p->len, (struct header *)p->data, p->hdrlen, &p->src, false, p->hop_limit);
+
+	if (p->hdrlen == sizeof(struct header))
+		dupfilter_add(&ctx.dupfilter, ((struct header *)p->data)->nonce);
+}
+
+/** Unhashes and frees a pending packet once its timer has run */
+static void gossip_free(void *d) {
+	struct gossip_pending *p = d;
+	gossip_ctx *gossip = &ctx.gossip;
+
+	for (struct gossip_pending **n = &gossip->buckets[gossip_bucket(gossip, p->key)]; *n; n = &(*n)->next) {
+		if (*n == p) {
+			*n = p->next;
+			gossip->len--;
+			break;
+		}
+	}
+
+	free(p);
+}
+
+/**
+ * gossip_schedule - relay a packet after a random delay
+ * @ctx: the mmfd context
+ * @key: identifies the packet, the nonce or origin id and sequence number
+ * @hdr: the mmfd header of the packet
+ * @hdrlen: length of the mmfd header
+ * @packet: the IPv6 packet
+ * @len: length of the packet
+ * @src_addr: the neighbour the packet came from
+ * @hop_limit: passed on to forward_packet()
+ *
+ * The packet is copied, so the caller may reuse its buffers right away.
+ */
+void gossip_schedule(struct context *ctx, uint64_t key, struct header *hdr, size_t hdrlen,
+		     uint8_t *packet, size_t len, struct sockaddr_in6 *src_addr, uint8_t hop_limit) {
+	gossip_ctx *gossip = &ctx->gossip;
+
+	if (gossip_find(gossip, key))
+		return;
+
+	struct gossip_pending *p = mmfd_alloc0(sizeof(*p) + hdrlen + len);
+
+	p->key = key;
+	p->src = *src_addr;
+	p->hop_limit = hop_limit;
+	p->hdrlen = hdrlen;
+	p->len = len;
+	memcpy(p->data, hdr, hdrlen);
+	memcpy(p->data + hdrlen, packet, len);
+
+	if (gossip->len >= gossip->mask + 1)
+		gossip_resize(gossip, (gossip->mask + 1) * 2);
+
+	size_t b = gossip_bucket(gossip, key);
+	p->next = gossip->buckets[b];
+	gossip->buckets[b] = p;
+	gossip->len++;
+	gossip->scheduled++;
+
+	long delay = gossip->jitter_min + rand() % (gossip->jitter_max - gossip->jitter_min + 1);
+
+	// the task is never dropped, a cancelled relay just does nothing when
+	// its timer runs, so no pointer to the task has to be kept
+	post_task(&ctx->taskqueue_ctx, 0, delay, gossip_relay_task, gossip_free, p);
+}
+
+static bool same_neighbour(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+	return a->sin6_scope_id == b->sin6_scope_id && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+/**
+ * gossip_heard - count a copy of a packet that arrived from a neighbour
+ * @ctx: the mmfd context
+ * @key: identifies the packet
+ * @src_addr: the neighbour, each one is only counted once
+ */
+void gossip_heard(struct context *ctx, uint64_t key, struct sockaddr_in6 *src_addr) {
+	gossip_ctx *gossip = &ctx->gossip;
+
+	if (!gossip_enabled(gossip))
+		return;
+
+	struct gossip_pending *p = gossip_find(gossip, key);
+
+	if (!p || p->cancelled || same_neighbour(&p->src, src_addr))
+		return;
+
+	for (unsigned int i = 0; i < p->heard; i++) {
+		if (same_neighbour(&p->heard_from[i], src_addr))
+			return;
+	}
+
+	p->heard_from[p->heard] = *src_addr;
+
+	if (++p->heard >= gossip->threshold) {
+		log_verbose("cancelling relay of " FMT_NONCE ", heard it %u times\n", key, p->heard);
+		p->cancelled = true;
+		gossip->cancelled++;
+	}
+}
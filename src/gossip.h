@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define GOSSIP_MIN_BUCKETS 64
+#define GOSSIP_JITTER_MIN 1   /* milliseconds */
+#define GOSSIP_JITTER_MAX 20  /* milliseconds */
+#define GOSSIP_MAX_THRESHOLD 8
+
+struct context;
+struct header;
+
+/** A received packet waiting for its relay timer */
+struct gossip_pending {
+	uint64_t key;                /**< nonce or origin id and sequence number */
+	struct gossip_pending *next; /**< next packet in the same hash bucket */
+	struct sockaddr_in6 src;     /**< the neighbour the packet came from */
+	unsigned int heard;          /**< other neighbours a copy arrived from while waiting */
+	struct sockaddr_in6 heard_from[GOSSIP_MAX_THRESHOLD];
+	bool cancelled;
+	uint8_t hop_limit;           /**< to forward the packet with */
+	size_t hdrlen;
+	size_t len;                  /**< length of the packet behind the header */
+	uint8_t data[];              /**< mmfd header followed by the packet */
+};
+
+/**
+ * Counter-based flooding.
+ *
+ * Instead of relaying a new packet right away it is held back for a random
+ * delay between jitter_min and jitter_max milliseconds. Every neighbour a
+ * copy is heard from meanwhile is counted, and once threshold neighbours
+ * sent one the neighbourhood is assumed to be covered and the relay is
+ * cancelled. The nonce only goes to the kernel duplicate filter once the
+ * packet was relayed, so it does not hide the copies that are counted.
+ */
+typedef struct {
+	struct gossip_pending **buckets;
+	size_t mask;           /**< number of buckets - 1 */
+	size_t len;
+	uint64_t seed;
+	unsigned int threshold; /**< copies that cancel a relay, 0 disables counter-based flooding */
+	unsigned int jitter_min;
+	unsigned int jitter_max;
+
+	uint64_t scheduled;
+	uint64_t cancelled;
+} gossip_ctx;
+
+void gossip_init(gossip_ctx *gossip, unsigned int threshold, unsigned int jitter_min, unsigned int jitter_max);
+void gossip_schedule(struct context *ctx, uint64_t key, struct header *hdr, size_t hdrlen,
+		     uint8_t *packet, size_t len, struct sockaddr_in6 *src_addr, uint8_t hop_limit);
+void gossip_heard(struct context *ctx, uint64_t key, struct sockaddr_in6 *src_addr);
+
+static inline bool gossip_enabled(gossip_ctx *gossip) {
+	return gossip->threshold > 0;
+}
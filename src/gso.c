@@ -0,0 +1,202 @@
+#include "gso.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <netinet/udp.h>
+
+/**
+ * gso_probe - enable UDP GSO and GRO on the socket of an interface
+ * @iface: the interface
+ *
+ * Kernels that do not know the options leave the interface on one datagram
+ * per send and per read. GRO stays off with the eBPF duplicate filter,
+ * which only sees the first of the merged datagrams.
+ */
+void gso_probe(interface *iface) {
+	int off = 0, on = 1;
+
+	bool want_gro = ctx.offload && !dupfilter_enabled(&ctx.dupfilter);
+
+	iface->gso = iface->gro = false;
+
+	if (ctx.offload) {
+		if (setsockopt(iface->unicastfd, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0)
+			iface->gso = true;
+		else
+			log_error("UDP GSO not available on %s: %s\n", iface->ifname, strerror(errno));
+	}
+
+	if (setsockopt(iface->unicastfd, SOL_UDP, UDP_GRO, want_gro ? &on : &off, sizeof(on)) == 0)
+		iface->gro = want_gro;
+	else if (want_gro)
+		log_error("UDP GRO not available on %s: %s\n", iface->ifname, strerror(errno));
+}
+
+/** Sends the queued datagrams of a neighbour one by one */
+static void gso_send_single(struct context *ctx, interface *iface, struct neighbour *neighbour) {
+	struct mmsghdr msgs[GSO_MAX_SEGMENTS];
+	struct iovec iovs[GSO_MAX_SEGMENTS];
+	unsigned int n = 0;
+
+	for (size_t offset = 0; offset < neighbour->gso_len; offset += neighbour->gso_size, n++) {
+		size_t len = neighbour->gso_len - offset;
+
+		iovs[n] = (struct iovec){
+			.iov_base = neighbour->gso + offset,
+			.iov_len = len < neighbour->gso_size ? len : neighbour->gso_size,
+		};
+
+		msgs[n] = (struct mmsghdr){
+			.msg_hdr = {
+				.msg_name = &neighbour->address,
+				.msg_namelen = sizeof(struct sockaddr_in6),
+				.msg_iov = &iovs[n],
+				.msg_iovlen = 1,
+			},
+		};
+	}
+
+	send_batch(ctx, iface, msgs, n);
+}
+
+/**
+ * gso_flush_neighbour - send the datagrams queued for a neighbour
+ * @ctx: the mmfd context
+ * @iface: the interface the neighbour is reachable on
+ * @neighbour: the neighbour
+ *
+ * Anything sent to the neighbour right away must go after its train, or
+ * it would overtake the datagrams queued before it.
+ */
+void gso_flush_neighbour(struct context *ctx, interface *iface, struct neighbour *neighbour) {
+	if (!neighbour->gso_segments)
+		return;
+
+	if (neighbour->gso_segments == 1 || !iface->gso) {
+		gso_send_single(ctx, iface, neighbour);
+		goto out;
+	}
+
+	uint8_t control[CMSG_SPACE(sizeof(uint16_t))] = {};
+	struct iovec iov = {
+		.iov_base = neighbour->gso,
+		.iov_len = neighbour->gso_len,
+	};
+	struct msghdr message = {
+		.msg_name = &neighbour->address,
+		.msg_namelen = sizeof(struct sockaddr_in6),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_UDP;
+	cmsg->cmsg_type = UDP_SEGMENT;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+	memcpy(CMSG_DATA(cmsg), &neighbour->gso_size, sizeof(uint16_t));
+
+	ctx->stats.data_tx_syscalls++;
+
+	if (sendmsg(iface->unicastfd, &message, 0) < 0) {
+		// EIO means the device cannot checksum the segments
+		if (errno == EIO || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+			log_error("UDP GSO failed on %s, sending datagrams one by one from now on: %s\n", iface->ifname, strerror(errno));
+			iface->gso = false;
+		}
+
+		gso_send_single(ctx, iface, neighbour);
+		goto out;
+	}
+
+	ctx->stats.data_tx += neighbour->gso_segments;
+	ctx->stats.gso_sends++;
+	ctx->stats.gso_segments += neighbour->gso_segments;
+
+out:
+	neighbour->gso_len = 0;
+	neighbour->gso_segments = 0;
+}
+
+/**
+ * gso_flush - send everything that was queued for segmentation offload
+ * @ctx: the mmfd context
+ */
+void gso_flush(struct context *ctx) {
+	if (!ctx->gso_pending)
+		return;
+
+	ctx->gso_pending = false;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++)
+			gso_flush_neighbour(ctx, iface, VECTOR_INDEX(iface->neighbours, j));
+	}
+}
+
+/**
+ * gso_add - queue a datagram for a neighbour
+ * @ctx: the mmfd context
+ * @iface: the interface the neighbour is reachable on
+ * @neighbour: the neighbour
+ * @iov: the header and the packet
+ *
+ * All segments but the last of one send must have the same size, so a
+ * datagram that is bigger than the queued ones or follows a shorter one
+ * starts a new train.
+ *
+ * Return: true if the datagram was queued, false if it has to be sent the
+ * usual way
+ */
+bool gso_add(struct context *ctx, interface *iface, struct neighbour *neighbour, struct iovec *iov) {
+	size_t len = iov[0].iov_len + iov[1].iov_len;
+
+	if (!iface->gso || len > UINT16_MAX)
+		return false;
+
+	if (neighbour->gso_segments &&
+	    (len > neighbour->gso_size ||
+	     neighbour->gso_len % neighbour->gso_size ||
+	     neighbour->gso_segments == GSO_MAX_SEGMENTS ||
+	     neighbour->gso_len + len > GSO_MAX_BYTES))
+		gso_flush_neighbour(ctx, iface, neighbour);
+
+	if (!neighbour->gso)
+		neighbour->gso = mmfd_alloc(GSO_MAX_BYTES);
+
+	if (!neighbour->gso_segments)
+		neighbour->gso_size = len;
+
+	memcpy(neighbour->gso + neighbour->gso_len, iov[0].iov_base, iov[0].iov_len);
+	memcpy(neighbour->gso + neighbour->gso_len + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+	neighbour->gso_len += len;
+	neighbour->gso_segments++;
+	ctx->gso_pending = true;
+
+	return true;
+}
+
+/**
+ * gro_segment_size - size of the datagrams the kernel merged into one read
+ * @message: the received message
+ *
+ * Return: the segment size, 0 if the read holds a single datagram
+ */
+uint16_t gro_segment_size(struct msghdr *message) {
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+		if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+			int size;
+
+			memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+			return size;
+		}
+	}
+
+	return 0;
+}
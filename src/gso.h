@@ -0,0 +1,23 @@
+#pragma once
+
+#include "mmfd.h"
+
+#define GSO_MAX_SEGMENTS 64
+#define GSO_MAX_BYTES 60000
+#define GRO_BUFFER_SIZE 65535
+
+/**
+ * UDP segmentation offload.
+ *
+ * Datagrams of the same size that go to the same neighbour during one turn
+ * of the event loop are handed to the kernel with a single sendmsg() and a
+ * UDP_SEGMENT control message, which splits them up again as late as
+ * possible. On the receiving side UDP_GRO lets the kernel merge datagrams
+ * of one flow into a single large read.
+ */
+
+void gso_probe(interface *iface);
+bool gso_add(struct context *ctx, interface *iface, struct neighbour *neighbour, struct iovec *iov);
+void gso_flush_neighbour(struct context *ctx, interface *iface, struct neighbour *neighbour);
+void gso_flush(struct context *ctx);
+uint16_t gro_segment_size(struct msghdr *message);
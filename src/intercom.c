@@ -4,33 +4,216 @@
 #include "mmfd.h"
 #include "alloc.h"
 #include "util.h"
+#include "neighbour.h"
+#include "mpr.h"
+#include "gso.h"
 
 #include <search.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 
 #define INTERCOM_GROUP "ff02::6a8b"
 
-void intercom_send_packet_allif(struct context *ctx, uint8_t *packet, ssize_t packet_len);
+void intercom_send_packet(struct context *ctx, interface *iface, uint8_t *packet, ssize_t packet_len);
 
 int assemble_header(intercom_packet_hello *packet) {
 	obtainrandom(&packet->hdr.nonce, sizeof(packet->hdr.nonce), 0);
 	return sizeof(packet->hdr);
 }
 
+/**
+ * hello_room - how many neighbours a hello may list
+ *
+ * Every node receives into buffers of at least RX_BUFFER_SIZE, a hello
+ * that does not fit is cut off and dropped by the receiver.
+ */
+static size_t hello_room(void) {
+	size_t fixed = sizeof(intercom_packet_hello) + sizeof(struct hello_links);
+
+	if (mld_enabled(&ctx.mld))
+		fixed += sizeof(struct hello_groups) + MLD_LEVELS * MLD_FILTER_SIZE;
+
+	size_t room = (RX_BUFFER_SIZE - fixed) / (sizeof(struct hello_neighbour) + sizeof(struct hello_link));
+
+	return room < HELLO_MAX_NEIGHBOURS ? room : HELLO_MAX_NEIGHBOURS;
+}
+
+/**
+ * assemble_neighbours - list every neighbour that sent us its node id once
+ * @packet: the hello, with room for HELLO_MAX_NEIGHBOURS neighbours
+ *
+ * Our relays go first and are flagged, so they still learn that they were
+ * selected when there are more neighbours than fit into a hello.
+ */
+static size_t assemble_neighbours(intercom_packet_hello *packet) {
+	size_t count = 0, room = hello_room();
+
+	for (int relays = 1; relays >= 0; relays--) {
+		for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+			interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+			for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+				struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+				uint32_t id = htonl(neighbour->node_id);
+				size_t k;
+
+				if (!neighbour->has_id || (relays && !neighbour->mpr))
+					continue;
+
+				for (k = 0; k < count && packet->neighbours[k].node_id != id; k++);
+
+				if (k == count) {
+					if (count == room)
+						continue;
+
+					packet->neighbours[count++] = (struct hello_neighbour){ .node_id = id };
+				}
+
+				if (neighbour->mpr)
+					packet->neighbours[k].flags |= HELLO_NEIGHBOUR_MPR;
+			}
+		}
+	}
+
+	return count;
+}
+
 bool intercom_send_hello() {
+	if (ctx.mpr)
+		mpr_select(&ctx);
 
-	intercom_packet_hello *packet = mmfd_alloc(sizeof(struct header));
+	intercom_packet_hello *packet = mmfd_alloc(sizeof(*packet) + HELLO_MAX_NEIGHBOURS * sizeof(struct hello_neighbour) +
+						   sizeof(struct hello_groups) + MLD_LEVELS * MLD_FILTER_SIZE +
+						   sizeof(struct hello_links) + HELLO_MAX_NEIGHBOURS * sizeof(struct hello_link));
 
 	int currentoffset = assemble_header(packet);
-	VECTOR_ADD(ctx.seen, packet->hdr.nonce);
+	seen_add(&ctx.hello_seen, packet->hdr.nonce);
+
+	size_t count = assemble_neighbours(packet);
+	packet->type = INTERCOM_HELLO;
+	packet->flags = (ctx.mpr ? HELLO_SELECTS_RELAYS : 0) | (mld_enabled(&ctx.mld) ? HELLO_GROUPS : 0) | HELLO_VERSIONED | HELLO_LINKS;
+	packet->count = htons(count);
+	packet->node_id = htonl(ctx.origin_id);
+	currentoffset += sizeof(*packet) - sizeof(packet->hdr) + count * sizeof(struct hello_neighbour);
+
+	// the filters differ per interface, everything else is shared
+	struct hello_groups *groups = (struct hello_groups *)((uint8_t *)packet + currentoffset);
+
+	if (mld_enabled(&ctx.mld))
+		currentoffset += sizeof(*groups) + MLD_LEVELS * MLD_FILTER_SIZE;
+
+	currentoffset += etx_fill(&ctx, (struct hello_links *)((uint8_t *)packet + currentoffset), packet->neighbours, count);
 	log_verbose("sending hello " FMT_NONCE "\n", packet->hdr.nonce);
 
-	intercom_send_packet_allif(&ctx, (uint8_t *)packet, currentoffset);
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		if (mld_enabled(&ctx.mld))
+			mld_fill(&ctx, iface, groups);
+
+		intercom_send_packet(&ctx, iface, (uint8_t *)packet, currentoffset);
+	}
 
 	free(packet);
 	return true;
 }
 
+/**
+ * intercom_is_hello - tell hellos apart from data sent to the intercom group
+ * @buffer: the datagram
+ * @len: length of the datagram
+ *
+ * Bundles, fragments, NACKs, versioned and sequenced data are marked by
+ * their nonce, other data carries an IPv6 packet right behind the nonce.
+ */
+bool intercom_is_hello(const uint8_t *buffer, size_t len) {
+	const struct header *hdr = (const struct header *)buffer;
+
+	if (hdr->nonce == SEQ_MAGIC || hdr->nonce == BUNDLE_MAGIC || hdr->nonce == FRAG_MAGIC ||
+	    hdr->nonce == NACK_MAGIC || hdr->nonce == VERSIONED_MAGIC)
+		return false;
+
+	return len == sizeof(*hdr) || (buffer[sizeof(*hdr)] >> 4) != 6;
+}
+
+/** Takes over the node id and the neighbours a neighbour advertised */
+static void read_neighbours(struct context *ctx, struct neighbour *neighbour, const intercom_packet_hello *packet, size_t len) {
+	neighbour->mpr_selector = false;
+
+	if (len < sizeof(*packet) || packet->type != INTERCOM_HELLO) {
+		neighbour->has_id = neighbour->selects_relays = neighbour->versioned = false;
+		VECTOR_RESIZE(neighbour->two_hop, 0);
+		mld_read(&ctx->mld, neighbour, NULL, 0);
+		etx_read(ctx, neighbour, NULL, 0, NULL, 0);
+		return;
+	}
+
+	size_t count = ntohs(packet->count);
+
+	if (count > (len - sizeof(*packet)) / sizeof(struct hello_neighbour))
+		count = (len - sizeof(*packet)) / sizeof(struct hello_neighbour);
+
+	size_t offset = sizeof(*packet) + count * sizeof(struct hello_neighbour);
+
+	if (packet->flags & HELLO_GROUPS) {
+		const struct hello_groups *groups = (const struct hello_groups *)((const uint8_t *)packet + offset);
+
+		mld_read(&ctx->mld, neighbour, (const uint8_t *)groups, len - offset);
+		offset = offset < len ? offset + sizeof(*groups) + groups->levels * MLD_FILTER_SIZE : len;
+	} else {
+		mld_read(&ctx->mld, neighbour, NULL, 0);
+	}
+
+	if ((packet->flags & HELLO_LINKS) && offset < len)
+		etx_read(ctx, neighbour, packet->neighbours, count, (const uint8_t *)packet + offset, len - offset);
+	else
+		etx_read(ctx, neighbour, packet->neighbours, count, NULL, 0);
+
+	neighbour->node_id = ntohl(packet->node_id);
+	neighbour->has_id = true;
+	neighbour->selects_relays = packet->flags & HELLO_SELECTS_RELAYS;
+	neighbour->versioned = packet->flags & HELLO_VERSIONED;
+
+	VECTOR_RESIZE(neighbour->two_hop, count);
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t id = ntohl(packet->neighbours[i].node_id);
+
+		VECTOR_INDEX(neighbour->two_hop, i) = id;
+		if (id == ctx->origin_id && (packet->neighbours[i].flags & HELLO_NEIGHBOUR_MPR))
+			neighbour->mpr_selector = true;
+	}
+}
+
+/**
+ * intercom_handle_hello - process a hello received on the intercom group
+ * @ctx: the mmfd context
+ * @src_addr: address of the sender
+ * @buffer: the hello
+ * @len: length of the hello
+ * @ifindex: index of the interface the hello arrived on
+ *
+ * Hellos have their own small replay cache so they never displace data
+ * nonces from the duplicate cache.
+ */
+void intercom_handle_hello(struct context *ctx, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t len, unsigned int ifindex) {
+	struct header *hdr = (struct header *)buffer;
+
+	ctx->stats.hello_rx++;
+
+	if (!seen_add(&ctx->hello_seen, hdr->nonce)) {
+		ctx->stats.hello_duplicates++;
+		return;
+	}
+
+	log_verbose("received hello " FMT_NONCE " from %s\n", hdr->nonce, print_ip(&src_addr->sin6_addr));
+
+	struct neighbour *neighbour = neighbour_change(ctx, &src_addr->sin6_addr, ifindex);
+
+	if (neighbour)
+		read_neighbours(ctx, neighbour, (intercom_packet_hello *)buffer, len);
+}
+
 bool leave_mcast(const struct in6_addr addr, interface *iface) {
 
 	if (!iface || !iface->ifindex)
@@ -58,6 +241,16 @@ interface *find_interface_by_name(const char *ifname) {
 	return ret;
 }
 
+interface *find_interface_by_index(unsigned int ifindex) {
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+		if (iface->ifindex > 0 && (unsigned int)iface->ifindex == ifindex)
+			return iface;
+	}
+
+	return NULL;
+}
+
 bool join_mcast(const struct in6_addr addr, interface *iface) {
 	struct ipv6_mreq mreq = {};
 
@@ -79,11 +272,28 @@ bool join_mcast(const struct in6_addr addr, interface *iface) {
 }
 
 
+bool if_set_mcast_threshold(char *ifname, size_t threshold) {
+	interface *iface = find_interface_by_name(ifname);
+
+	if (!iface)
+		return false;
+
+	iface->mcast_threshold = threshold;
+	ctx.workers.dirty = true;
+	return true;
+}
+
 bool if_del(char *ifname) {
 	if (VECTOR_LEN(ctx.interfaces)) {
 		for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
 			interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
 			if (!strcmp(ifname, iface->ifname)) {
+				flush_neighbours(&ctx, iface);
+				VECTOR_FREE(iface->neighbours);
+				if (iface->worker_fds)
+					workers_del_interface(&ctx.workers, iface);
+				if (uring_enabled(&ctx.uring))
+					uring_unwatch_socket(&ctx.uring, iface->unicastfd);
 				if (iface->ok)
 					close(iface->unicastfd);
 				VECTOR_DELETE(ctx.interfaces, i);
@@ -98,6 +308,75 @@ int if_compare_by_name(const interface *a, const interface *b) {
 	return strncmp(a->ifname, b->ifname, IFNAMSIZ);
 }
 
+/** Returns the MTU of an interface, or the IPv6 minimum if it cannot be read */
+static int if_mtu(interface *iface) {
+	struct ifreq ifr = {};
+
+	strncpy(ifr.ifr_name, iface->ifname, IFNAMSIZ - 1);
+
+	if (ioctl(iface->unicastfd, SIOCGIFMTU, &ifr) < 0)
+		return 1280;
+
+	return ifr.ifr_mtu;
+}
+
+/**
+ * path_mtu - path MTU towards a destination
+ * @fd: an unconnected UDP socket
+ * @dst: the destination, sin6_scope_id set to the interface
+ * @mtu: returned if the path MTU cannot be read
+ *
+ * Connecting lets the kernel look up the route including the path MTU it
+ * learnt from packet too big messages, which IPV6_MTU then returns.
+ */
+static int path_mtu(int fd, const struct sockaddr_in6 *dst, int mtu) {
+	int path = 0;
+	socklen_t len = sizeof(path);
+
+	if (connect(fd, (const struct sockaddr *)dst, sizeof(*dst)) < 0 ||
+	    getsockopt(fd, IPPROTO_IPV6, IPV6_MTU, &path, &len) < 0 || path < 1280)
+		return mtu;
+
+	return path < mtu ? path : mtu;
+}
+
+/**
+ * if_update_mtu - read the path MTU of an interface again
+ * @iface: the interface
+ *
+ * Takes the smallest of the device MTU and the path MTU towards the intercom
+ * group and every neighbour on the interface, so datagrams are split up to
+ * fit the narrowest of them. Called periodically, so the MTU grows again once
+ * the kernel forgets a learnt path MTU, and whenever a datagram was too big.
+ */
+void if_update_mtu(interface *iface) {
+	int mtu = if_mtu(iface);
+	int fd = socket(PF_INET6, SOCK_DGRAM, 0);
+
+	if (fd >= 0) {
+		struct sockaddr_in6 group = ctx.groupaddr;
+
+		group.sin6_scope_id = iface->ifindex;
+		mtu = path_mtu(fd, &group, mtu);
+
+		for (size_t i = 0; i < VECTOR_LEN(iface->neighbours); i++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, i);
+
+			// a connected socket is connected again to the next one
+			mtu = path_mtu(fd, &neighbour->address, mtu);
+		}
+
+		close(fd);
+	}
+
+	if (mtu == iface->mtu)
+		return;
+
+	log_verbose("MTU of %s changed from %d to %d\n", iface->ifname, iface->mtu, mtu);
+	iface->mtu = mtu;
+	ctx.workers.dirty = true;
+}
+
 int socket_prepare(interface *iface) {
 	int fd = socket(PF_INET6, SOCK_DGRAM | SOCK_NONBLOCK, 0);
 	if (fd < 0) exit_error("creating socket");
@@ -113,11 +392,27 @@ int socket_prepare(interface *iface) {
 		exit_error("error on setsockopt (BIND) in socket_prepare()");
 	}
 
+	// the sockets of the worker threads share the port
+	if (workers_enabled(&ctx.workers) && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+		exit_error("error on setsockopt (SO_REUSEPORT)");
+
+	// datagrams that are too big fail with EMSGSIZE and are split up by
+	// us, intercom_send_packet() lifts this for the hellos
+	if (ctx.fragment && setsockopt(fd, IPPROTO_IPV6, IPV6_DONTFRAG, &on, sizeof(on)))
+		exit_error("error on setsockopt (IPV6_DONTFRAG)");
+
+	// do not receive our own hellos and multicast data
+	int off = 0;
+	if (setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &off, sizeof(off)))
+		exit_error("error on setsockopt (IPV6_MULTICAST_LOOP)");
+
 	return fd;
 }
 
 void udp_open(interface *iface) {
 	iface->unicastfd = socket_prepare(iface);
+	dupfilter_attach(&ctx.dupfilter, iface->unicastfd);
+	gso_probe(iface);
 
 	struct sockaddr_in6 server_addr = {};
 	server_addr.sin6_family = AF_INET6;
@@ -132,7 +427,7 @@ void udp_open(interface *iface) {
 
 
 bool if_add(char *ifname) {
-	interface iface;
+	interface iface = {};
 
 	strncpy(iface.ifname, ifname, IFNAMSIZ);
 
@@ -142,28 +437,63 @@ bool if_add(char *ifname) {
 
 	iface.ifindex = if_nametoindex(ifname);
 	iface.ok=false;
+	iface.mcast_threshold = ctx.mcast_threshold;
+	VECTOR_INIT(iface.neighbours);
 
 	if (iface.ifindex) {
 		udp_open(&iface);
-		change_fd(ctx.efd, iface.unicastfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+		iface.mtu = if_mtu(&iface);
+		if (uring_enabled(&ctx.uring))
+			uring_watch_socket(&ctx.uring, iface.unicastfd);
+		else
+			change_fd(ctx.efd, iface.unicastfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
 		VECTOR_ADD(ctx.interfaces, iface);
+		if (workers_enabled(&ctx.workers))
+			workers_add_interface(&ctx.workers, &VECTOR_INDEX(ctx.interfaces, VECTOR_LEN(ctx.interfaces) - 1));
 		return true;
 	}
 
 	return false;
 }
 
+/** Returns true if fd is bound to the interface with index ifindex */
+static bool bound_to(int fd, int ifindex) {
+	int bound;
+	socklen_t len = sizeof(bound);
+
+	return getsockopt(fd, SOL_SOCKET, SO_BINDTOIFINDEX, &bound, &len) == 0 && bound == ifindex;
+}
+
 void intercom_update_interfaces(struct context *ctx) {
 	if (VECTOR_LEN(ctx->interfaces)) {
 		for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
 			interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+			int ifindex = if_nametoindex(iface->ifname);
+
+			// neighbours are keyed by the index they were seen on,
+			// and the sockets of the workers are bound to it
+			if (ifindex != iface->ifindex) {
+				log_verbose("index of %s changed from %d to %d, forgetting its neighbours\n", iface->ifname, iface->ifindex, ifindex);
+				flush_neighbours(ctx, iface);
+				iface->ifindex = ifindex;
 
-			iface->ifindex = if_nametoindex(iface->ifname);
+				if (iface->worker_fds)
+					workers_del_interface(&ctx->workers, iface);
+				if (ifindex && workers_enabled(&ctx->workers))
+					workers_add_interface(&ctx->workers, iface);
+
+				ctx->workers.dirty = true;
+			}
 
 			if (iface->ifindex) {
 				iface->ok = join_mcast(ctx->groupaddr.sin6_addr, iface);
+				if_update_mtu(iface);
 
-				if (setsockopt(iface->unicastfd, SOL_SOCKET, SO_BINDTODEVICE, iface->ifname,
+				// binding again takes the socket out of its
+				// SO_REUSEPORT group, so only do it if the
+				// interface was recreated
+				if (!bound_to(iface->unicastfd, iface->ifindex) &&
+				    setsockopt(iface->unicastfd, SOL_SOCKET, SO_BINDTODEVICE, iface->ifname,
 							strnlen(iface->ifname, IFNAMSIZ))) {
 					exit_error("error on setsockopt (BIND) in intercom_update_interfaces()");
 				}
@@ -172,16 +502,39 @@ void intercom_update_interfaces(struct context *ctx) {
 	}
 }
 
-void intercom_send_packet_allif(struct context *ctx, uint8_t *packet, ssize_t packet_len) {
-	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
-		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
-		ctx->groupaddr.sin6_scope_id = iface->ifindex;
-		ssize_t rc = sendto(iface->unicastfd, packet, packet_len, 0, (struct sockaddr*)&ctx->groupaddr, sizeof(struct sockaddr_in6));
-		if (rc < 0)
-			perror("sendto");
-		log_debug("sent intercom packet on %s to %s rc: %zi\n", iface->ifname, print_ip(&ctx->groupaddr.sin6_addr), rc);
-	}
-	ctx->groupaddr.sin6_scope_id = 0;
+void intercom_send_packet(struct context *ctx, interface *iface, uint8_t *packet, ssize_t packet_len) {
+	struct sockaddr_in6 group = ctx->groupaddr;
+	group.sin6_scope_id = iface->ifindex;
+
+	// the socket refuses datagrams bigger than the link with -F, but
+	// hellos are not split up by us, so the kernel may fragment them
+	uint8_t control[CMSG_SPACE(sizeof(int))] = {};
+	struct iovec iov = {
+		.iov_base = packet,
+		.iov_len = packet_len,
+	};
+	struct msghdr message = {
+		.msg_name = &group,
+		.msg_namelen = sizeof(group),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+	int dontfrag = 0;
+
+	cmsg->cmsg_level = IPPROTO_IPV6;
+	cmsg->cmsg_type = IPV6_DONTFRAG;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(dontfrag));
+	memcpy(CMSG_DATA(cmsg), &dontfrag, sizeof(dontfrag));
+
+	ssize_t rc = sendmsg(iface->unicastfd, &message, 0);
+	if (rc < 0)
+		perror("sendto");
+	else
+		ctx->stats.hello_tx++;
+	log_debug("sent intercom packet on %s to %s rc: %zi\n", iface->ifname, print_ip(&group.sin6_addr), rc);
 }
 
 void intercom_init(struct context *ctx) {
@@ -3,17 +3,43 @@
 #include "mmfd.h"
 #define MMFD_PACKET_FORMAT_VERSION 1
 
+#define INTERCOM_HELLO 0x01
+#define HELLO_MAX_NEIGHBOURS 256
+
+#define HELLO_SELECTS_RELAYS 0x01 /* the sender only lets its relays forward its packets */
+#define HELLO_GROUPS 0x02         /* struct hello_groups follows the neighbours */
+#define HELLO_VERSIONED 0x04      /* the sender understands the versioned header */
+#define HELLO_LINKS 0x08          /* struct hello_links follows the groups */
+#define HELLO_NEIGHBOUR_MPR 0x01  /* the sender selected this neighbour as relay */
+
+struct __attribute__((__packed__)) hello_neighbour {
+	uint32_t node_id; /**< network byte order */
+	uint8_t flags;
+};
+
+/* Older versions send the bare header, which still counts as a hello */
 typedef struct __attribute__((__packed__)) {
 	struct header hdr;
+	uint8_t type;      /**< INTERCOM_HELLO, never looks like the version nibble of IPv6 data */
+	uint8_t flags;
+	uint16_t count;    /**< number of neighbours, network byte order */
+	uint32_t node_id;  /**< origin id of the sender, network byte order */
+	struct hello_neighbour neighbours[];
 } intercom_packet_hello;
 
 bool intercom_send_hello();
+bool intercom_is_hello(const uint8_t *buffer, size_t len);
+void intercom_handle_hello(struct context *ctx, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t len, unsigned int ifindex);
 void intercom_init(struct context *ctx);
 bool if_add(char *ifname);
 bool if_del(char *ifname);
+bool if_set_mcast_threshold(char *ifname, size_t threshold);
 void intercom_update_interfaces(struct context *ctx);
+void if_update_mtu(interface *iface);
 interface *find_interface_by_name(const char *ifname);
+interface *find_interface_by_index(unsigned int ifindex);
 bool join_mcast(const struct in6_addr addr, interface *iface);
+int socket_prepare(interface *iface);
 void udp_open(interface *iface);
 
 
@@ -5,6 +5,9 @@
 #include "neighbour.h"
 #include "taskqueue.h"
 #include "intercom.h"
+#include "mpr.h"
+#include "bundle.h"
+#include "gso.h"
 
 #include <linux/ipv6.h>
 #include <stdint.h>
@@ -20,13 +23,14 @@
 #include <sys/timerfd.h>
 
 #define NEIGHBOUR_PRINT_INTERVAL 5
-#define MTU 1280
+#define EXPIRE_INTERVAL 5
+#define MTU_INTERVAL 10
 
-static void handle_udp_packet(struct context *ctx,  struct sockaddr_in6 *src_addr, struct header *hdr, uint8_t *packet, ssize_t len);
-bool is_seen(uint64_t nonce);
+static void handle_udp_packet(struct context *ctx,  struct sockaddr_in6 *src_addr, struct header *hdr, size_t hdrlen, uint8_t *packet, ssize_t len, uint64_t key, bool relay, uint8_t hop_limit);
 struct context ctx = {};
 
 void send_hello_task(__attribute__ ((unused)) void *d) {
+	etx_age(&ctx);
 	intercom_send_hello();
 
 	post_task(&ctx.taskqueue_ctx, HELLO_INTERVAL, 0, send_hello_task, NULL, NULL);
@@ -38,15 +42,38 @@ void print_neighbours_task(__attribute__ ((unused)) void *d) {
 	post_task(&ctx.taskqueue_ctx, NEIGHBOUR_PRINT_INTERVAL, 0, print_neighbours_task, NULL, NULL);
 }
 
+void expire_task(__attribute__ ((unused)) void *d) {
+	seen_expire(&ctx.seen);
+	if (workers_enabled(&ctx.workers))
+		workers_expire(&ctx.workers);
+	seen_expire(&ctx.hello_seen);
+	origin_expire(&ctx.origins);
+	if (ctx.mpr)
+		seen_expire(&ctx.relayed);
+	frag_expire(&ctx.frag);
+	post_task(&ctx.taskqueue_ctx, EXPIRE_INTERVAL, 0, expire_task, NULL, NULL);
+}
+
+void mtu_task(__attribute__ ((unused)) void *d) {
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		if (iface->ifindex)
+			if_update_mtu(iface);
+	}
+	post_task(&ctx.taskqueue_ctx, MTU_INTERVAL, 0, mtu_task, NULL, NULL);
+}
+
 /**
  * tun_open - open a tun device, set mtu and return it
  * @ifname: name of the interface to open
  * @mtu: mtu to assign to the device
  * @dev_name: path to the tun device node (normally this should be "/dev/net/tun")
+ * @flags: further IFF_* flags, IFF_MULTI_QUEUE lets tun_open_queue() add queues
  *
  * Return: filedescriptor to tun device on success, otherwise -1
  */
-int tun_open(const char *ifname, uint16_t mtu, const char *dev_name) {
+int tun_open(const char *ifname, uint16_t mtu, const char *dev_name, int flags) {
 	int ctl_sock = -1;
 	struct ifreq ifr = {};
 
@@ -59,7 +86,7 @@ int tun_open(const char *ifname, uint16_t mtu, const char *dev_name) {
 	if (ifname)
 		strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
 
-	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | flags;
 
 	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
 		puts("unable to open TUN/TAP interface: TUNSETIFF ioctl failed");
@@ -103,34 +130,129 @@ error:
 	return -1;
 }
 
-bool is_seen(uint64_t nonce) {
+/**
+ * tun_open_queue - open another queue of a multiqueue tun device
+ * @ifname: name of the device opened with tun_open()
+ * @dev_name: path to the tun device node
+ * @flags: the flags given to tun_open()
+ *
+ * Return: filedescriptor of the queue on success, otherwise -1
+ */
+int tun_open_queue(const char *ifname, const char *dev_name, int flags) {
+	struct ifreq ifr = {};
+
+	int fd = open(dev_name, O_RDWR|O_NONBLOCK);
+	if (fd < 0)
+		return -1;
 
-	while (VECTOR_LEN(ctx.seen) > 2000)
-		VECTOR_DELETE(ctx.seen, 0);
+	strncpy(ifr.ifr_name, ifname, IFNAMSIZ-1);
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI | IFF_MULTI_QUEUE | flags;
 
-	for (size_t i = VECTOR_LEN(ctx.seen) -1; i < VECTOR_LEN(ctx.seen); i--) {
-		// if we have seen a packet, it is more likely for it to be at
-		// the end of the vector, starting comparison at the back for
-		// performance gain.
-		log_debug("checking whether we have seen packet " FMT_NONCE ", comparing with " FMT_NONCE "\n", nonce, VECTOR_INDEX(ctx.seen, i));
-		if (VECTOR_INDEX(ctx.seen, i) == nonce) {
-			log_verbose("we already saw nonce " FMT_NONCE "\n", nonce);
-			return true;
+	if (ioctl(fd, TUNSETIFF, &ifr) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/**
+ * send_batch - send prepared messages on the socket of an interface
+ * @ctx: the mmfd context
+ * @iface: the interface to send on
+ * @msgs: the messages
+ * @n: number of messages
+ *
+ * A destination that cannot be sent to is reported and skipped, the
+ * remaining messages are still sent.
+ */
+void send_batch(struct context *ctx, interface *iface, struct mmsghdr *msgs, unsigned int n) {
+	unsigned int done = 0;
+
+	// queued sends are counted when they complete
+	if (uring_enabled(&ctx->uring))
+		done = uring_send(&ctx->uring, iface->unicastfd, msgs, n);
+
+	while (done < n) {
+		int rc = sendmmsg(iface->unicastfd, &msgs[done], n - done, 0);
+		ctx->stats.data_tx_syscalls++;
+
+		if (rc < 0) {
+			struct sockaddr_in6 *dst = msgs[done].msg_hdr.msg_name;
+			log_error("sendmmsg on interface %s (%s): %s\n", iface->ifname, print_ip(&dst->sin6_addr), strerror(errno));
+			ctx->stats.data_tx_errors++;
+
+			// the link shrank, later datagrams are split up to fit
+			if (errno == EMSGSIZE) {
+				ctx->stats.tx_too_big++;
+				if_update_mtu(iface);
+			}
+			done++;
+			continue;
 		}
+
+		ctx->stats.data_tx += rc;
+		done += rc;
 	}
-	return false;
 }
 
-bool forward_packet(struct context *ctx, uint8_t *packet, ssize_t len, uint64_t nonce, struct sockaddr_in6 *src_addr) {
+/** True if every neighbour on the interface understands the versioned header */
+static bool interface_versioned(interface *iface) {
+	for (size_t i = 0; i < VECTOR_LEN(iface->neighbours); i++) {
+		if (!VECTOR_INDEX(iface->neighbours, i)->versioned)
+			return false;
+	}
 
-	struct header hdr = {
-		.nonce = nonce,
-	};
+	return true;
+}
+
+/**
+ * fill_messages - prepare the messages that carry a datagram to one destination
+ * @ctx: the mmfd context
+ * @msgs: room for the messages
+ * @dst: the destination
+ * @iov: the header and the packet
+ * @fragments: number of fragments frag_split() made of them, 0 to send them in one piece
+ *
+ * Return: number of messages
+ */
+static unsigned int fill_messages(struct context *ctx, struct mmsghdr *msgs, struct sockaddr_in6 *dst, struct iovec *iov, unsigned int fragments) {
+	unsigned int n = fragments ? fragments : 1;
+
+	for (unsigned int i = 0; i < n; i++) {
+		msgs[i] = (struct mmsghdr){
+			.msg_hdr = {
+				.msg_name = dst,
+				.msg_namelen = sizeof(struct sockaddr_in6),
+				.msg_iov = fragments ? ctx->frag.iovs[i] : iov,
+				.msg_iovlen = 2,
+			},
+		};
+	}
+
+	return n;
+}
+
+/**
+ * forward_packet - send a packet to the neighbours
+ * @ctx: the mmfd context
+ * @packet: the IPv6 packet
+ * @len: length of the packet
+ * @hdr: the mmfd header to put in front of the packet
+ * @hdrlen: length of the mmfd header
+ * @src_addr: the neighbour the packet came from, NULL for local packets
+ * @legacy_only: only send to neighbours that do not take part in relay selection
+ * @hop_limit: hops the packet may still travel, 0 if it may not be forwarded
+ *
+ * Return: false if there is no neighbour to send to
+ */
+bool forward_packet(struct context *ctx, uint8_t *packet, ssize_t len, struct header *hdr, size_t hdrlen, struct sockaddr_in6 *src_addr, bool legacy_only, uint8_t hop_limit) {
+	uint64_t nonce = hdr->nonce;
 
 	struct iovec iov[2] = {
 		{
-			.iov_base = &hdr,
-			.iov_len = sizeof(hdr),
+			.iov_base = hdr,
+			.iov_len = hdrlen,
 		},
 		{
 			.iov_base = packet,
@@ -140,125 +262,538 @@ bool forward_packet(struct context *ctx, uint8_t *packet, ssize_t len, uint64_t
 
 	struct ipv6hdr *packethdr = (struct ipv6hdr*)packet;
 
-	if (VECTOR_LEN(ctx->neighbours) == 0) {
+	if (!hop_limit) {
+		log_verbose("Hop limit of packet with destaddr=%s, nonce=" FMT_NONCE " is used up. Not forwarding it.\n", print_ip(&packethdr->daddr), nonce);
+		ctx->stats.hop_limit_exceeded++;
+		return false;
+	}
+
+	if (ctx->neighbours.len == 0) {
 		log_verbose("No neighbour found. Cannot forward packet with destaddr=%s, nonce=" FMT_NONCE ".\n", print_ip(&packethdr->daddr), nonce);
 		return false;
 	}
 
-	for (size_t i = 0; i < VECTOR_LEN(ctx->neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx->neighbours, i);
+	// the scheduler calls us again once it is the turn of the packet
+	if (egress_enabled(&ctx->egress) && !ctx->egress.draining)
+		return egress_enqueue(ctx, packet, len, hdr, hdrlen, src_addr, legacy_only, hop_limit);
 
-		int forwardmessage =  src_addr ?
-					memcmp(&src_addr->sin6_addr, &(neighbour->address.sin6_addr), sizeof(struct in6_addr)) ||
-					src_addr->sin6_scope_id != neighbour->address.sin6_scope_id
-				      : 1;
+	struct neighbour *src = src_addr ? neighbour_find(ctx, &src_addr->sin6_addr, src_addr->sin6_scope_id) : NULL;
+	bool prune = mld_enabled(&ctx->mld) && !mld_flooded(&packethdr->daddr);
+	bool wanted = false;
 
-		if (forwardmessage) {
-			struct msghdr msg = {
-				.msg_name = &neighbour->address,
-				.msg_namelen = sizeof(struct sockaddr_in6),
-				.msg_iov = iov,
-				.msg_iovlen = 2,
-			};
+	if (mld_enabled(&ctx->mld) && !prune)
+		ctx->mld.flooded++;
+
+	struct versioned_header vh;
+	struct iovec viov[2] = { iov[0], iov[1] };
+
+	if (ctx->versioned) {
+		viov[0].iov_base = &vh;
+		viov[0].iov_len = versioned_wrap(&vh, hdr, hdrlen, hop_limit);
+	}
+
+	// build one batch of messages per interface so the fan-out costs one
+	// syscall per interface rather than one per neighbour
+	for (size_t j = 0; j < VECTOR_LEN(ctx->interfaces); j++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, j);
+		unsigned int n = 0;
+		size_t recipients = VECTOR_LEN(iface->neighbours);
+		bool wrapped = ctx->versioned && interface_versioned(iface);
+		// neighbours that get the bare header start over with their own hop limit
+		uint8_t reach = wrapped ? hop_limit : UINT8_MAX;
+
+		if (src && src->address.sin6_scope_id == (uint32_t)iface->ifindex)
+			recipients--;
+
+		// neighbours without listeners behind them and those reached
+		// better through another neighbour do not count
+		if (prune || etx_enabled(&ctx->etx)) {
+			for (size_t i = 0; i < VECTOR_LEN(iface->neighbours); i++) {
+				struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, i);
+
+				if (neighbour == src)
+					continue;
+
+				if (prune && !mld_wants(neighbour, &packethdr->daddr, reach)) {
+					recipients--;
+					ctx->mld.pruned++;
+				} else if (neighbour->etx.bypassed) {
+					recipients--;
+					ctx->etx.bypassed++;
+				}
+			}
+		}
+
+		if (recipients)
+			wanted = true;
+		else if (prune || etx_enabled(&ctx->etx))
+			continue;
+
+		// a single neighbour that only knows the bare header gets it on
+		// the whole interface, which keeps multicast and bundles simple
+		struct iovec *out = wrapped ? viov : iov;
+
+		if (out == viov && recipients)
+			ctx->stats.versioned_tx++;
+
+		unsigned int fragments = 0;
+		size_t room = iface->mtu > DATAGRAM_OVERHEAD ? iface->mtu - DATAGRAM_OVERHEAD : 0;
+
+		if (ctx->fragment && recipients && out[0].iov_len + len > room) {
+			fragments = frag_split(&ctx->frag, out, 2, room);
+
+			if (!fragments) {
+				log_error("Packet with nonce " FMT_NONCE " cannot be split up for %s. Skipping interface.\n", nonce, iface->ifname);
+				continue;
+			}
+		}
+
+		// on a shared medium with many neighbours one multicast frame
+		// replaces a unicast copy per neighbour
+		if (!legacy_only && iface->mcast_threshold && recipients >= iface->mcast_threshold) {
+			struct sockaddr_in6 group = ctx->groupaddr;
+			group.sin6_scope_id = iface->ifindex;
+
+			// the multicast copy must not overtake datagrams still queued for GSO
+			for (size_t i = 0; ctx->gso_pending && i < VECTOR_LEN(iface->neighbours); i++)
+				gso_flush_neighbour(ctx, iface, VECTOR_INDEX(iface->neighbours, i));
 
-			log_verbose("Forwarding packet from %s with destaddr=%s, nonce=" FMT_NONCE " to %s%%%s [%zd].\n",
+			VECTOR_RESIZE(ctx->fanout, fragments ? fragments : 1);
+			n = fill_messages(ctx, &VECTOR_INDEX(ctx->fanout, 0), &group, out, fragments);
+
+			log_verbose("Forwarding packet from %s with destaddr=%s, nonce=" FMT_NONCE " to %zu neighbours on %s via multicast.\n",
 				    src_addr ? print_ip(&src_addr->sin6_addr) : "local", print_ip(&packethdr->daddr), nonce,
-				    print_ip(&neighbour->address.sin6_addr), neighbour->ifname, neighbour->address.sin6_scope_id);
+				    recipients, iface->ifname);
+			send_batch(ctx, iface, &VECTOR_INDEX(ctx->fanout, 0), n);
+			ctx->stats.data_tx_mcast++;
+			continue;
+		}
 
+		VECTOR_RESIZE(ctx->fanout, VECTOR_LEN(iface->neighbours) * (fragments ? fragments : 1));
 
-			if (sendmsg(find_interface_by_name(neighbour->ifname)->unicastfd, &msg, 0) < 0)
-				log_error("sendmsg on interface %s (%s): %s", neighbour->ifname, print_ip(&neighbour->address.sin6_addr),  strerror(errno) );
+		for (size_t i = 0; i < VECTOR_LEN(iface->neighbours); i++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, i);
+
+			// neighbours without a node id never learn that we
+			// are not their relay, so they always get a copy
+			if (neighbour != src && !(legacy_only && neighbour->has_id) &&
+			    !(prune && !mld_wants(neighbour, &packethdr->daddr, reach)) && !neighbour->etx.bypassed) {
+				if (!fragments && ctx->aggregation_us && bundle_add(ctx, iface, neighbour, out)) {
+					log_verbose("Queueing packet from %s with destaddr=%s, nonce=" FMT_NONCE " for %s%%%s.\n",
+						    src_addr ? print_ip(&src_addr->sin6_addr) : "local", print_ip(&packethdr->daddr), nonce,
+						    print_ip(&neighbour->address.sin6_addr), neighbour->ifname);
+					continue;
+				}
+
+				if (!fragments && gso_add(ctx, iface, neighbour, out))
+					continue;
+
+				gso_flush_neighbour(ctx, iface, neighbour);
+				n += fill_messages(ctx, &VECTOR_INDEX(ctx->fanout, n), &neighbour->address, out, fragments);
+
+				log_verbose("Forwarding packet from %s with destaddr=%s, nonce=" FMT_NONCE " to %s%%%s [%zd].\n",
+					    src_addr ? print_ip(&src_addr->sin6_addr) : "local", print_ip(&packethdr->daddr), nonce,
+					    print_ip(&neighbour->address.sin6_addr), neighbour->ifname, neighbour->address.sin6_scope_id);
+			}
 		}
+
+		send_batch(ctx, iface, &VECTOR_INDEX(ctx->fanout, 0), n);
 	}
 
+	if (prune && !wanted)
+		ctx->mld.unwanted++;
+
 	return true;
 }
 
+/** Forwards a packet from a neighbour, after a random delay with counter-based flooding */
+static void relay_packet(struct context *ctx, struct sockaddr_in6 *src_addr, struct header *hdr, size_t hdrlen, uint8_t *packet, ssize_t len, uint64_t key, uint8_t hop_limit) {
+	if (gossip_enabled(&ctx->gossip))
+		gossip_schedule(ctx, key, hdr, hdrlen, packet, len, src_addr, hop_limit);
+	else
+		forward_packet(ctx, packet, len, hdr, hdrlen, src_addr, false, hop_limit);
+}
+
+static struct in6_pktinfo *get_pktinfo(struct msghdr *message) {
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(message); cmsg != NULL; cmsg = CMSG_NXTHDR(message, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)
+			return (struct in6_pktinfo *)CMSG_DATA(cmsg);
+	}
+
+	return NULL;
+}
+
+/**
+ * rx_batch_init - preallocate everything recvmmsg() needs
+ * @batch: the batch to set up
+ * @size: number of datagrams to receive per syscall
+ * @buffer_size: size of the buffer for each datagram
+ */
+void rx_batch_init(struct rx_batch *batch, size_t size, size_t buffer_size) {
+	batch->size = size;
+	batch->buffer_size = buffer_size;
+	batch->msgs = mmfd_new0_array(size, struct mmsghdr);
+	batch->iovs = mmfd_new0_array(size, struct iovec);
+	batch->addrs = mmfd_new0_array(size, struct sockaddr_in6);
+	batch->buffers = mmfd_alloc(size * buffer_size);
+	batch->control = mmfd_alloc0_array(size, RX_CONTROL_SIZE);
+}
+
+static void udp_handle_data(struct context *ctx, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t count);
+
+/** Hands every packet in a bundle to udp_handle_data() */
+static void udp_handle_bundle(struct context *ctx, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t count) {
+	size_t offset = sizeof(struct header);
+
+	ctx->stats.bundles_rx++;
+
+	while (offset + sizeof(struct bundle_entry) <= count) {
+		struct bundle_entry *entry = (struct bundle_entry *)(buffer + offset);
+		size_t len = ntohs(entry->len);
+
+		offset += sizeof(*entry) + len;
+
+		if (offset > count) {
+			log_error("Received truncated bundle. Skipping the rest of it.\n");
+			return;
+		}
+
+		if (len >= sizeof(struct header) && ((struct header *)entry->data)->nonce == BUNDLE_MAGIC) {
+			log_error("Received nested bundle. Skipping packet.\n");
+			continue;
+		}
+
+		ctx->stats.bundled_rx++;
+		udp_handle_data(ctx, src_addr, entry->data, len);
+	}
+}
+
+static void udp_handle_datagram(struct context *ctx, struct msghdr *message, uint8_t *buffer, ssize_t count) {
+	struct sockaddr_in6 *src_addr = message->msg_name;
+	struct header *hdr = (struct header *)buffer;
+
+	if ((size_t)count < sizeof(*hdr)) {
+		log_error("Received packet that is smaller than header size. Skipping packet. This should not happen.\n");
+		return;
+	}
+
+	if (message->msg_flags & MSG_TRUNC) {
+		log_error("Message too long for buffer\n");
+		ctx->stats.rx_truncated++;
+		return;
+	}
+
+	struct in6_pktinfo *pi = get_pktinfo(message);
+
+	if (!pi)
+		return;
+
+	// hellos are classified before any data processing so
+	// they never touch the data duplicate cache
+	if (!memcmp(&pi->ipi6_addr, &ctx->groupaddr.sin6_addr, sizeof(ctx->groupaddr.sin6_addr)) && intercom_is_hello(buffer, count)) {
+		intercom_handle_hello(ctx, src_addr, buffer, count, pi->ipi6_ifindex);
+		return;
+	}
+
+	if (hdr->nonce == FRAG_MAGIC) {
+		size_t len;
+
+		buffer = frag_input(&ctx->frag, src_addr, buffer, count, &len);
+		if (!buffer)
+			return;
+
+		count = len;
+		hdr = (struct header *)buffer;
+
+		if (hdr->nonce == FRAG_MAGIC) {
+			log_error("Received nested fragment. Skipping packet.\n");
+			return;
+		}
+	}
+
+	if (hdr->nonce == NACK_MAGIC)
+		nack_handle(ctx, src_addr, buffer, count);
+	else if (hdr->nonce == BUNDLE_MAGIC)
+		udp_handle_bundle(ctx, src_addr, buffer, count);
+	else
+		udp_handle_data(ctx, src_addr, buffer, count);
+}
+
+static void udp_handle_data(struct context *ctx, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t count) {
+	struct header *hdr = (struct header *)buffer;
+
+	if (count < sizeof(*hdr)) {
+		log_error("Received bundled packet that is smaller than header size. Skipping packet.\n");
+		return;
+	}
+
+	ctx->stats.data_rx++;
+
+	uint8_t hop_limit = 0;
+
+	if (hdr->nonce == VERSIONED_MAGIC) {
+		ssize_t start = versioned_unwrap(buffer, count, &hop_limit);
+
+		switch (start) {
+		case VERSIONED_MISMATCH:
+			log_verbose("Received packet of another format version from %s. Skipping packet.\n", print_ip(&src_addr->sin6_addr));
+			ctx->stats.version_mismatch++;
+			return;
+		case VERSIONED_UNKNOWN_TLV:
+			log_verbose("Received packet with an unknown critical extension from %s. Skipping packet.\n", print_ip(&src_addr->sin6_addr));
+			ctx->stats.unknown_tlv++;
+			return;
+		case VERSIONED_EXPIRED:
+			ctx->stats.hop_limit_expired++;
+			return;
+		case VERSIONED_INVALID:
+			log_error("Received malformed versioned packet from %s. Skipping packet.\n", print_ip(&src_addr->sin6_addr));
+			ctx->stats.versioned_invalid++;
+			return;
+		}
+
+		ctx->stats.versioned_rx++;
+		buffer += start;
+		count -= start;
+		hdr = (struct header *)buffer;
+	}
+
+	// packets from neighbours that only send the bare header travel as
+	// far as our own
+	hop_limit = hop_limit ? hop_limit - 1 : ctx->hop_limit;
+
+	struct seq_header *shdr = (struct seq_header *)buffer;
+	size_t hdrlen = sizeof(*hdr);
+	uint64_t key = hdr->nonce;
+	bool is_new;
+
+	if (hdr->nonce == SEQ_MAGIC) {
+		if (count < sizeof(*shdr)) {
+			log_error("Received sequenced packet that is smaller than its header. Skipping packet.\n");
+			return;
+		}
+
+		hdrlen = sizeof(*shdr);
+		key = (uint64_t)ntohl(shdr->origin) << 32 | ntohl(shdr->seq);
+
+		if (nack_enabled(&ctx->nack))
+			nack_observe(ctx, src_addr, ntohl(shdr->origin), ntohl(shdr->seq));
+
+		// the worker threads only share plain duplicate detection
+		if (workers_enabled(&ctx->workers))
+			is_new = workers_seen_add(&ctx->workers, key);
+		else
+			is_new = origin_check(&ctx->origins, ntohl(shdr->origin), ntohl(shdr->seq));
+	} else if (workers_enabled(&ctx->workers)) {
+		is_new = workers_seen_add(&ctx->workers, key);
+	} else {
+		is_new = seen_add(&ctx->seen, hdr->nonce);
+	}
+
+	bool relay = ctx->mpr ? mpr_relay(ctx, src_addr, key) : is_new;
+
+	// with mpr a late copy from a neighbour that selected us may still
+	// have to be relayed, so the kernel may only drop relayed packets,
+	// and with -k the copies have to be counted until the relay is done
+	if (relay && hdrlen == sizeof(*hdr) && !gossip_enabled(&ctx->gossip))
+		dupfilter_add(&ctx->dupfilter, hdr->nonce);
+
+	if (!is_new) {
+		ctx->stats.data_duplicates++;
+		gossip_heard(ctx, key, src_addr);
+		if (hdrlen == sizeof(*shdr))
+			log_verbose("we already saw packet %" PRIu32 " of origin 0x%08" PRIx32 "\n", ntohl(shdr->seq), ntohl(shdr->origin));
+		else
+			log_verbose("we already saw nonce " FMT_NONCE "\n", hdr->nonce);
+
+		if (relay)
+			relay_packet(ctx, src_addr, hdr, hdrlen, buffer + hdrlen, count - hdrlen, key, hop_limit);
+		return;
+	}
+
+	if (!storm_check(&ctx->storm, src_addr, buffer + hdrlen, count - hdrlen)) {
+		log_verbose("rate limit exceeded, dropping packet from %s\n", print_ip(&src_addr->sin6_addr));
+		return;
+	}
+
+	if (!relay)
+		ctx->stats.mpr_suppressed++;
+
+	handle_udp_packet(ctx, src_addr, hdr, hdrlen, buffer + hdrlen, count - hdrlen, key, relay, hop_limit);
+}
+
+/**
+ * udp_handle_message - handle one read from an intercom socket
+ * @ctx: the mmfd context
+ * @message: the message with source address and control data
+ * @buffer: the payload
+ * @len: length of the payload
+ */
+void udp_handle_message(struct context *ctx, struct msghdr *message, uint8_t *buffer, size_t len) {
+	size_t segment = gro_segment_size(message);
+
+	if (!segment) {
+		udp_handle_datagram(ctx, message, buffer, len);
+		return;
+	}
+
+	// the kernel merged several datagrams of one sender
+	ctx->stats.gro_reads++;
+
+	for (size_t offset = 0; offset < len; offset += segment) {
+		ctx->stats.gro_segments++;
+		udp_handle_datagram(ctx, message, buffer + offset, len - offset < segment ? len - offset : segment);
+	}
+}
+
 void udp_handle_in(struct context *ctx, int fd) {
+	struct rx_batch *batch = &ctx->rx_batch;
+
 	log_debug("handling intercom packet\n");
 	while (1) {
-		struct header hdr = {};
-		uint8_t buffer[1500];
-		struct sockaddr_in6 src_addr = {};
-
-		struct iovec iov[2] = {{
-					   .iov_base = &hdr, .iov_len = sizeof(hdr),
-				       },
-				       {
-					   .iov_base = buffer, .iov_len = sizeof(buffer),
-				       }};
-
-		uint8_t cmbuf[CMSG_SPACE(sizeof(struct in6_pktinfo))];
-
-		struct msghdr message = {
-		    .msg_name = &src_addr,
-		    .msg_namelen = sizeof(src_addr),
-		    .msg_iov = iov,
-		    .msg_iovlen = 2,
-		    .msg_control = cmbuf,
-		    .msg_controllen = sizeof(cmbuf),
-		};
+		for (size_t i = 0; i < batch->size; i++) {
+			batch->iovs[i] = (struct iovec){
+				.iov_base = batch->buffers + i * batch->buffer_size,
+				.iov_len = batch->buffer_size,
+			};
 
-		ssize_t count = recvmsg(fd, &message, 0);
-		log_debug("read %zd bytes\n", count);
+			batch->msgs[i].msg_hdr = (struct msghdr){
+				.msg_name = &batch->addrs[i],
+				.msg_namelen = sizeof(struct sockaddr_in6),
+				.msg_iov = &batch->iovs[i],
+				.msg_iovlen = 1,
+				.msg_control = batch->control + i * RX_CONTROL_SIZE,
+				.msg_controllen = RX_CONTROL_SIZE,
+			};
+		}
 
-		if (count == -1 && errno == EAGAIN)
-			break;
+		int n = recvmmsg(fd, batch->msgs, batch->size, 0, NULL);
+		ctx->stats.rx_syscalls++;
+		log_debug("read %d datagrams\n", n);
 
-		if (count == -1) {
-			perror("Error during recvmsg");
-		} else if (count > 0 && (size_t)count < sizeof(hdr)) {
-			log_error("Received packet that is smaller than header size. Skipping packet. This should not happen.\n");
-		} else if (message.msg_flags & MSG_TRUNC) {
-			log_error("Message too long for buffer\n");
-		} else {
-			if (is_seen(hdr.nonce))
-				continue;
-			VECTOR_ADD(ctx->seen, hdr.nonce);
-
-			for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg != NULL; cmsg = CMSG_NXTHDR(&message, cmsg)) {
-				if ((cmsg->cmsg_level == IPPROTO_IPV6 && cmsg->cmsg_type == IPV6_PKTINFO)) {
-					struct in6_pktinfo *pi = (struct in6_pktinfo *)CMSG_DATA(cmsg);
-
-					bool is_packet_dest_mcast = memcmp(&pi->ipi6_addr, &ctx->groupaddr.sin6_addr, sizeof(ctx->groupaddr.sin6_addr)) == 0;
-
-					if (is_packet_dest_mcast) {
-						log_verbose("received packet " FMT_NONCE " from %s for %s\n", hdr.nonce,
-							    print_ip(&src_addr.sin6_addr), print_ip(&pi->ipi6_addr));
-						char buf[IFNAMSIZ];
-						char *ifname = if_indextoname(pi->ipi6_ifindex, buf);
-						neighbour_change(ctx, &src_addr.sin6_addr, ifname);
-					} else {
-						handle_udp_packet(ctx, &src_addr, &hdr, buffer, count - sizeof(hdr));
-					}
-					break;
-				}
-			}
+		if (n == -1) {
+			if (errno != EAGAIN)
+				perror("Error during recvmmsg");
+			break;
 		}
+
+		ctx->stats.rx_datagrams += n;
+
+		for (int i = 0; i < n; i++)
+			udp_handle_message(ctx, &batch->msgs[i].msg_hdr, batch->iovs[i].iov_base, batch->msgs[i].msg_len);
+
+		// a short batch means the socket is drained
+		if ((size_t)n < batch->size)
+			break;
 	}
 }
 
-void handle_udp_packet(struct context *ctx,  struct sockaddr_in6 *src_addr, struct header *hdr, uint8_t *packet, ssize_t len) {
-	forward_packet(ctx, packet, len, hdr->nonce, src_addr);
-	log_verbose("writing packet to tun interface\n");
-	write(ctx->tunfd, packet, len);
+void handle_udp_packet(struct context *ctx,  struct sockaddr_in6 *src_addr, struct header *hdr, size_t hdrlen, uint8_t *packet, ssize_t len, uint64_t key, bool relay, uint8_t hop_limit) {
+	if (nack_enabled(&ctx->nack) && hdr->nonce == SEQ_MAGIC)
+		nack_cache_add(&ctx->nack, key, hdr, hdrlen, packet, len);
+
+	if (relay)
+		relay_packet(ctx, src_addr, hdr, hdrlen, packet, len, key, hop_limit);
+	else
+		forward_packet(ctx, packet, len, hdr, hdrlen, src_addr, true, hop_limit);
+
+	log_verbose("queueing packet for tun interface\n");
+	tunqueue_add(ctx, packet, len);
 }
 
 void handle_packet(struct context *ctx, uint8_t *packet, ssize_t len) {
-	uint64_t nonce;
-	obtainrandom(&nonce, sizeof(nonce), 0);
+	ctx->stats.local_rx++;
+
+	if (!storm_check(&ctx->storm, NULL, packet, len)) {
+		log_verbose("rate limit exceeded, dropping packet from the tun device\n");
+		return;
+	}
+
+	if (ctx->seqmode) {
+		// worker threads read other queues of the tun device
+		uint32_t seq = __atomic_add_fetch(&ctx->seqno, 1, __ATOMIC_RELAXED);
+		struct seq_header shdr = {
+			.hdr.nonce = SEQ_MAGIC,
+			.origin = htonl(ctx->origin_id),
+			.seq = htonl(seq),
+		};
+
+		if (workers_enabled(&ctx->workers))
+			workers_seen_add(&ctx->workers, (uint64_t)ctx->origin_id << 32 | seq);
+		else
+			origin_check(&ctx->origins, ctx->origin_id, seq);
+		if (ctx->mpr)
+			seen_add(&ctx->relayed, (uint64_t)ctx->origin_id << 32 | seq);
+		if (nack_enabled(&ctx->nack))
+			nack_cache_add(&ctx->nack, (uint64_t)ctx->origin_id << 32 | seq, &shdr.hdr, sizeof(shdr), packet, len);
+		forward_packet(ctx, packet, len, &shdr.hdr, sizeof(shdr), NULL, false, ctx->hop_limit);
+		return;
+	}
+
+	struct header hdr;
+	obtainrandom(&hdr.nonce, sizeof(hdr.nonce), 0);
+
+	if (workers_enabled(&ctx->workers))
+		workers_seen_add(&ctx->workers, hdr.nonce);
+	else
+		seen_add(&ctx->seen, hdr.nonce);
+	dupfilter_add(&ctx->dupfilter, hdr.nonce);
+	if (ctx->mpr)
+		seen_add(&ctx->relayed, hdr.nonce);
+	forward_packet(ctx, packet, len, &hdr, sizeof(hdr), NULL, false, ctx->hop_limit);
+}
+
+/** Returns true if a packet read from the tun device is IPv6 multicast */
+bool tun_packet_valid(uint8_t *buf, ssize_t count) {
+	if (count < 40) // ipv6 header has 40 bytes
+		return false;
+
+	struct ipv6hdr *hdr = (struct ipv6hdr*)buf;
+
+	if (hdr->version != 6) {
+		log_verbose("Dropping non-IPv6 packet.\n");
+		return false;
+	}
+
+	// Ignore any non-multicast packets
+	if (hdr->daddr.s6_addr[0] != 0xff) {
+		log_verbose("Dropping non multicast packet destined to %s.\n", print_ip(&hdr->daddr));
+		return false;
+	}
+
+	return true;
+}
+
+static void tun_handle_segment(void *arg, uint8_t *packet, size_t len) {
+	if (tun_packet_valid(packet, len))
+		handle_packet(arg, packet, len);
+}
+
+/** Sends a packet read from the tun device if it is IPv6 multicast */
+void tun_handle_packet(struct context *ctx, uint8_t *buf, ssize_t count) {
+	if (ctx->tun_vnet) {
+		unsigned int n = vnet_segment(buf, count, tun_handle_segment, ctx);
 
-	VECTOR_ADD(ctx->seen, nonce);
-	forward_packet(ctx, packet, len, nonce, NULL);
+		if (n > 1) {
+			ctx->stats.tun_gso_reads++;
+			ctx->stats.tun_gso_segments += n;
+		}
+		return;
+	}
+
+	if (tun_packet_valid(buf, count))
+		handle_packet(ctx, buf, count);
 }
 
 void tun_handle_in(struct context *ctx, int fd) {
 	ssize_t count;
 
-	uint8_t buf[MTU];
+	// only the main thread gets here, a super-packet is too big for the stack
+	static uint8_t buf[VNET_BUFFER_SIZE];
+	size_t size = ctx->tun_vnet ? sizeof(buf) : ctx->mtu;
 
 	while (1) {
-		count = read(fd, buf, MTU);
+		count = read(fd, buf, size);
 
 		if (count == -1) {
 			/* If errno == EAGAIN, that means we have read all
@@ -271,23 +806,7 @@ void tun_handle_in(struct context *ctx, int fd) {
 			break;
 		}
 
-		if (count < 40) // ipv6 header has 40 bytes
-			continue;
-
-		struct ipv6hdr *hdr = (struct ipv6hdr*)buf;
-
-		if (hdr->version != 6) {
-			log_verbose("Dropping non-IPv6 packet.\n");
-			continue;
-		}
-
-		// Ignore any non-multicast packets
-		if (hdr->daddr.s6_addr[0] != 0xff) {
-			log_verbose("Dropping non multicast packet destined to %s.\n", print_ip(&hdr->daddr));
-			continue;
-		}
-
-		handle_packet(ctx, buf, count);
+		tun_handle_packet(ctx, buf, count);
 	}
 }
 
@@ -301,6 +820,18 @@ void change_fd(int efd, int fd, int type, uint32_t events) {
 		exit_error("epoll_ctl %d", errno);
 }
 
+static bool is_tun_fd(struct context *ctx, int fd) {
+	if (fd == ctx->tunfd)
+		return true;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->tun_queues); i++) {
+		if (VECTOR_INDEX(ctx->tun_queues, i) == fd)
+			return true;
+	}
+
+	return false;
+}
+
 bool is_nic_fd(int fd) {
 	bool ret = false;
 	for (size_t i = 0; !ret && i < VECTOR_LEN(ctx.interfaces); i++) {
@@ -315,6 +846,12 @@ bool is_nic_fd(int fd) {
 void loop(struct context *ctx) {
 
 	change_fd(ctx->efd, ctx->tunfd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+
+	// with worker threads the further queues belong to them
+	if (!workers_enabled(&ctx->workers)) {
+		for (size_t i = 0; i < VECTOR_LEN(ctx->tun_queues); i++)
+			change_fd(ctx->efd, VECTOR_INDEX(ctx->tun_queues, i), EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+	}
 	change_fd(ctx->efd, ctx->taskqueue_ctx.fd, EPOLL_CTL_ADD, EPOLLIN);
 
 	if (ctx->socket_ctx.fd)
@@ -326,7 +863,8 @@ void loop(struct context *ctx) {
 
 	while (1) {
 		log_debug("epoll_wait: ... ");
-		int n = epoll_wait(ctx->efd, events, maxevents, -1);
+		// packets left over by the scheduler go out in the next turn
+		int n = epoll_wait(ctx->efd, events, maxevents, egress_backlog(&ctx->egress) ? 0 : -1);
 		log_debug("%i\n", n);
 
 		for ( int i = 0; i < n; i++ ) {
@@ -341,41 +879,117 @@ void loop(struct context *ctx) {
 			} else if (ctx->socket_ctx.fd == events[i].data.fd) {
 				log_debug("event on socketfd\n");
 				socket_handle_in(&ctx->socket_ctx);
-			} else if (ctx->tunfd == events[i].data.fd) {
+			} else if (is_tun_fd(ctx, events[i].data.fd)) {
 				log_debug("event on tunfd\n");
 				if (events[i].events & EPOLLIN)
 					tun_handle_in(ctx, events[i].data.fd);
+				if (events[i].events & EPOLLOUT)
+					tunqueue_writable(ctx);
 			} else {
 				char junk;
 				read(events[i].data.fd, &junk, 1);
 				log_error("THIS SHOULD NEVER HAPPEN: Data arrived on fd %d which we are not monitoring in our loop, discarding data: %c\n", events[i].data.fd, junk);
 			}
 		}
+
+		// everything queued for the same neighbour during this turn
+		// leaves in as few sends as possible
+		egress_flush(ctx);
+		gso_flush(ctx);
+		tunqueue_flush(ctx);
+
+		workers_publish(ctx);
 	}
 
 	free(events);
 }
 
 void usage() {
-	puts("Usage: mmfd [-h] [-v] [-d] [-D <devicename>] [-i <mesh-device>] [-i <mesh-device>] [-s /path/to/socket]");
+	puts("Usage: mmfd [-h] [-v] [-d] [-D <devicename>] [-i <mesh-device>] [-i <mesh-device>] [-s /path/to/socket] [-w <seconds>] [-c <entries>] [-S] [-B] [-b <datagrams>] [-M <neighbours>] [-R] [-k <copies>] [-j <min>-<max>] [-a <microseconds>] [-G] [-e epoll|uring] [-t <threads>] [-q <queues>] [-O] [-Q <packets>] [-m <mtu>] [-F] [-n <packets>] [-N <packets/s>] [-p <prefix>=<packets/s>[:<burst>]] [-P strict|weighted[:<high>,<normal>,<low>]] [-C <prefix>=high|normal|low] [-l <ifname>]");
 	puts("  -v     verbose");
 	puts("  -d     debug");
 	puts("  -D     name of the mmfd device");
-	puts("  -s     socket on which the commands: verbosity [none, verbose,debug], add_meshif <ifname>, del_meshif <ifname>, get_neighbours and get_meshifs are valid");
+	puts("  -s     socket on which the commands: verbosity [none, verbose,debug], add_meshif <ifname>, del_meshif <ifname>, mcast_threshold <ifname> <neighbours>, get_neighbours, get_meshifs and get_stats are valid");
 	puts("  -i     bind to interface, may be specified multiple times, default: lo");
+	printf("  -w     seconds to remember a packet for duplicate detection, default: %d\n", SEEN_WINDOW);
+	printf("  -c     maximum number of packets remembered for duplicate detection, default: %d\n", SEEN_MAX_ENTRIES);
+	puts("  -S     send packets with an origin id and sequence number instead of a random nonce.");
+	puts("         Only enable this once every node in the mesh understands it.");
+	puts("  -B     drop known duplicates in the kernel with an eBPF socket filter");
+	printf("  -b     number of datagrams to receive per syscall, default: %d\n", RX_BATCH_SIZE);
+	puts("  -M     send to the intercom group instead of unicast when this many neighbours on an interface receive a packet, default: 0 (never)");
+	puts("  -R     only relay packets for neighbours that selected this node as multipoint relay");
+	puts("  -k     delay relaying and cancel it once copies of the packet were heard from this many other neighbours,");
+	printf("         at most %d, default: 0 (relay right away)\n", GOSSIP_MAX_THRESHOLD);
+	printf("  -j     range of the relay delay for -k in milliseconds, default: %d-%d\n", GOSSIP_JITTER_MIN, GOSSIP_JITTER_MAX);
+	puts("  -a     bundle packets to the same neighbour that are sent within this many microseconds, default: 0 (never)");
+	puts("         Only enable this once every node in the mesh understands it.");
+	puts("  -G     send and receive bursts to the same neighbour with UDP GSO and GRO if the kernel supports it");
+	puts("  -e     I/O engine, epoll (default) or uring for io_uring with multishot receives and batched submission");
+	puts("  -t     receive and relay data in this many worker threads with their own sockets, default: 0 (main thread only)");
+	puts("         -R, -k, -a, -G, -e uring, -n, -p, -P, -l and -x are not available with worker threads.");
+	puts("  -q     open the tun device with this many queues, read by the worker threads if there are any, default: 1");
+	printf("  -Q     packets waiting for the tun device at most, 0 writes them right away, default: %d\n", TUNQUEUE_SIZE);
+	puts("  -O     exchange UDP GSO super-packets with the tun device instead of single packets (IFF_VNET_HDR)");
+	printf("  -m     MTU of the mmfd device, use the same on every node, default: %d\n", DEFAULT_MTU);
+	puts("  -F     split datagrams that are too big for a link into fragments instead of leaving it to IPv6");
+	puts("         Only enable this once every node in the mesh understands it.");
+	puts("  -n     keep this many sequenced packets and ask neighbours with NACKs for those missing, requires -S, default: 0 (never)");
+	puts("         Only enable this once every node in the mesh understands it.");
+	printf("  -N     packets sent again for NACKs per second at most, default: %d\n", NACK_RATE);
+	puts("  -p     limit each sender to a group under <prefix>[/<length>] to this many packets per second, per ingress,");
+	puts("         may be specified multiple times, the longest prefix applies, e.g. -p ff02::fb=50 -p ff05::/16=200:400");
+	printf("         each group and each ingress may pass %d times that in total\n", STORM_SHARE);
+	printf("  -P     queue forwarded packets per class and send up to %d per turn of the event loop, strictly by priority\n", EGRESS_BUDGET);
+	puts("         or round robin with these weights, default weights: 8,4,1. DSCP CS5 and above is high, LE and CS1 low");
+	puts("  -C     put groups under <prefix>[/<length>] into a class of -P regardless of their DSCP, may be specified multiple times");
+	puts("  -l     count groups joined on this interface and on the mmfd device as listeners and only send packets towards");
+	puts("         nodes with listeners, link scope and all-nodes groups are always flooded, may be specified multiple times");
+	puts("         For a bridge the groups in its MDB count as well, which needs multicast_snooping and multicast_querier");
+	puts("         set on it, otherwise its clients cannot be seen and no group is pruned towards this node.");
+	puts("  -H     send the versioned header with this hop limit to interfaces where every neighbour understands it,");
+	printf("         use the same on every node, default: bare header, hop limit %d for forwarded packets\n", DEFAULT_HOP_LIMIT);
+	puts("         A packet that arrives with the bare header, from older nodes or those running -t, starts over with this limit.");
+	puts("  -x     stop sending forwarded packets over links whose quality, the product of the hello delivery ratios");
+	puts("         in both directions, is below this percentage while another neighbour has a good link to the node");
 	puts("  -h     this help");
 }
 
 int main(int argc, char *argv[]) {
 	int c;
 	char mmfd_device[IFNAMSIZ] = "mmfd0";
+	unsigned long seen_window = SEEN_WINDOW;
+	unsigned long seen_max_entries = SEEN_MAX_ENTRIES;
+	unsigned long rx_batch_size = RX_BATCH_SIZE;
+	bool use_dupfilter = false;
+	bool use_uring = false;
+	unsigned int workers = 0;
+	unsigned int tun_queues = 1;
+	unsigned long tunqueue_size = TUNQUEUE_SIZE;
+	unsigned long mtu;
+	unsigned long hop_limit;
+	unsigned long quality;
+	unsigned long nack_size = 0;
+	unsigned long nack_rate = NACK_RATE;
+	VECTOR(char *) meshifs = {};
+	unsigned int gossip_threshold = 0;
+	unsigned int jitter_min = GOSSIP_JITTER_MIN, jitter_max = GOSSIP_JITTER_MAX;
 	memset(&ctx, 0, sizeof(ctx));
 	ctx.verbose = false;
 	ctx.debug = false;
 
-	VECTOR_INIT(ctx.seen);
-	VECTOR_INIT(ctx.neighbours);
+	neighbour_table_init(&ctx.neighbours);
 	VECTOR_INIT(ctx.interfaces);
+	VECTOR_INIT(ctx.fanout);
+
+	ctx.dupfilter = (dupfilter_ctx){
+		.map_fd = -1, .stats_fd = -1, .prog_fd = -1,
+	};
+	ctx.uring.fd = -1;
+	ctx.mtu = DEFAULT_MTU;
+	ctx.hop_limit = DEFAULT_HOP_LIMIT;
+	frag_init(&ctx.frag);
+	etx_init(&ctx.etx);
 
 	intercom_init(&ctx);
 
@@ -384,7 +998,7 @@ int main(int argc, char *argv[]) {
 	if (ctx.efd == -1)
 		exit_errno("epoll_create");
 
-	while ((c = getopt(argc, argv, "vhds:D:i:")) != -1)
+	while ((c = getopt(argc, argv, "vhds:D:i:w:c:SBb:M:Rk:j:a:Ge:t:q:OQ:m:Fn:N:p:P:C:l:H:x:")) != -1)
 		switch (c) {
 			case 'd':
 				ctx.debug = true;
@@ -401,33 +1015,251 @@ int main(int argc, char *argv[]) {
 			case 's':
 				socket_init(&ctx.socket_ctx, optarg);
 				break;
-			case 'i':
-				if (!if_add(optarg))
-					fprintf(stderr, "Could not add device %s. ignoring.\n", optarg);
+			case 'w':
+				seen_window = strtoul(optarg, NULL, 10);
+				if (!seen_window) {
+					fprintf(stderr, "Invalid window %s, using %d.\n", optarg, SEEN_WINDOW);
+					seen_window = SEEN_WINDOW;
+				}
+				break;
+			case 'c':
+				seen_max_entries = strtoul(optarg, NULL, 10);
+				if (seen_max_entries > SEEN_MAX_CAPACITY) {
+					fprintf(stderr, "Too many entries %s, using %lu.\n", optarg, (unsigned long)SEEN_MAX_CAPACITY);
+					seen_max_entries = SEEN_MAX_CAPACITY;
+				}
+				break;
+			case 'b':
+				rx_batch_size = strtoul(optarg, NULL, 10);
+				if (!rx_batch_size)
+					rx_batch_size = 1;
+				break;
+			case 'M':
+				ctx.mcast_threshold = strtoul(optarg, NULL, 10);
+				break;
+			case 'B':
+				use_dupfilter = true;
+				break;
+			case 'k':
+				gossip_threshold = strtoul(optarg, NULL, 10);
+				if (gossip_threshold > GOSSIP_MAX_THRESHOLD) {
+					fprintf(stderr, "Relay threshold %s is too high, using %d.\n", optarg, GOSSIP_MAX_THRESHOLD);
+					gossip_threshold = GOSSIP_MAX_THRESHOLD;
+				}
+				break;
+			case 'j':
+				if (sscanf(optarg, "%u-%u", &jitter_min, &jitter_max) != 2) {
+					fprintf(stderr, "Invalid relay delay %s, expected <min>-<max>. ignoring.\n", optarg);
+					jitter_min = GOSSIP_JITTER_MIN;
+					jitter_max = GOSSIP_JITTER_MAX;
+				}
+				break;
+			case 'a':
+				ctx.aggregation_us = strtol(optarg, NULL, 10);
+				break;
+			case 'G':
+				ctx.offload = true;
+				break;
+			case 'e':
+				if (!strcmp(optarg, "uring"))
+					use_uring = true;
+				else if (!strcmp(optarg, "epoll"))
+					use_uring = false;
 				else
-					intercom_update_interfaces(&ctx);
+					fprintf(stderr, "Unknown I/O engine %s, using epoll.\n", optarg);
+				break;
+			case 'R':
+				ctx.mpr = true;
+				break;
+			case 'S':
+				ctx.seqmode = true;
+				break;
+			case 't':
+				workers = strtoul(optarg, NULL, 10);
+				break;
+			case 'q':
+				tun_queues = strtoul(optarg, NULL, 10);
+				if (!tun_queues)
+					tun_queues = 1;
+				break;
+			case 'O':
+				ctx.tun_vnet = true;
+				break;
+			case 'Q':
+				tunqueue_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'm':
+				mtu = strtoul(optarg, NULL, 10);
+				if (mtu < 1280 || mtu > UINT16_MAX - RX_HEADROOM) {
+					fprintf(stderr, "Invalid MTU %s, using %d.\n", optarg, DEFAULT_MTU);
+					mtu = DEFAULT_MTU;
+				}
+				ctx.mtu = mtu;
+				break;
+			case 'F':
+				ctx.fragment = true;
+				break;
+			case 'n':
+				nack_size = strtoul(optarg, NULL, 10);
+				break;
+			case 'N':
+				nack_rate = strtoul(optarg, NULL, 10);
+				break;
+			case 'p':
+				if (!storm_add_rule(&ctx.storm, optarg))
+					fprintf(stderr, "Invalid rate limit %s, expected <prefix>[/<length>]=<packets/s>[:<burst>]. ignoring.\n", optarg);
+				break;
+			case 'P':
+				if (!egress_configure(&ctx.egress, optarg))
+					fprintf(stderr, "Invalid scheduler %s, expected strict or weighted[:<high>,<normal>,<low>]. ignoring.\n", optarg);
+				break;
+			case 'C':
+				if (!egress_add_rule(&ctx.egress, optarg))
+					fprintf(stderr, "Invalid class %s, expected <prefix>[/<length>]=high|normal|low. ignoring.\n", optarg);
+				break;
+			case 'l':
+				mld_add_interface(&ctx.mld, optarg);
+				break;
+			case 'H':
+				hop_limit = strtoul(optarg, NULL, 10);
+				if (!hop_limit || hop_limit > UINT8_MAX) {
+					fprintf(stderr, "Invalid hop limit %s, using %d.\n", optarg, DEFAULT_HOP_LIMIT);
+					hop_limit = DEFAULT_HOP_LIMIT;
+				}
+				ctx.hop_limit = hop_limit;
+				ctx.versioned = true;
+				break;
+			case 'x':
+				quality = strtoul(optarg, NULL, 10);
+				if (!quality || quality > 100) {
+					fprintf(stderr, "Invalid link quality %s, expected 1 to 100. ignoring.\n", optarg);
+					break;
+				}
+				ctx.etx.threshold = quality * ETX_SCALE / 100;
+				ctx.etx.enabled = true;
+				break;
+			case 'i':
+				VECTOR_ADD(meshifs, optarg);
 				break;
 			default:
 				fprintf(stderr, "Invalid parameter %c ignored.\n", c);
 		}
 
+	if (workers) {
+		if (ctx.mpr || gossip_threshold || ctx.aggregation_us || ctx.offload || use_uring || nack_size || VECTOR_LEN(ctx.storm.rules) ||
+		    egress_enabled(&ctx.egress) || mld_enabled(&ctx.mld) || etx_enabled(&ctx.etx)) {
+			fprintf(stderr, "-R, -k, -a, -G, -e uring, -n, -p, -P, -l and -x keep state the worker threads cannot share, ignoring them.\n");
+			ctx.mpr = false;
+			gossip_threshold = 0;
+			ctx.aggregation_us = 0;
+			ctx.offload = false;
+			use_uring = false;
+			nack_size = 0;
+			VECTOR_RESIZE(ctx.storm.rules, 0);
+			ctx.egress.enabled = false;
+			ctx.mld.enabled = false;
+			ctx.etx.enabled = false;
+		}
+
+		if (!workers_init(&ctx.workers, &ctx, workers, seen_window * 1000, seen_max_entries, rx_batch_size))
+			exit_error("Can not set up worker threads");
+	}
+
+	if (nack_size && !ctx.seqmode) {
+		fprintf(stderr, "-n needs the sequence numbers of -S to find lost packets, ignoring it.\n");
+		nack_size = 0;
+	}
+
+	// pruned packets would look lost
+	if (nack_size && mld_enabled(&ctx.mld)) {
+		fprintf(stderr, "-n cannot tell lost packets from pruned ones, ignoring it.\n");
+		nack_size = 0;
+	}
+
+	if (mld_enabled(&ctx.mld))
+		mld_add_interface(&ctx.mld, mmfd_device);
+
 	int rfd = open("/dev/urandom", O_RDONLY);
 	unsigned int seed;
 	read(rfd, &seed, sizeof(seed));
 	close(rfd);
 	srand(seed);
 
-	ctx.tunfd = tun_open(mmfd_device, MTU, "/dev/net/tun");
+	int tun_flags = (tun_queues > 1 ? IFF_MULTI_QUEUE : 0) | (ctx.tun_vnet ? IFF_VNET_HDR : 0);
+
+	ctx.tunfd = tun_open(mmfd_device, ctx.mtu, "/dev/net/tun", tun_flags);
 
 	if (ctx.tunfd == -1)
 		exit_error("Can not create tun device");
 
+	if (ctx.tun_vnet) {
+		vnet_setup(ctx.tunfd);
+		ctx.tun_coalesce = true;
+	}
+
+	tunqueue_init(&ctx.tunqueue, tunqueue_size, ctx.mtu);
+
+	for (unsigned int i = 1; i < tun_queues; i++) {
+		int fd = tun_open_queue(mmfd_device, "/dev/net/tun", tun_flags);
+
+		if (fd < 0) {
+			fprintf(stderr, "Could only open %u queues of the tun device: %s\n", i, strerror(errno));
+			break;
+		}
+
+		VECTOR_ADD(ctx.tun_queues, fd);
+
+		if (workers_enabled(&ctx.workers))
+			workers_add_tun(&ctx.workers, fd);
+	}
+
+	seen_init(&ctx.seen, seen_window * 1000, seen_max_entries);
+	seen_init(&ctx.hello_seen, HELLO_INTERVAL * 1000, SEEN_MIN_CAPACITY);
+	origin_init(&ctx.origins);
+	nack_init(&ctx.nack, nack_size, rx_buffer_size(&ctx), nack_rate);
+	storm_init(&ctx.storm);
+	egress_init(&ctx.egress, EGRESS_DEPTH, rx_buffer_size(&ctx));
+	if (ctx.mpr)
+		seen_init(&ctx.relayed, seen_window * 1000, seen_max_entries);
+	gossip_init(&ctx.gossip, gossip_threshold, jitter_min, jitter_max);
+	if (use_dupfilter)
+		dupfilter_init(&ctx.dupfilter, seen_max_entries);
+
 	taskqueue_init(&ctx.taskqueue_ctx);
 
+	// sockets are only opened once all options that shape them are known
+	for (size_t i = 0; i < VECTOR_LEN(meshifs); i++) {
+		if (!if_add(VECTOR_INDEX(meshifs, i)))
+			fprintf(stderr, "Could not add device %s. ignoring.\n", VECTOR_INDEX(meshifs, i));
+	}
+	intercom_update_interfaces(&ctx);
+	VECTOR_FREE(meshifs);
+
+	// merged reads need room for a whole train of datagrams
+	rx_batch_init(&ctx.rx_batch, rx_batch_size,
+		      ctx.offload && !dupfilter_enabled(&ctx.dupfilter) ? GRO_BUFFER_SIZE : rx_buffer_size(&ctx));
+
+	if (use_uring)
+		uring_init(&ctx.uring, ctx.rx_batch.buffer_size, ctx.tun_vnet ? VNET_BUFFER_SIZE : ctx.mtu);
+
+	obtainrandom(&ctx.origin_id, sizeof(ctx.origin_id), 0);
+
 	print_neighbours_task(NULL);
 
+	expire_task(NULL);
+
+	mtu_task(NULL);
+
 	send_hello_task(NULL);
 
-	loop(&ctx);
+	if (mld_enabled(&ctx.mld))
+		mld_task(NULL);
+
+	workers_start(&ctx.workers);
+
+	if (uring_enabled(&ctx.uring))
+		uring_loop(&ctx);
+	else
+		loop(&ctx);
 	return 0;
 }
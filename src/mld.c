@@ -0,0 +1,393 @@
+#include "mld.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+#include "intercom.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <linux/if_bridge.h>
+#include <linux/if_ether.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define MLD_FILTER_BITS (MLD_FILTER_SIZE * 8)
+
+/** Counts the memberships on an interface as local listeners */
+void mld_add_interface(mld_ctx *mld, char *ifname) {
+	for (size_t i = 0; i < VECTOR_LEN(mld->ifnames); i++) {
+		if (!strcmp(VECTOR_INDEX(mld->ifnames, i), ifname))
+			return;
+	}
+
+	VECTOR_ADD(mld->ifnames, ifname);
+	mld->enabled = true;
+}
+
+/** Groups of interface or link scope and the all-nodes groups reach every node */
+bool mld_flooded(const struct in6_addr *group) {
+	static const uint8_t zero[13];
+
+	if ((group->s6_addr[1] & 0x0f) <= 2)
+		return true;
+
+	return !memcmp(group->s6_addr + 2, zero, sizeof(zero)) && group->s6_addr[15] == 1;
+}
+
+/** The three bits of a group in a filter, every node has to pick the same so the hash is not seeded */
+static void filter_bits(const struct in6_addr *group, unsigned int bits[3]) {
+	uint64_t w[2];
+
+	memcpy(w, group, sizeof(w));
+
+	uint64_t h = hash64(hash64(w[0]) ^ w[1]);
+
+	for (int i = 0; i < 3; i++, h >>= 16)
+		bits[i] = h % MLD_FILTER_BITS;
+}
+
+static void filter_add(uint8_t *filter, const struct in6_addr *group) {
+	unsigned int bits[3];
+
+	filter_bits(group, bits);
+
+	for (int i = 0; i < 3; i++)
+		filter[bits[i] / 8] |= 1 << (bits[i] % 8);
+}
+
+static bool filter_contains(const uint8_t *filter, const struct in6_addr *group) {
+	unsigned int bits[3];
+
+	filter_bits(group, bits);
+
+	for (int i = 0; i < 3; i++) {
+		if (!(filter[bits[i] / 8] & (1 << (bits[i] % 8))))
+			return false;
+	}
+
+	return true;
+}
+
+static bool mld_listens(mld_ctx *mld, const char *ifname) {
+	for (size_t i = 0; i < VECTOR_LEN(mld->ifnames); i++) {
+		if (!strcmp(VECTOR_INDEX(mld->ifnames, i), ifname))
+			return true;
+	}
+
+	return false;
+}
+
+/** Takes a group into the next slot of the local groups, noting if it differs from what was there */
+static void group_add(mld_ctx *mld, const struct in6_addr *group, size_t *n, bool *changed) {
+	if (mld_flooded(group))
+		return;
+
+	// joined on several interfaces, or by the host and behind its bridge
+	for (size_t i = 0; i < *n; i++) {
+		if (!memcmp(&VECTOR_INDEX(mld->groups, i), group, sizeof(*group)))
+			return;
+	}
+
+	if (*n < VECTOR_LEN(mld->groups) && !memcmp(&VECTOR_INDEX(mld->groups, *n), group, sizeof(*group))) {
+		(*n)++;
+		return;
+	}
+
+	*changed = true;
+	VECTOR_RESIZE(mld->groups, *n + 1);
+	VECTOR_INDEX(mld->groups, (*n)++) = *group;
+}
+
+/** Returns a numeric bridge option from sysfs, or -1 if @ifname is not a bridge */
+static int bridge_option(const char *ifname, const char *option) {
+	char path[64 + IFNAMSIZ];
+	int value = -1;
+
+	snprintf(path, sizeof(path), MLD_BRIDGE, ifname, option);
+
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return -1;
+
+	if (fscanf(f, "%d", &value) != 1)
+		value = -1;
+
+	fclose(f);
+	return value;
+}
+
+/** Walks MDBA_MDB, MDBA_MDB_ENTRY and MDBA_MDB_ENTRY_INFO down to the IPv6 groups */
+static void mdb_groups(mld_ctx *mld, struct rtattr *rta, int len, int depth, size_t *n, bool *changed) {
+	static const unsigned short types[] = { MDBA_MDB, MDBA_MDB_ENTRY, MDBA_MDB_ENTRY_INFO };
+
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if ((rta->rta_type & NLA_TYPE_MASK) != types[depth])
+			continue;
+
+		if (depth < 2) {
+			mdb_groups(mld, RTA_DATA(rta), RTA_PAYLOAD(rta), depth + 1, n, changed);
+			continue;
+		}
+
+		const struct br_mdb_entry *entry = RTA_DATA(rta);
+
+		if (RTA_PAYLOAD(rta) >= sizeof(*entry) && entry->addr.proto == htons(ETH_P_IPV6))
+			group_add(mld, &entry->addr.u.ip6, n, changed);
+	}
+}
+
+/**
+ * mdb_read - take over the groups a bridge learnt by MLD snooping
+ * @mld: the context
+ * @ifname: the bridge
+ * @n: next slot of the local groups
+ * @changed: set if the groups differ from the last read
+ *
+ * Return: true if the whole MDB of the bridge was read
+ */
+static bool mdb_read(mld_ctx *mld, const char *ifname, size_t *n, bool *changed) {
+	unsigned int ifindex = if_nametoindex(ifname);
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	struct {
+		struct nlmsghdr nlh;
+		struct br_port_msg bpm;
+	} req = {
+		.nlh = { .nlmsg_len = sizeof(req), .nlmsg_type = RTM_GETMDB, .nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP, },
+		.bpm = { .family = AF_BRIDGE, .ifindex = ifindex, },
+	};
+	uint8_t buffer[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+	bool ok = ifindex && fd >= 0 && send(fd, &req, sizeof(req), 0) == sizeof(req), done = false;
+
+	while (ok && !done) {
+		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+
+		if (len < 0)
+			break;
+
+		for (struct nlmsghdr *nlh = (struct nlmsghdr *)buffer; !done && NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			const struct br_port_msg *bpm = NLMSG_DATA(nlh);
+
+			if (nlh->nlmsg_type == NLMSG_ERROR)
+				ok = false;
+
+			if (nlh->nlmsg_type == NLMSG_DONE || nlh->nlmsg_type == NLMSG_ERROR)
+				done = true;
+			// the dump answers with RTM_GETMDB, older kernels dump the
+			// MDB of every bridge
+			else if ((nlh->nlmsg_type == RTM_GETMDB || nlh->nlmsg_type == RTM_NEWMDB) && bpm->ifindex == ifindex)
+				mdb_groups(mld, (struct rtattr *)((uint8_t *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(*bpm))),
+					   nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*bpm)), 0, n, changed);
+		}
+	}
+
+	if (fd >= 0)
+		close(fd);
+
+	return ok && done;
+}
+
+/**
+ * mld_update - read the groups with listeners here
+ * @mld: the context
+ *
+ * Takes the groups joined on the interfaces of interest and, for those
+ * that are bridges, the groups in their MDB. A bridge whose MDB is not
+ * kept complete hides its listeners and makes every group count.
+ */
+static void mld_update(mld_ctx *mld) {
+	FILE *f = fopen(MLD_PROC, "r");
+	char line[128];
+	size_t n = 0;
+	bool changed = false, unknown = false;
+
+	if (!f) {
+		log_error("Could not read " MLD_PROC ", keeping the known groups\n");
+		return;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char ifname[IFNAMSIZ], hex[33];
+		struct in6_addr group;
+
+		if (sscanf(line, "%*d %15s %32s", ifname, hex) != 2 || strlen(hex) != 32 || !mld_listens(mld, ifname))
+			continue;
+
+		for (size_t i = 0; i < sizeof(group); i++)
+			sscanf(hex + 2 * i, "%2hhx", &group.s6_addr[i]);
+
+		group_add(mld, &group, &n, &changed);
+	}
+
+	fclose(f);
+
+	// without snooping the bridge floods, without its own queries the
+	// entries of listeners that only answer queries are missing
+	for (size_t i = 0; i < VECTOR_LEN(mld->ifnames); i++) {
+		const char *ifname = VECTOR_INDEX(mld->ifnames, i);
+		int snooping = bridge_option(ifname, "multicast_snooping");
+
+		if (snooping < 0)
+			continue;
+
+		if (!snooping || bridge_option(ifname, "multicast_querier") != 1 || !mdb_read(mld, ifname, &n, &changed))
+			unknown = true;
+	}
+
+	if (unknown != mld->unknown) {
+		log_error(unknown ? "Listeners behind a bridge given with -l are unknown, not pruning towards them\n"
+				  : "Listeners behind the bridges given with -l are known again\n");
+		mld->unknown = unknown;
+		changed = true;
+	}
+
+	if (changed || n != VECTOR_LEN(mld->groups)) {
+		VECTOR_RESIZE(mld->groups, n);
+		mld->changed = true;
+		mld->updates++;
+		log_verbose("%zu groups with local listeners\n", n);
+	}
+}
+
+/** Tells whether the neighbours on @iface, other than @neighbour, hear it themselves */
+static bool heard_by_all(interface *iface, const struct neighbour *neighbour) {
+	for (size_t i = 0; i < VECTOR_LEN(iface->neighbours); i++) {
+		const struct neighbour *other = VECTOR_INDEX(iface->neighbours, i);
+		size_t j;
+
+		if (other == neighbour)
+			continue;
+
+		if (!neighbour->has_id || !other->has_id)
+			return false;
+
+		for (j = 0; j < VECTOR_LEN(other->two_hop) && VECTOR_INDEX(other->two_hop, j) != neighbour->node_id; j++);
+
+		if (j == VECTOR_LEN(other->two_hop))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * mld_fill - prepare the group filters of a hello
+ * @ctx: the mmfd context
+ * @iface: the interface the hello goes out on
+ * @groups: room for MLD_LEVELS filters
+ *
+ * The filters of a neighbour are not passed on over an interface whose
+ * other neighbours all hear it directly. They already know its listeners
+ * from it, and the neighbour itself would learn them back from us and
+ * send their packets our way.
+ */
+void mld_fill(struct context *ctx, interface *iface, struct hello_groups *groups) {
+	ctx->mld.changed = false;
+	groups->levels = MLD_LEVELS;
+	memset(groups->filters, 0, MLD_LEVELS * MLD_FILTER_SIZE);
+
+	if (ctx->mld.unknown)
+		memset(groups->filters, 0xff, MLD_FILTER_SIZE);
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->mld.groups); i++)
+		filter_add(groups->filters, &VECTOR_INDEX(ctx->mld.groups, i));
+
+	// a listener d hops behind a neighbour is d + 1 hops behind us
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *from = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(from->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(from->neighbours, j);
+
+			if (!neighbour->groups || heard_by_all(iface, neighbour))
+				continue;
+
+			for (size_t level = 1; level < MLD_LEVELS; level++) {
+				uint8_t *dst = groups->filters + level * MLD_FILTER_SIZE;
+				const uint8_t *src = neighbour->groups + (level - 1) * MLD_FILTER_SIZE;
+
+				for (size_t k = 0; k < MLD_FILTER_SIZE; k++)
+					dst[k] |= src[k];
+			}
+		}
+	}
+}
+
+/**
+ * mld_read - take over the group filters a neighbour advertised
+ * @mld: the context
+ * @neighbour: the neighbour
+ * @buffer: the filters and their header, NULL if its hello had none
+ * @len: their length
+ */
+void mld_read(mld_ctx *mld, struct neighbour *neighbour, const uint8_t *buffer, size_t len) {
+	const struct hello_groups *groups = (const struct hello_groups *)buffer;
+
+	if (!buffer || len < sizeof(*groups) || !groups->levels ||
+	    len < sizeof(*groups) + groups->levels * MLD_FILTER_SIZE) {
+		if (neighbour->groups)
+			mld->changed = true;
+		free(neighbour->groups);
+		neighbour->groups = NULL;
+		return;
+	}
+
+	size_t levels = groups->levels < MLD_LEVELS ? groups->levels : MLD_LEVELS;
+
+	// the filters we pass on only depend on the first MLD_LEVELS - 1
+	if (!neighbour->groups || memcmp(neighbour->groups, groups->filters, (levels - 1) * MLD_FILTER_SIZE))
+		mld->changed = true;
+
+	// the last filter is the union of all levels
+	if (!neighbour->groups)
+		neighbour->groups = mmfd_alloc((MLD_LEVELS + 1) * MLD_FILTER_SIZE);
+
+	uint8_t *all = neighbour->groups + MLD_LEVELS * MLD_FILTER_SIZE;
+
+	memset(neighbour->groups, 0, (MLD_LEVELS + 1) * MLD_FILTER_SIZE);
+	memcpy(neighbour->groups, groups->filters, levels * MLD_FILTER_SIZE);
+
+	for (size_t level = 0; level < levels; level++) {
+		for (size_t k = 0; k < MLD_FILTER_SIZE; k++)
+			all[k] |= neighbour->groups[level * MLD_FILTER_SIZE + k];
+	}
+}
+
+/**
+ * mld_wants - tell whether a packet may reach a listener behind a neighbour
+ * @neighbour: the neighbour
+ * @group: the group of the packet
+ * @hop_limit: hops the packet may still travel when the neighbour gets it
+ *
+ * A listener d hops behind the neighbour is only reached if d is below
+ * @hop_limit, so the levels beyond that are not looked at.
+ *
+ * Return: true unless the neighbour advertised that no such listener is behind it
+ */
+bool mld_wants(const struct neighbour *neighbour, const struct in6_addr *group, uint8_t hop_limit) {
+	if (!neighbour->groups)
+		return true;
+
+	if (hop_limit >= MLD_LEVELS)
+		return filter_contains(neighbour->groups + MLD_LEVELS * MLD_FILTER_SIZE, group);
+
+	for (size_t level = 0; level < hop_limit; level++) {
+		if (filter_contains(neighbour->groups + level * MLD_FILTER_SIZE, group))
+			return true;
+	}
+
+	return false;
+}
+
+/** Reads the local groups and sends a hello early if anything changed */
+void mld_task(__attribute__ ((unused)) void *d) {
+	mld_update(&ctx.mld);
+
+	if (ctx.mld.changed)
+		intercom_send_hello();
+
+	post_task(&ctx.taskqueue_ctx, MLD_INTERVAL, 0, mld_task, NULL, NULL);
+}
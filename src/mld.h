@@ -0,0 +1,71 @@
+#pragma once
+
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define MLD_LEVELS 8          /* hops behind a neighbour that listeners are known for */
+#define MLD_FILTER_SIZE 64    /* bytes per bloom filter */
+#define MLD_MAX_GROUPS 256    /* local groups listed in get_stats */
+#define MLD_PROC "/proc/net/igmp6"
+#define MLD_INTERVAL 1        /* seconds between reads of MLD_PROC */
+#define MLD_BRIDGE "/sys/class/net/%s/bridge/%s"
+
+struct context;
+struct interface;
+struct neighbour;
+
+/* Follows the neighbours of a hello with HELLO_GROUPS in its flags */
+struct __attribute__((__packed__)) hello_groups {
+	uint8_t levels;     /**< number of filters */
+	uint8_t filters[];  /**< levels bloom filters of MLD_FILTER_SIZE bytes, the
+			     *   groups with listeners 0, 1, ... hops behind the sender */
+};
+
+/**
+ * Multicast listener aware pruning.
+ *
+ * The groups joined on the mmfd device and the interfaces given with -l
+ * are read from MLD_PROC every MLD_INTERVAL, for a bridge also those its
+ * ports learnt by MLD snooping from its MDB. A hello carries them as a
+ * bloom filter, followed by one filter per hop for the groups the
+ * neighbours of the sender advertised, up to MLD_LEVELS hops away. The
+ * filters of a neighbour are left out on an interface where everyone else
+ * hears it directly, which keeps them from coming back to it, and a group
+ * that still goes around a loop drops off after MLD_LEVELS hops. A packet
+ * is only sent to a neighbour that advertised its group on a level its
+ * hop limit still reaches, or to one that does not advertise groups at
+ * all. Groups of link scope and the all-nodes groups are always flooded.
+ * The MDB of a bridge is only complete if the bridge snoops and sends
+ * queries itself, otherwise the first filter has every bit set, so no
+ * group is pruned towards the listeners we cannot see.
+ * A hello goes out early when the groups here or the filters of a
+ * neighbour changed, so a new listener is known after about MLD_INTERVAL
+ * per hop.
+ */
+typedef struct {
+	bool enabled;
+	VECTOR(char *) ifnames;           /**< interfaces whose memberships count as listeners */
+	VECTOR(struct in6_addr) groups;   /**< joined on those */
+	bool changed;                     /**< a hello should tell the neighbours */
+	bool unknown;                     /**< a bridge hides its listeners, every group counts */
+
+	uint64_t flooded;    /**< packets flooded because of their scope */
+	uint64_t pruned;     /**< copies not sent since no listener is behind the neighbour */
+	uint64_t unwanted;   /**< packets not sent to anyone */
+	uint64_t updates;    /**< changes of the local groups */
+} mld_ctx;
+
+void mld_add_interface(mld_ctx *mld, char *ifname);
+void mld_fill(struct context *ctx, struct interface *iface, struct hello_groups *groups);
+void mld_read(mld_ctx *mld, struct neighbour *neighbour, const uint8_t *buffer, size_t len);
+void mld_task(void *d);
+bool mld_flooded(const struct in6_addr *group);
+bool mld_wants(const struct neighbour *neighbour, const struct in6_addr *group, uint8_t hop_limit);
+
+static inline bool mld_enabled(mld_ctx *mld) {
+	return mld->enabled;
+}
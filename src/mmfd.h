@@ -9,44 +9,221 @@
 #include <net/if.h>
 #include "taskqueue.h"
 #include "socket.h"
+#include "seen.h"
+#include "origin.h"
+#include "dupfilter.h"
+#include "gossip.h"
+#include "uring.h"
+#include "worker.h"
+#include "vnet.h"
+#include "tunqueue.h"
+#include "frag.h"
+#include "nack.h"
+#include "storm.h"
+#include "egress.h"
+#include "mld.h"
+#include "versioned.h"
+#include "etx.h"
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
 
 #define PORT 27275
+#define DEFAULT_MTU 1280
 #define HELLO_INTERVAL 10
+#define SEEN_WINDOW 30
+#define SEEN_MAX_ENTRIES 65536
+#define RX_BATCH_SIZE 32
+#define RX_BUFFER_SIZE 2048
+#define RX_HEADROOM 64           /* mmfd headers in front of a packet as big as the tun MTU */
+#define DATAGRAM_OVERHEAD 48     /* IPv6 and UDP header in front of every intercom datagram */
+#define RX_CONTROL_SIZE (CMSG_SPACE(sizeof(struct in6_pktinfo)) + CMSG_SPACE(sizeof(int)))
 #define FMT_NONCE "0x%08"PRIx64
 
 typedef struct interface {
 	char ifname[IFNAMSIZ];
 	int ifindex;
 	int unicastfd;
+	int mtu;   /**< smallest path MTU towards the group and the neighbours */
 	bool ok;
+	bool gso;  /**< the socket takes UDP_SEGMENT */
+	bool gro;  /**< the socket may return merged datagrams */
+	size_t mcast_threshold; /**< send to the intercom group from this many recipients on, 0: never */
+	VECTOR(struct neighbour *) neighbours; /**< neighbours reachable via this interface */
+	int *worker_fds;  /**< one SO_REUSEPORT socket per worker thread, NULL without workers */
 } interface;
 
+/** Hash table of all neighbours, keyed by address and interface index */
+typedef struct {
+	struct neighbour **buckets;
+	size_t mask;  /**< number of buckets - 1 */
+	size_t len;
+	uint64_t seed;
+} neighbour_table;
+
+/** Preallocated buffers for receiving a batch of datagrams with recvmmsg() */
+struct rx_batch {
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_in6 *addrs;
+	uint8_t *buffers;    /**< size buffers of buffer_size bytes */
+	uint8_t *control;    /**< size control message areas of RX_CONTROL_SIZE bytes */
+	size_t size;         /**< number of datagrams per syscall */
+	size_t buffer_size;
+};
+
+struct stats {
+	uint64_t hello_rx;
+	uint64_t hello_tx;
+	uint64_t hello_duplicates;
+	uint64_t data_rx;         /**< data packets received from neighbours */
+	uint64_t data_duplicates;
+	uint64_t data_tx;         /**< data packets sent to neighbours */
+	uint64_t data_tx_errors;
+	uint64_t data_tx_syscalls;
+	uint64_t data_tx_mcast;   /**< fan-outs replaced by a single multicast datagram */
+	uint64_t mpr_relayed;     /**< packets relayed for a neighbour that selected us */
+	uint64_t mpr_suppressed;  /**< new packets not relayed since their sender did not select us */
+	uint64_t bundles_tx;      /**< datagrams carrying more than one packet */
+	uint64_t bundled_tx;      /**< packets sent inside those */
+	uint64_t bundles_rx;
+	uint64_t bundled_rx;
+	uint64_t gso_sends;       /**< sends of several datagrams with UDP_SEGMENT */
+	uint64_t gso_segments;
+	uint64_t gro_reads;       /**< reads that returned several merged datagrams */
+	uint64_t gro_segments;
+	uint64_t local_rx;        /**< packets read from the tun device */
+	uint64_t tun_gso_reads;   /**< super-packets read from the tun device */
+	uint64_t tun_gso_segments;
+	uint64_t tun_coalesced_writes;  /**< super-packets written to the tun device */
+	uint64_t tun_coalesced_packets;
+	uint64_t rx_datagrams;    /**< datagrams received on intercom sockets */
+	uint64_t rx_syscalls;
+	uint64_t rx_truncated;    /**< datagrams bigger than the receive buffer */
+	uint64_t tx_too_big;      /**< sends refused with EMSGSIZE */
+	uint64_t versioned_rx;    /**< datagrams received with the versioned header */
+	uint64_t versioned_tx;    /**< packets sent with it, once per interface */
+	uint64_t version_mismatch;
+	uint64_t versioned_invalid;
+	uint64_t unknown_tlv;     /**< datagrams dropped for a critical extension we do not know */
+	uint64_t hop_limit_expired;   /**< datagrams received with a hop limit of 0 */
+	uint64_t hop_limit_exceeded;  /**< packets not forwarded since their hop limit was used up */
+};
+
 struct context {
-	VECTOR(struct neighbour) neighbours;
-	VECTOR(uint64_t) seen;
+	neighbour_table neighbours;
+	seen_cache seen;
+	seen_cache hello_seen;
+	seen_cache relayed;            /**< packets already relayed, only used with mpr */
+	origin_table origins;
+	dupfilter_ctx dupfilter;
+	gossip_ctx gossip;
 	VECTOR(interface) interfaces;
+	VECTOR(struct mmsghdr) fanout; /**< scratch space for forward_packet() */
+	struct rx_batch rx_batch;
+	struct stats stats;
 	taskqueue_ctx taskqueue_ctx;
 	socket_ctx socket_ctx;
 	struct sockaddr_in6 groupaddr;
 	int efd;
+	uring_ctx uring;        /**< replaces efd if the io_uring engine is used */
+	workers_ctx workers;
 	int tunfd;
+	VECTOR(int) tun_queues; /**< further queues of a multiqueue tun device */
+	bool tun_vnet;          /**< the tun device reads and writes a virtio header first */
+	bool tun_coalesce;      /**< write trains of packets as UDP super-packets */
+	struct vnet_train tun_train;
+	tunqueue_ctx tunqueue;  /**< packets for the tun device, written once per turn of the loop */
+	uint16_t mtu;           /**< of the tun device */
+	bool fragment;          /**< split datagrams that are too big for a link instead of leaving it to IPv6 */
+	frag_ctx frag;
+	nack_ctx nack;          /**< retransmission of sequenced packets lost on a link */
+	storm_ctx storm;        /**< rate limits for senders that flood the mesh */
+	egress_ctx egress;      /**< queues that order forwarded packets by priority */
+	mld_ctx mld;            /**< only send packets towards nodes with listeners */
+	bool versioned;         /**< send the versioned header to interfaces where every neighbour understands it */
+	uint8_t hop_limit;      /**< of local packets and those from older neighbours */
+	etx_ctx etx;            /**< link quality from the sequence numbers of hellos */
+	size_t mcast_threshold; /**< default for new interfaces */
+	long aggregation_us;    /**< how long packets wait for more to bundle with, 0: never bundle */
+	bool bundle_flush_pending;
+	bool offload;           /**< use UDP GSO and GRO where the kernel has them */
+	bool gso_pending;
+	uint32_t origin_id;
+	uint32_t seqno;
+	bool seqmode;
+	bool mpr;                      /**< only relay for neighbours that selected us */
 	bool verbose;
 	bool debug;
 };
 
 extern struct context ctx;
 
+/** Receive buffer for one datagram */
+static inline size_t rx_buffer_size(const struct context *ctx) {
+	size_t size = ctx->mtu + RX_HEADROOM;
+
+	return size > RX_BUFFER_SIZE ? size : RX_BUFFER_SIZE;
+}
+
 struct __attribute__((__packed__)) header {
 	uint64_t nonce;
 };
 
+/* These nonces read the same in either byte order. SEQ_MAGIC marks packets
+ * that carry an origin id and a sequence number instead of a random nonce,
+ * BUNDLE_MAGIC marks datagrams that carry several packets, FRAG_MAGIC
+ * fragments of a datagram, see frag.h, NACK_MAGIC requests to send
+ * sequenced packets again, see nack.h, and VERSIONED_MAGIC the versioned
+ * header, see versioned.h. */
+#define SEQ_MAGIC 0x6d6d666464666d6dull
+#define BUNDLE_MAGIC 0x6d6d666262666d6dull
+#define FRAG_MAGIC 0x6d6d666666666d6dull
+#define NACK_MAGIC 0x6d6d666e6e666d6dull
+#define VERSIONED_MAGIC 0x6d6d667676666d6dull
+
+struct __attribute__((__packed__)) seq_header {
+	struct header hdr; /**< hdr.nonce is SEQ_MAGIC */
+	uint32_t origin;   /**< network byte order */
+	uint32_t seq;      /**< network byte order */
+};
+
+/* A bundle is a header with BUNDLE_MAGIC followed by entries. Each entry is
+ * a complete datagram: a header and the packet it carries. */
+struct __attribute__((__packed__)) bundle_entry {
+	uint16_t len;      /**< length of data, network byte order */
+	uint8_t data[];
+};
+
 struct neighbour {
-	struct sockaddr_in6 address;
-	char *ifname;
+	struct sockaddr_in6 address; /**< ready to use as destination, sin6_scope_id is the ifindex */
+	char ifname[IFNAMSIZ];
 	taskqueue_t *timeout_task;
+	uint32_t node_id;            /**< origin id of the neighbour, valid if has_id */
+	bool has_id;                 /**< false for neighbours that send bare hellos */
+	bool selects_relays;         /**< the neighbour only lets its relays forward its packets */
+	bool mpr;                    /**< we selected this neighbour as relay */
+	bool mpr_selector;           /**< this neighbour selected us as relay */
+	VECTOR(uint32_t) two_hop;    /**< node ids of the neighbours of this neighbour */
+	uint8_t *groups;             /**< group filters it advertised and their union, NULL if it does not prune */
+	bool versioned;              /**< it understands the versioned header */
+	struct etx_link etx;         /**< quality of the link to it */
+	uint8_t *bundle;             /**< packets waiting to be sent as one datagram, allocated on first use */
+	size_t bundle_len;
+	unsigned int bundle_count;
+	uint8_t *gso;                /**< datagrams waiting for one segmented send, allocated on first use */
+	size_t gso_len;
+	uint16_t gso_size;           /**< size of all segments but the last */
+	unsigned int gso_segments;
+	struct neighbour *next;      /**< next neighbour in the same hash bucket */
 };
 
 void change_fd(int efd, int fd, int type, uint32_t events);
+bool is_nic_fd(int fd);
+void rx_batch_init(struct rx_batch *batch, size_t size, size_t buffer_size);
+void udp_handle_message(struct context *ctx, struct msghdr *message, uint8_t *buffer, size_t len);
+bool tun_packet_valid(uint8_t *buf, ssize_t count);
+void tun_handle_packet(struct context *ctx, uint8_t *buf, ssize_t count);
+void send_batch(struct context *ctx, interface *iface, struct mmsghdr *msgs, unsigned int n);
+bool forward_packet(struct context *ctx, uint8_t *packet, ssize_t len, struct header *hdr, size_t hdrlen, struct sockaddr_in6 *src_addr, bool legacy_only, uint8_t hop_limit);
 
@@ -0,0 +1,154 @@
+#include "mpr.h"
+#include "neighbour.h"
+#include "util.h"
+
+typedef VECTOR(struct neighbour *) neighbour_vector;
+typedef VECTOR(uint32_t) id_vector;
+
+static bool reaches(const struct neighbour *neighbour, uint32_t id) {
+	for (size_t i = 0; i < VECTOR_LEN(neighbour->two_hop); i++) {
+		if (VECTOR_INDEX(neighbour->two_hop, i) == id)
+			return true;
+	}
+
+	return false;
+}
+
+static bool contains(const id_vector *ids, uint32_t id) {
+	for (size_t i = 0; i < VECTOR_LEN(*ids); i++) {
+		if (VECTOR_INDEX(*ids, i) == id)
+			return true;
+	}
+
+	return false;
+}
+
+/** Drops all ids from uncovered that one of the selected relays reaches */
+static void cover(neighbour_vector *candidates, id_vector *uncovered) {
+	for (size_t i = VECTOR_LEN(*uncovered); i-- > 0;) {
+		for (size_t j = 0; j < VECTOR_LEN(*candidates); j++) {
+			struct neighbour *c = VECTOR_INDEX(*candidates, j);
+
+			if (c->mpr && reaches(c, VECTOR_INDEX(*uncovered, i))) {
+				VECTOR_DELETE(*uncovered, i);
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * mpr_select - choose the relays among our neighbours
+ * @ctx: the mmfd context
+ *
+ * Uses the heuristic of RFC 3626: first every neighbour that is the only
+ * way to some two-hop neighbour, then repeatedly the neighbour that reaches
+ * most of the two-hop neighbours not covered yet. Neighbourhoods are small,
+ * so plain linear searches are good enough here.
+ */
+void mpr_select(struct context *ctx) {
+	neighbour_vector candidates = {};
+	id_vector neighbour_ids = {};
+	id_vector uncovered = {};
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+
+			neighbour->mpr = false;
+			if (neighbour->has_id) {
+				VECTOR_ADD(candidates, neighbour);
+				VECTOR_ADD(neighbour_ids, neighbour->node_id);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < VECTOR_LEN(candidates); i++) {
+		struct neighbour *c = VECTOR_INDEX(candidates, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(c->two_hop); j++) {
+			uint32_t id = VECTOR_INDEX(c->two_hop, j);
+
+			if (id != ctx->origin_id && !contains(&neighbour_ids, id) && !contains(&uncovered, id))
+				VECTOR_ADD(uncovered, id);
+		}
+	}
+
+	for (size_t i = 0; i < VECTOR_LEN(uncovered); i++) {
+		struct neighbour *only = NULL;
+		size_t count = 0;
+
+		for (size_t j = 0; j < VECTOR_LEN(candidates); j++) {
+			if (reaches(VECTOR_INDEX(candidates, j), VECTOR_INDEX(uncovered, i))) {
+				only = VECTOR_INDEX(candidates, j);
+				count++;
+			}
+		}
+
+		if (count == 1)
+			only->mpr = true;
+	}
+
+	cover(&candidates, &uncovered);
+
+	while (VECTOR_LEN(uncovered)) {
+		struct neighbour *best = NULL;
+		size_t best_count = 0;
+
+		for (size_t i = 0; i < VECTOR_LEN(candidates); i++) {
+			struct neighbour *c = VECTOR_INDEX(candidates, i);
+			size_t count = 0;
+
+			if (c->mpr)
+				continue;
+
+			for (size_t j = 0; j < VECTOR_LEN(uncovered); j++)
+				count += reaches(c, VECTOR_INDEX(uncovered, j));
+
+			if (count > best_count) {
+				best = c;
+				best_count = count;
+			}
+		}
+
+		best->mpr = true;
+		cover(&candidates, &uncovered);
+	}
+
+	size_t relays = 0;
+	for (size_t i = 0; i < VECTOR_LEN(candidates); i++)
+		relays += VECTOR_INDEX(candidates, i)->mpr;
+
+	log_debug("selected %zu of %zu neighbours as relays\n", relays, VECTOR_LEN(candidates));
+
+	VECTOR_FREE(candidates);
+	VECTOR_FREE(neighbour_ids);
+	VECTOR_FREE(uncovered);
+}
+
+/**
+ * mpr_relay - decide whether a data packet is to be relayed now
+ * @ctx: the mmfd context
+ * @src_addr: the neighbour the packet came from
+ * @key: identifies the packet, the nonce or origin id and sequence number
+ *
+ * A packet is relayed once, as soon as a copy arrives from a neighbour that
+ * selected us as relay or that does not select relays at all. Copies from
+ * other neighbours do not use up that chance.
+ *
+ * Return: true if the packet is to be forwarded to all neighbours
+ */
+bool mpr_relay(struct context *ctx, struct sockaddr_in6 *src_addr, uint64_t key) {
+	struct neighbour *src = neighbour_find(ctx, &src_addr->sin6_addr, src_addr->sin6_scope_id);
+
+	if (src && src->selects_relays && !src->mpr_selector)
+		return false;
+
+	if (!seen_add(&ctx->relayed, key))
+		return false;
+
+	ctx->stats.mpr_relayed++;
+	return true;
+}
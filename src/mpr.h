@@ -0,0 +1,16 @@
+#pragma once
+
+#include "mmfd.h"
+
+/**
+ * Multipoint relays as in OLSR (RFC 3626).
+ *
+ * Every node advertises its neighbours in its hellos. From that each node
+ * knows its two-hop neighbourhood and selects a small set of neighbours, its
+ * relays, that together reach all of it. A node only relays packets it
+ * received from a neighbour that selected it, so a flood still reaches every
+ * node but most nodes stay silent.
+ */
+
+void mpr_select(struct context *ctx);
+bool mpr_relay(struct context *ctx, struct sockaddr_in6 *src_addr, uint64_t key);
@@ -0,0 +1,312 @@
+#include "nack.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "intercom.h"
+#include "timespec.h"
+#include "util.h"
+
+#include <string.h>
+
+#define NACK_MAX_SEQS ((RX_BUFFER_SIZE - sizeof(struct nack_header)) / sizeof(uint32_t))
+
+/**
+ * nack_init - set up the retransmission cache
+ * @nack: the context to initialize
+ * @size: number of packets to keep, 0 disables retransmissions
+ * @slot_size: largest datagram that is kept
+ * @rate: retransmissions per second
+ */
+void nack_init(nack_ctx *nack, size_t size, size_t slot_size, unsigned int rate) {
+	memset(nack, 0, sizeof(*nack));
+	VECTOR_INIT(nack->pending);
+
+	nack->size = size;
+	nack->slot_size = slot_size;
+	nack->rate = rate;
+	nack->tokens = rate;
+	nack->refilled = monotonic_ms();
+
+	if (!size)
+		return;
+
+	nack->slots = mmfd_alloc(size * slot_size);
+	nack->entries = mmfd_new0_array(size, struct nack_entry);
+
+	for (size_t i = 0; i < size; i++)
+		nack->entries[i].data = nack->slots + i * slot_size;
+
+	size_t buckets = 1;
+
+	while (buckets < size)
+		buckets *= 2;
+
+	nack->buckets = mmfd_new_array(buckets, uint32_t);
+	nack->mask = buckets - 1;
+	obtainrandom(&nack->seed, sizeof(nack->seed), 0);
+
+	for (size_t i = 0; i < buckets; i++)
+		nack->buckets[i] = NACK_NONE;
+}
+
+static uint32_t *nack_bucket(nack_ctx *nack, uint64_t key) {
+	return &nack->buckets[hash64(key ^ nack->seed) & nack->mask];
+}
+
+/** Takes the entry that is about to be overwritten out of its hash chain */
+static void nack_unlink(nack_ctx *nack, uint32_t index) {
+	for (uint32_t *n = nack_bucket(nack, nack->entries[index].key); *n != NACK_NONE; n = &nack->entries[*n].next) {
+		if (*n == index) {
+			*n = nack->entries[index].next;
+			return;
+		}
+	}
+}
+
+/**
+ * nack_cache_add - keep a copy of a sequenced packet
+ * @nack: the context
+ * @key: origin id and sequence number
+ * @hdr: the sequence header
+ * @hdrlen: its length
+ * @packet: the packet
+ * @len: its length
+ */
+void nack_cache_add(nack_ctx *nack, uint64_t key, struct header *hdr, size_t hdrlen, const uint8_t *packet, size_t len) {
+	if (hdrlen + len > nack->slot_size)
+		return;
+
+	uint32_t index = nack->head;
+	struct nack_entry *entry = &nack->entries[index];
+
+	if (nack->len == nack->size)
+		nack_unlink(nack, index);
+
+	// newer copies come first in the chain
+	uint32_t *bucket = nack_bucket(nack, key);
+
+	entry->next = *bucket;
+	*bucket = index;
+	entry->key = key;
+	entry->len = hdrlen + len;
+	memcpy(entry->data, hdr, hdrlen);
+	memcpy(entry->data + hdrlen, packet, len);
+
+	nack->head = (nack->head + 1) % nack->size;
+	if (nack->len < nack->size)
+		nack->len++;
+}
+
+static struct nack_entry *nack_cache_find(nack_ctx *nack, uint64_t key) {
+	for (uint32_t i = *nack_bucket(nack, key); i != NACK_NONE; i = nack->entries[i].next) {
+		if (nack->entries[i].key == key)
+			return &nack->entries[i];
+	}
+
+	return NULL;
+}
+
+static void nack_send(struct context *ctx, struct sockaddr_in6 *dst, const void *data, size_t len) {
+	interface *iface = find_interface_by_index(dst->sin6_scope_id);
+
+	if (!iface)
+		return;
+
+	struct iovec iov = {
+		.iov_base = (void *)data,
+		.iov_len = len,
+	};
+	struct mmsghdr msg = {
+		.msg_hdr = {
+			.msg_name = dst,
+			.msg_namelen = sizeof(struct sockaddr_in6),
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+		},
+	};
+
+	send_batch(ctx, iface, &msg, 1);
+}
+
+static bool same_neighbour(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+	return a->sin6_scope_id == b->sin6_scope_id && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+/** Sends NACKs for the missing packets that are due, drops those that arrived */
+static void nack_task(__attribute__ ((unused)) void *d) {
+	nack_ctx *nack = &ctx.nack;
+	uint64_t now = monotonic_ms();
+	uint8_t buffer[RX_BUFFER_SIZE];
+	struct nack_header *nh = (struct nack_header *)buffer;
+	struct sockaddr_in6 dst;
+	size_t n = 0, kept = 0;
+
+	nack->task_pending = false;
+
+	for (size_t i = 0; i < VECTOR_LEN(nack->pending); i++) {
+		struct nack_request *r = &VECTOR_INDEX(nack->pending, i);
+
+		if (origin_seen(&ctx.origins, r->origin, r->seq)) {
+			if (r->tries)
+				nack->recovered++;
+			continue;
+		}
+
+		if (r->due > now) {
+			VECTOR_INDEX(nack->pending, kept++) = *r;
+			continue;
+		}
+
+		if (r->tries == NACK_RETRIES) {
+			nack->unrecovered++;
+			continue;
+		}
+
+		// requests for the same origin from the same neighbour share a NACK
+		if (n && (n == NACK_MAX_SEQS || ntohl(nh->origin) != r->origin || !same_neighbour(&dst, &r->neighbour))) {
+			nh->count = htons(n);
+			nack_send(&ctx, &dst, buffer, sizeof(*nh) + n * sizeof(uint32_t));
+			nack->nacks_tx++;
+			n = 0;
+		}
+
+		if (!n) {
+			nh->nonce = NACK_MAGIC;
+			nh->origin = htonl(r->origin);
+			dst = r->neighbour;
+		}
+
+		nh->seqs[n++] = htonl(r->seq);
+
+		r->tries++;
+		r->due = now + NACK_INTERVAL;
+		VECTOR_INDEX(nack->pending, kept++) = *r;
+	}
+
+	if (n) {
+		nh->count = htons(n);
+		nack_send(&ctx, &dst, buffer, sizeof(*nh) + n * sizeof(uint32_t));
+		nack->nacks_tx++;
+	}
+
+	VECTOR_RESIZE(nack->pending, kept);
+
+	if (kept) {
+		nack->task_pending = true;
+		post_task(&ctx.taskqueue_ctx, 0, NACK_DELAY, nack_task, NULL, NULL);
+	}
+}
+
+/**
+ * nack_observe - look for a gap before a sequenced packet from a neighbour
+ * @ctx: the mmfd context
+ * @src_addr: the neighbour
+ * @origin: the origin of the packet
+ * @seq: its sequence number
+ *
+ * To be called before the packet is checked against the origin table.
+ */
+void nack_observe(struct context *ctx, struct sockaddr_in6 *src_addr, uint32_t origin, uint32_t seq) {
+	nack_ctx *nack = &ctx->nack;
+	uint32_t top;
+
+	if (!origin_top(&ctx->origins, origin, &top))
+		return;
+
+	int32_t d = (int32_t)(seq - top);
+
+	if (d <= 1)
+		return;
+
+	uint32_t missing = d - 1 < NACK_MAX_GAP ? d - 1 : NACK_MAX_GAP;
+	uint64_t due = monotonic_ms() + NACK_DELAY;
+
+	for (uint32_t s = seq - missing; s != seq; s++) {
+		if (VECTOR_LEN(nack->pending) == NACK_MAX_PENDING)
+			break;
+
+		struct nack_request r = {
+			.neighbour = *src_addr,
+			.origin = origin,
+			.seq = s,
+			.due = due,
+		};
+
+		VECTOR_ADD(nack->pending, r);
+		nack->gaps++;
+	}
+
+	if (!nack->task_pending && VECTOR_LEN(nack->pending)) {
+		nack->task_pending = true;
+		post_task(&ctx->taskqueue_ctx, 0, NACK_DELAY, nack_task, NULL, NULL);
+	}
+}
+
+/** Takes a retransmission token, there are up to rate of them per second */
+static bool nack_take_token(nack_ctx *nack) {
+	uint64_t now = monotonic_ms();
+
+	nack->tokens += (now - nack->refilled) * nack->rate / 1000.0;
+	nack->refilled = now;
+
+	if (nack->tokens > nack->rate)
+		nack->tokens = nack->rate;
+
+	if (nack->tokens < 1)
+		return false;
+
+	nack->tokens--;
+	return true;
+}
+
+/**
+ * nack_handle - answer a NACK from a neighbour
+ * @ctx: the mmfd context
+ * @src_addr: the neighbour
+ * @buffer: the NACK
+ * @len: its length
+ */
+void nack_handle(struct context *ctx, struct sockaddr_in6 *src_addr, const uint8_t *buffer, size_t len) {
+	nack_ctx *nack = &ctx->nack;
+	struct nack_header nh;
+
+	if (len < sizeof(nh))
+		return;
+
+	memcpy(&nh, buffer, sizeof(nh));
+	nack->nacks_rx++;
+
+	if (!nack_enabled(nack))
+		return;
+
+	size_t count = ntohs(nh.count);
+
+	if (count > (len - sizeof(nh)) / sizeof(uint32_t))
+		count = (len - sizeof(nh)) / sizeof(uint32_t);
+
+	for (size_t i = 0; i < count; i++) {
+		uint32_t seq;
+
+		memcpy(&seq, buffer + sizeof(nh) + i * sizeof(seq), sizeof(seq));
+		nack->requested++;
+
+		// the rest of the NACK waits for tokens as well, so it is not
+		// even looked up
+		if (!nack_take_token(nack)) {
+			nack->requested += count - i - 1;
+			nack->rate_limited += count - i;
+			return;
+		}
+
+		struct nack_entry *entry = nack_cache_find(nack, (uint64_t)ntohl(nh.origin) << 32 | ntohl(seq));
+
+		if (!entry) {
+			nack->not_cached++;
+			continue;
+		}
+
+		log_verbose("Retransmitting packet %" PRIu32 " of origin 0x%08" PRIx32 " to %s\n",
+			    ntohl(seq), ntohl(nh.origin), print_ip(&src_addr->sin6_addr));
+		nack_send(ctx, src_addr, entry->data, entry->len);
+		nack->retransmitted++;
+	}
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define NACK_RATE 200        /* retransmissions per second */
+#define NACK_DELAY 20        /* milliseconds a gap may take to fill by itself */
+#define NACK_INTERVAL 50     /* milliseconds between NACKs for the same packet */
+#define NACK_RETRIES 3
+#define NACK_MAX_GAP 32      /* missing packets asked for per gap */
+#define NACK_MAX_PENDING 256
+#define NACK_NONE UINT32_MAX  /* end of a hash chain */
+
+struct context;
+struct header;
+
+/* A NACK asks a neighbour to send sequenced packets of one origin again */
+struct __attribute__((__packed__)) nack_header {
+	uint64_t nonce;    /**< NACK_MAGIC */
+	uint32_t origin;   /**< network byte order */
+	uint16_t count;    /**< number of sequence numbers that follow, network byte order */
+	uint32_t seqs[];   /**< network byte order */
+};
+
+/** A copy of a packet we sent or accepted, as it went out */
+struct nack_entry {
+	uint64_t key;      /**< origin id and sequence number */
+	uint32_t next;     /**< next entry in the same hash bucket, NACK_NONE at the end */
+	size_t len;
+	uint8_t *data;     /**< sequence header followed by the packet */
+};
+
+/** A missing packet we are asking for */
+struct nack_request {
+	struct sockaddr_in6 neighbour;  /**< the neighbour whose packet showed the gap */
+	uint32_t origin;
+	uint32_t seq;
+	uint64_t due;                   /**< monotonic_ms() of the next NACK */
+	unsigned int tries;
+};
+
+/**
+ * NACK-based retransmission of sequenced packets.
+ *
+ * Every node keeps the last size packets it originated or accepted. When a
+ * sequence number of an origin is skipped, the packets in between are
+ * asked for from the neighbour that sent the packet after the gap, unless
+ * they show up within NACK_DELAY by themselves. A neighbour answers from
+ * its cache, which is hashed by origin id and sequence number, limited to
+ * rate retransmissions per second. Every sequence number asked for takes a
+ * token, whether it is cached or not.
+ */
+typedef struct {
+	size_t size;                 /**< cached packets, 0 if disabled */
+	size_t slot_size;
+	uint8_t *slots;
+	struct nack_entry *entries;  /**< ring of size entries */
+	size_t head;                 /**< next entry to overwrite */
+	size_t len;
+	uint32_t *buckets;           /**< first entry of each hash chain, NACK_NONE if empty */
+	size_t mask;                 /**< number of buckets - 1 */
+	uint64_t seed;
+
+	VECTOR(struct nack_request) pending;
+	bool task_pending;
+
+	unsigned int rate;
+	double tokens;
+	uint64_t refilled;           /**< monotonic_ms() of the last refill */
+
+	uint64_t gaps;               /**< missing packets detected */
+	uint64_t nacks_tx;
+	uint64_t nacks_rx;
+	uint64_t requested;          /**< packets neighbours asked us for */
+	uint64_t retransmitted;
+	uint64_t not_cached;
+	uint64_t rate_limited;
+	uint64_t recovered;          /**< missing packets that arrived after a NACK */
+	uint64_t unrecovered;        /**< missing packets given up on */
+} nack_ctx;
+
+void nack_init(nack_ctx *nack, size_t size, size_t slot_size, unsigned int rate);
+void nack_cache_add(nack_ctx *nack, uint64_t key, struct header *hdr, size_t hdrlen, const uint8_t *packet, size_t len);
+void nack_observe(struct context *ctx, struct sockaddr_in6 *src_addr, uint32_t origin, uint32_t seq);
+void nack_handle(struct context *ctx, struct sockaddr_in6 *src_addr, const uint8_t *buffer, size_t len);
+
+static inline bool nack_enabled(nack_ctx *nack) {
+	return nack->size > 0;
+}
@@ -1,5 +1,6 @@
 #include "neighbour.h"
 #include "mmfd.h"
+#include "intercom.h"
 #include "util.h"
 #include "alloc.h"
 
@@ -12,118 +13,193 @@
 void print_neighbours() {
 	puts("neighbours:");
 
-	for (size_t i = 0; i < VECTOR_LEN(ctx.neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx.neighbours, i);
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
 
-		printf(" - %s on %s\n", print_ip(&neighbour->address.sin6_addr), neighbour->ifname);
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+
+			printf(" - %s on %s\n", print_ip(&neighbour->address.sin6_addr), neighbour->ifname);
+		}
 	}
 }
 
-bool cmp_neighbour(struct neighbour *neighbour, struct in6_addr *address, char *ifname) {
-	bool is_sameif = (ifname && neighbour && neighbour->ifname) ? strncmp(ifname, neighbour->ifname, IFNAMSIZ) == 0 : 0;
-	bool is_sameaddress = (memcmp(address, &(neighbour->address.sin6_addr), sizeof(struct in6_addr)) == 0);
-	return is_sameif && is_sameaddress;
+static size_t neighbour_bucket(neighbour_table *table, const struct in6_addr *address, unsigned int ifindex) {
+	uint64_t a, b;
+
+	memcpy(&a, &address->s6_addr[0], sizeof(a));
+	memcpy(&b, &address->s6_addr[8], sizeof(b));
+
+	return hash64(a ^ hash64(b ^ ifindex ^ table->seed)) & table->mask;
 }
 
-struct neighbour *find_neighbour(struct context *ctx, struct in6_addr *address, char *ifname) {
-	if (!ifname || !address)
-		return NULL;
+static void neighbour_table_resize(neighbour_table *table, size_t buckets) {
+	struct neighbour **old = table->buckets;
+	size_t old_buckets = old ? table->mask + 1 : 0;
+
+	table->buckets = mmfd_new0_array(buckets, struct neighbour *);
+	table->mask = buckets - 1;
 
-	for (size_t i = 0; i < VECTOR_LEN(ctx->neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx->neighbours, i);
+	for (size_t i = 0; i < old_buckets; i++) {
+		struct neighbour *next;
+		for (struct neighbour *n = old[i]; n; n = next) {
+			next = n->next;
 
-		if (cmp_neighbour(neighbour, address, ifname))
-			return neighbour;
+			size_t b = neighbour_bucket(table, &n->address.sin6_addr, n->address.sin6_scope_id);
+			n->next = table->buckets[b];
+			table->buckets[b] = n;
+		}
 	}
 
-	return NULL;
+	free(old);
 }
 
-void copy_neighbour(struct neighbour *dest, struct neighbour *source) {
-	memcpy(dest, source, sizeof(struct neighbour));
-	dest->ifname = source->ifname ? mmfd_strdup(source->ifname) : NULL;
+void neighbour_table_init(neighbour_table *table) {
+	memset(table, 0, sizeof(*table));
+	obtainrandom(&table->seed, sizeof(table->seed), 0);
+	neighbour_table_resize(table, NEIGHBOUR_MIN_BUCKETS);
 }
 
-void free_neighbour_members(struct neighbour *neighbour) {
-	free(neighbour->ifname);
-}
+struct neighbour *neighbour_find(struct context *ctx, const struct in6_addr *address, unsigned int ifindex) {
+	if (!address)
+		return NULL;
 
-void free_neighbour(struct neighbour *neighbour) {
-	free_neighbour_members(neighbour);
-	free(neighbour);
-}
+	neighbour_table *table = &ctx->neighbours;
 
-void free_neighbour_task(void *neighbour) {
-	free_neighbour((struct neighbour*)neighbour);
+	for (struct neighbour *n = table->buckets[neighbour_bucket(table, address, ifindex)]; n; n = n->next) {
+		if (n->address.sin6_scope_id == ifindex && !memcmp(address, &n->address.sin6_addr, sizeof(*address)))
+			return n;
+	}
+
+	return NULL;
 }
 
 void neighbour_remove_task(void *d) {
 	struct neighbour *n = (struct neighbour*)d;
 	log_verbose("removing neighbour %s%%%s\n", print_ip(&n->address.sin6_addr), n->ifname);
-	neighbour_remove(&ctx, &(n->address.sin6_addr), n->ifname);
+
+	// the task is being run and freed by the taskqueue right now
+	n->timeout_task = NULL;
+	neighbour_remove(&ctx, n);
 }
 
-struct neighbour *add_neighbour(struct context *ctx, struct in6_addr *address, char *ifname, size_t ifindex) {
-	struct neighbour neighbour = {
-		.ifname = mmfd_strdup(ifname),
-		.address = {},
-	};
+static struct neighbour *neighbour_add(struct context *ctx, const struct in6_addr *address, interface *iface) {
+	neighbour_table *table = &ctx->neighbours;
+	struct neighbour *neighbour = mmfd_new0(struct neighbour);
 
-	log_verbose("copying ip %s from hello packet on interface %s\n", print_ip(address), ifname);
-	memcpy(&neighbour.address.sin6_addr, address, sizeof(struct in6_addr));
-	neighbour.address.sin6_family = AF_INET6;
-	neighbour.address.sin6_port = htons(PORT);
-	neighbour.address.sin6_scope_id = ifindex;
+	log_verbose("copying ip %s from hello packet on interface %s\n", print_ip(address), iface->ifname);
+	neighbour->address.sin6_family = AF_INET6;
+	neighbour->address.sin6_addr = *address;
+	neighbour->address.sin6_port = htons(PORT);
+	neighbour->address.sin6_scope_id = iface->ifindex;
+	strncpy(neighbour->ifname, iface->ifname, IFNAMSIZ - 1);
 
+	if (table->len >= table->mask + 1)
+		neighbour_table_resize(table, (table->mask + 1) * 2);
 
-	struct neighbour *neighbour_task_data = mmfd_alloc(sizeof(struct neighbour));
-	copy_neighbour(neighbour_task_data, &neighbour);
-	neighbour.timeout_task = post_task(&ctx->taskqueue_ctx, HELLO_INTERVAL * 5, 0, neighbour_remove_task, free_neighbour_task, neighbour_task_data);
-	VECTOR_ADD(ctx->neighbours, neighbour);
-	return &VECTOR_INDEX(ctx->neighbours, VECTOR_LEN(ctx->neighbours) - 1);
+	size_t b = neighbour_bucket(table, address, iface->ifindex);
+	neighbour->next = table->buckets[b];
+	table->buckets[b] = neighbour;
+	table->len++;
+
+	VECTOR_ADD(iface->neighbours, neighbour);
+	ctx->workers.dirty = true;
+
+	neighbour->timeout_task = post_task(&ctx->taskqueue_ctx, HELLO_INTERVAL * 5, 0, neighbour_remove_task, NULL, neighbour);
+	return neighbour;
 }
 
-void neighbour_remove(struct context *ctx, struct in6_addr *address, char *ifname) {
-	for (size_t i = 0; i < VECTOR_LEN(ctx->neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx->neighbours, i);
+/** Removes a neighbour from the hash table and frees it */
+static void neighbour_free(struct context *ctx, struct neighbour *neighbour) {
+	neighbour_table *table = &ctx->neighbours;
+	size_t b = neighbour_bucket(table, &neighbour->address.sin6_addr, neighbour->address.sin6_scope_id);
 
-		if (cmp_neighbour(neighbour, address, ifname)) {
-			free_neighbour_members(neighbour);
-			VECTOR_DELETE(ctx->neighbours, i);
+	for (struct neighbour **n = &table->buckets[b]; *n; n = &(*n)->next) {
+		if (*n == neighbour) {
+			*n = neighbour->next;
+			table->len--;
 			break;
 		}
 	}
-}
 
-void neighbour_add(struct context *ctx, struct in6_addr *address, char *ifname) {
-	unsigned int ifindex = if_nametoindex(ifname);
+	if (neighbour->timeout_task)
+		drop_task(neighbour->timeout_task);
+
+	VECTOR_FREE(neighbour->two_hop);
+	VECTOR_FREE(neighbour->etx.two_hop);
+	free(neighbour->bundle);
+	free(neighbour->gso);
+	free(neighbour->groups);
+	free(neighbour);
+}
 
-	if (ifindex == 0) {
-		perror("Cannot find interface for neighbour");
-		return;
+/**
+ * neighbour_remove - forget a neighbour
+ * @ctx: the mmfd context
+ * @neighbour: the neighbour, it is freed
+ */
+void neighbour_remove(struct context *ctx, struct neighbour *neighbour) {
+	// the interface may have been recreated with another index since
+	interface *iface = find_interface_by_name(neighbour->ifname);
+
+	for (size_t i = 0; iface && i < VECTOR_LEN(iface->neighbours); i++) {
+		if (VECTOR_INDEX(iface->neighbours, i) == neighbour) {
+			VECTOR_DELETE(iface->neighbours, i);
+			ctx->workers.dirty = true;
+			break;
+		}
 	}
 
-	add_neighbour(ctx, address, ifname, ifindex);
+	neighbour_free(ctx, neighbour);
+
+	etx_forget(ctx);
 }
 
-void neighbour_change(struct context *ctx, struct in6_addr *address, char *ifname) {
+/**
+ * neighbour_change - note a hello from a neighbour
+ * @ctx: the mmfd context
+ * @address: address of the neighbour
+ * @ifindex: index of the interface the hello arrived on
+ *
+ * Return: the neighbour, or NULL if the interface is not a mesh interface
+ */
+struct neighbour *neighbour_change(struct context *ctx, const struct in6_addr *address, unsigned int ifindex) {
 
-	struct neighbour *neighbour = find_neighbour(ctx, address, ifname);
+	struct neighbour *neighbour = neighbour_find(ctx, address, ifindex);
 
 	if (neighbour == NULL) {
+		interface *iface = find_interface_by_index(ifindex);
+
+		if (!iface) {
+			log_verbose("ignoring neighbour %s on unknown interface %u\n", print_ip(address), ifindex);
+			return NULL;
+		}
+
 		log_verbose("did not find changed neighbour, adding\n");
-		neighbour_add(ctx, address, ifname);
-		return;
-	} else {
-		reschedule_task(&ctx->taskqueue_ctx, neighbour->timeout_task, 5 * HELLO_INTERVAL, 0);
+		return neighbour_add(ctx, address, iface);
 	}
+
+	reschedule_task(&ctx->taskqueue_ctx, neighbour->timeout_task, 5 * HELLO_INTERVAL, 0);
+	return neighbour;
 }
 
-void flush_neighbours(struct context *ctx) {
-	for (size_t i = 0; i < VECTOR_LEN(ctx->neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx->neighbours, i);
+/**
+ * flush_neighbours - forget all neighbours on an interface
+ * @ctx: the mmfd context
+ * @iface: the interface, or NULL for all interfaces
+ */
+void flush_neighbours(struct context *ctx, interface *iface) {
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *cur = &VECTOR_INDEX(ctx->interfaces, i);
+
+		if (iface && iface != cur)
+			continue;
 
-		free_neighbour_members(neighbour);
-		VECTOR_DELETE(ctx->neighbours, i);
+		for (size_t j = 0; j < VECTOR_LEN(cur->neighbours); j++)
+			neighbour_free(ctx, VECTOR_INDEX(cur->neighbours, j));
+
+		VECTOR_RESIZE(cur->neighbours, 0);
 	}
+
+	ctx->workers.dirty = true;
 }
@@ -4,9 +4,12 @@
 
 #include <netinet/in.h>
 
-void neighbour_add(struct context *ctx, struct in6_addr *address, char *ifname);
-void neighbour_change(struct context *ctx, struct in6_addr *address, char *ifname);
-void neighbour_remove(struct context *ctx, struct in6_addr *address, char *ifname);
+#define NEIGHBOUR_MIN_BUCKETS 16
 
-void flush_neighbours(struct context *ctx);
+void neighbour_table_init(neighbour_table *table);
+struct neighbour *neighbour_find(struct context *ctx, const struct in6_addr *address, unsigned int ifindex);
+struct neighbour *neighbour_change(struct context *ctx, const struct in6_addr *address, unsigned int ifindex);
+void neighbour_remove(struct context *ctx, struct neighbour *neighbour);
+
+void flush_neighbours(struct context *ctx, interface *iface);
 void print_neighbours();
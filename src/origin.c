@@ -0,0 +1,176 @@
+#include "origin.h"
+#include "alloc.h"
+#include "timespec.h"
+#include "util.h"
+
+#include <string.h>
+
+#define ORIGIN_WORDS (ORIGIN_WINDOW / 64)
+
+static struct origin *origin_find(origin_table *origins, uint32_t id) {
+	size_t i = hash64(id ^ origins->seed) & origins->table_mask;
+
+	while (origins->table[i].used && origins->table[i].id != id)
+		i = (i + 1) & origins->table_mask;
+
+	return &origins->table[i];
+}
+
+/** Moves all origins that are still alive into a table with the given number of slots */
+static void origin_rebuild(origin_table *origins, size_t slots, uint64_t now) {
+	struct origin *old = origins->table;
+	size_t old_slots = old ? origins->table_mask + 1 : 0;
+
+	origins->table = mmfd_new0_array(slots, struct origin);
+	origins->table_mask = slots - 1;
+	origins->len = 0;
+
+	for (size_t i = 0; i < old_slots; i++) {
+		if (!old[i].used || now - old[i].last_seen > ORIGIN_TIMEOUT * 1000ull)
+			continue;
+
+		*origin_find(origins, old[i].id) = old[i];
+		origins->len++;
+	}
+
+	free(old);
+}
+
+/** Shifts the window of an origin up by d sequence numbers */
+static void origin_advance(struct origin *o, uint32_t d) {
+	if (d >= ORIGIN_WINDOW) {
+		memset(o->window, 0, sizeof(o->window));
+		return;
+	}
+
+	size_t q = d / 64, r = d % 64;
+
+	for (size_t i = ORIGIN_WORDS; i-- > 0;) {
+		uint64_t w = 0;
+
+		if (i >= q) {
+			w = o->window[i - q] << r;
+			if (r && i > q)
+				w |= o->window[i - q - 1] >> (64 - r);
+		}
+
+		o->window[i] = w;
+	}
+}
+
+void origin_init(origin_table *origins) {
+	memset(origins, 0, sizeof(*origins));
+	obtainrandom(&origins->seed, sizeof(origins->seed), 0);
+	origin_rebuild(origins, ORIGIN_MIN_SLOTS, monotonic_ms());
+}
+
+/**
+ * origin_check - check a sequence number of an origin and remember it
+ * @origins: the origin table
+ * @id: the id of the origin node
+ * @seq: the sequence number of the packet
+ *
+ * Sequence numbers are compared in serial number arithmetic, so they may
+ * wrap around.
+ *
+ * Return: true if the packet is new, false if it was seen before or is too
+ * old to tell
+ */
+bool origin_check(origin_table *origins, uint32_t id, uint32_t seq) {
+	uint64_t now = monotonic_ms();
+	struct origin *o = origin_find(origins, id);
+
+	if (!o->used) {
+		if ((origins->len + 1) * 2 > origins->table_mask + 1) {
+			origin_rebuild(origins, (origins->table_mask + 1) * 2, now);
+			o = origin_find(origins, id);
+		}
+
+		*o = (struct origin){
+			.id = id, .top = seq, .last_seen = now, .used = true,
+		};
+		o->window[0] = 1;
+		origins->len++;
+		return true;
+	}
+
+	o->last_seen = now;
+
+	int32_t d = (int32_t)(seq - o->top);
+
+	if (d > 0) {
+		origin_advance(o, d);
+		o->top = seq;
+		o->window[0] |= 1;
+		return true;
+	}
+
+	uint32_t age = -d;
+
+	if (age >= ORIGIN_WINDOW) {
+		origins->too_old++;
+		return false;
+	}
+
+	uint64_t bit = 1ull << (age % 64);
+
+	if (o->window[age / 64] & bit) {
+		origins->replayed++;
+		return false;
+	}
+
+	o->window[age / 64] |= bit;
+	return true;
+}
+
+/**
+ * origin_top - look up the highest sequence number seen from an origin
+ * @origins: the origin table
+ * @id: the id of the origin node
+ * @top: set to the sequence number
+ *
+ * Return: false if nothing was seen from the origin yet
+ */
+bool origin_top(origin_table *origins, uint32_t id, uint32_t *top) {
+	struct origin *o = origin_find(origins, id);
+
+	if (!o->used)
+		return false;
+
+	*top = o->top;
+	return true;
+}
+
+/**
+ * origin_seen - check a sequence number of an origin without remembering it
+ * @origins: the origin table
+ * @id: the id of the origin node
+ * @seq: the sequence number
+ *
+ * Return: true if the packet was seen or is too old to tell
+ */
+bool origin_seen(origin_table *origins, uint32_t id, uint32_t seq) {
+	struct origin *o = origin_find(origins, id);
+
+	if (!o->used)
+		return false;
+
+	int32_t d = (int32_t)(seq - o->top);
+
+	if (d > 0)
+		return false;
+
+	uint32_t age = -d;
+
+	return age >= ORIGIN_WINDOW || o->window[age / 64] & 1ull << (age % 64);
+}
+
+/** Forgets origins that have been silent for ORIGIN_TIMEOUT and shrinks the table */
+void origin_expire(origin_table *origins) {
+	size_t slots = origins->table_mask + 1;
+
+	while (slots / 2 >= ORIGIN_MIN_SLOTS && origins->len * 4 < slots)
+		slots /= 2;
+
+	origin_rebuild(origins, slots, monotonic_ms());
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define ORIGIN_WINDOW 256   /* sequence numbers tracked per origin, multiple of 64 */
+#define ORIGIN_TIMEOUT 300  /* seconds after which a silent origin is forgotten */
+#define ORIGIN_MIN_SLOTS 64
+
+/**
+ * Anti-replay state of one origin, as in IPsec: the highest sequence number
+ * seen so far and a bitmap of which of the ORIGIN_WINDOW sequence numbers
+ * below it have been seen.
+ */
+struct origin {
+	uint32_t id;
+	uint32_t top;       /**< highest sequence number seen */
+	uint64_t last_seen; /**< milliseconds, monotonic_ms() */
+	uint64_t window[ORIGIN_WINDOW / 64]; /**< bit i is set if top - i was seen */
+	bool used;
+};
+
+/** An open-addressing hash table of origins keyed by origin id */
+typedef struct {
+	struct origin *table;
+	size_t table_mask;  /**< number of slots - 1 */
+	size_t len;
+	uint64_t seed;
+
+	uint64_t replayed;  /**< duplicates inside the window */
+	uint64_t too_old;   /**< packets that fell behind the window */
+} origin_table;
+
+void origin_init(origin_table *origins);
+bool origin_check(origin_table *origins, uint32_t id, uint32_t seq);
+bool origin_top(origin_table *origins, uint32_t id, uint32_t *top);
+bool origin_seen(origin_table *origins, uint32_t id, uint32_t seq);
+void origin_expire(origin_table *origins);
@@ -0,0 +1,170 @@
+#include "seen.h"
+#include "alloc.h"
+#include "timespec.h"
+#include "util.h"
+
+#include <string.h>
+
+static inline size_t seen_slot(const seen_cache *cache, uint64_t nonce) {
+	return hash64(nonce ^ cache->seed) & cache->table_mask;
+}
+
+static inline size_t seen_tail(const seen_cache *cache) {
+	return (cache->head + cache->capacity - cache->len) % cache->capacity;
+}
+
+/** Returns the hash table slot holding nonce, or the empty slot ending its probe sequence */
+static size_t seen_find(const seen_cache *cache, uint64_t nonce) {
+	size_t i = seen_slot(cache, nonce);
+
+	while (cache->table[i] && cache->ring[cache->table[i] - 1].nonce != nonce)
+		i = (i + 1) & cache->table_mask;
+
+	return i;
+}
+
+/** Empties slot i and moves later members of the probe sequence up so lookups need no tombstones */
+static void seen_unlink(seen_cache *cache, size_t i) {
+	size_t j = i;
+
+	while (true) {
+		j = (j + 1) & cache->table_mask;
+		if (!cache->table[j])
+			break;
+
+		size_t k = seen_slot(cache, cache->ring[cache->table[j] - 1].nonce);
+
+		// move the entry in slot j into the hole unless its home slot k
+		// lies cyclically in (i, j]
+		if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+			cache->table[i] = cache->table[j];
+			i = j;
+		}
+	}
+
+	cache->table[i] = 0;
+}
+
+/** Forgets the oldest nonce */
+static void seen_drop_oldest(seen_cache *cache) {
+	seen_unlink(cache, seen_find(cache, cache->ring[seen_tail(cache)].nonce));
+	cache->len--;
+}
+
+/** Forgets all nonces whose window is over */
+static void seen_forget_expired(seen_cache *cache, uint64_t now) {
+	while (cache->len && now - cache->ring[seen_tail(cache)].time > cache->window) {
+		seen_drop_oldest(cache);
+		cache->expired++;
+	}
+}
+
+/** Moves all nonces into a ring of the given capacity and rebuilds the hash table */
+static void seen_resize(seen_cache *cache, size_t capacity) {
+	size_t slots = 1;
+
+	// keep the load factor of the table at or below 0.5
+	while (slots < capacity * 2)
+		slots <<= 1;
+
+	struct seen_entry *ring = mmfd_new_array(capacity, struct seen_entry);
+	size_t tail = cache->ring ? seen_tail(cache) : 0;
+
+	for (size_t i = 0; i < cache->len; i++)
+		ring[i] = cache->ring[(tail + i) % cache->capacity];
+
+	free(cache->ring);
+	free(cache->table);
+
+	cache->ring = ring;
+	cache->table = mmfd_new0_array(slots, uint32_t);
+	cache->capacity = capacity;
+	cache->table_mask = slots - 1;
+	cache->head = cache->len % capacity;
+
+	for (size_t i = 0; i < cache->len; i++)
+		cache->table[seen_find(cache, ring[i].nonce)] = i + 1;
+
+	cache->resizes++;
+}
+
+void seen_init(seen_cache *cache, uint64_t window, size_t max_capacity) {
+	memset(cache, 0, sizeof(*cache));
+
+	cache->window = window;
+	cache->max_capacity = max_capacity < SEEN_MIN_CAPACITY ? SEEN_MIN_CAPACITY : max_capacity;
+	obtainrandom(&cache->seed, sizeof(cache->seed), 0);
+
+	seen_resize(cache, SEEN_MIN_CAPACITY);
+	cache->resizes = 0;
+}
+
+void seen_free(seen_cache *cache) {
+	free(cache->ring);
+	free(cache->table);
+	memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * seen_expire - forget all nonces older than the window
+ * @cache: the cache to clean up
+ *
+ * Halves the ring while it is less than a quarter full.
+ */
+void seen_expire(seen_cache *cache) {
+	seen_forget_expired(cache, monotonic_ms());
+
+	size_t capacity = cache->capacity;
+	while (capacity / 2 >= SEEN_MIN_CAPACITY && cache->len < capacity / 4)
+		capacity /= 2;
+
+	if (capacity != cache->capacity)
+		seen_resize(cache, capacity);
+}
+
+bool seen_contains(seen_cache *cache, uint64_t nonce) {
+	seen_forget_expired(cache, monotonic_ms());
+	return cache->table[seen_find(cache, nonce)] != 0;
+}
+
+/**
+ * seen_add - remember a nonce
+ * @cache: the cache to add the nonce to
+ * @nonce: the nonce
+ *
+ * If the cache is full and may not grow any further, the oldest nonce is
+ * forgotten even if its window is not over yet.
+ *
+ * Return: false if the nonce was already in the cache, otherwise true
+ */
+bool seen_add(seen_cache *cache, uint64_t nonce) {
+	uint64_t now = monotonic_ms();
+
+	seen_forget_expired(cache, now);
+
+	size_t i = seen_find(cache, nonce);
+
+	if (cache->table[i])
+		return false;
+
+	if (cache->len == cache->capacity) {
+		if (cache->capacity < cache->max_capacity) {
+			size_t capacity = cache->capacity * 2;
+			seen_resize(cache, capacity < cache->max_capacity ? capacity : cache->max_capacity);
+		} else {
+			seen_drop_oldest(cache);
+			cache->evicted_early++;
+		}
+
+		i = seen_find(cache, nonce);
+	}
+
+	cache->ring[cache->head] = (struct seen_entry){
+		.nonce = nonce, .time = now,
+	};
+	cache->table[i] = cache->head + 1;
+	cache->head = (cache->head + 1) % cache->capacity;
+	cache->len++;
+
+	return true;
+}
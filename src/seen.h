@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SEEN_MIN_CAPACITY 256
+#define SEEN_MAX_CAPACITY UINT32_MAX  /* the hash table stores ring index + 1 in 32 bits */
+
+struct seen_entry {
+	uint64_t nonce;
+	uint64_t time; /**< arrival time in milliseconds, CLOCK_MONOTONIC_COARSE */
+};
+
+/**
+ * A time-bounded set of recently seen nonces.
+ *
+ * Nonces are kept in a ring buffer in order of arrival. An open-addressing
+ * hash table of ring indices sits on top of the ring so lookup and insert are
+ * O(1). Every nonce is remembered for window milliseconds. The ring doubles
+ * whenever it would otherwise have to forget a nonce before the window is
+ * over, up to max_capacity entries, and halves again when mostly empty.
+ */
+typedef struct {
+	struct seen_entry *ring; /**< nonces in order of arrival */
+	uint32_t *table;         /**< ring index + 1 of the nonce in this slot, 0 if empty */
+	size_t capacity;         /**< number of nonces the ring holds */
+	size_t max_capacity;     /**< the ring never grows beyond this */
+	size_t table_mask;       /**< number of hash table slots - 1 */
+	size_t head;             /**< ring slot the next nonce is written to */
+	size_t len;              /**< number of nonces currently stored */
+	uint64_t window;         /**< milliseconds a nonce is remembered */
+	uint64_t seed;           /**< hash seed, so remote peers cannot pick colliding nonces */
+
+	uint64_t expired;        /**< nonces forgotten after the full window */
+	uint64_t evicted_early;  /**< nonces forgotten before the window was over */
+	uint64_t resizes;
+} seen_cache;
+
+void seen_init(seen_cache *cache, uint64_t window, size_t max_capacity);
+void seen_free(seen_cache *cache);
+void seen_expire(seen_cache *cache);
+bool seen_contains(seen_cache *cache, uint64_t nonce);
+bool seen_add(seen_cache *cache, uint64_t nonce);
@@ -68,6 +68,10 @@ bool parse_command(char *cmd, enum socket_command *scmd) {
 		*scmd = GET_MESHIFS;
 	else if (!strncmp(cmd, "get_neighbours", 14))
 		*scmd = GET_NEIGHBOURS;
+	else if (!strncmp(cmd, "mcast_threshold ", 16))
+		*scmd = SET_MCAST_THRESHOLD;
+	else if (!strncmp(cmd, "get_stats", 9))
+		*scmd = GET_STATS;
 	else if (!strncmp(cmd, "add_meshif ", 11))
 		*scmd = ADD_MESHIF;
 	else
@@ -78,18 +82,393 @@ bool parse_command(char *cmd, enum socket_command *scmd) {
 
 void socket_get_neighbours(struct json_object *obj) {
 	struct json_object *neighbours = json_object_new_array();
-	for (size_t i = 0; i < VECTOR_LEN(ctx.neighbours); i++) {
-		struct neighbour *neighbour = &VECTOR_INDEX(ctx.neighbours, i);
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			struct neighbour *neighbour = VECTOR_INDEX(iface->neighbours, j);
+
+			struct json_object *jneighbour = json_object_new_object();
 
-		struct json_object *jneighbour = json_object_new_object();
+			json_object_object_add(jneighbour, "address",  json_object_new_string(print_ip(&neighbour->address.sin6_addr)));
+			json_object_object_add(jneighbour, "interface",  json_object_new_string(neighbour->ifname));
 
-		json_object_object_add(jneighbour, "address",  json_object_new_string(print_ip(&neighbour->address.sin6_addr)));
-		json_object_object_add(jneighbour, "interface",  json_object_new_string(neighbour->ifname));
-		json_object_array_add(neighbours, jneighbour);
+			// ratios are null until enough hellos were counted
+			if (etx_known(neighbour)) {
+				uint8_t quality = etx_quality(neighbour);
+
+				json_object_object_add(jneighbour, "rx", json_object_new_double((double)etx_rx(neighbour) / ETX_SCALE));
+				json_object_object_add(jneighbour, "tx", json_object_new_double((double)neighbour->etx.tx / ETX_SCALE));
+				json_object_object_add(jneighbour, "etx", quality ? json_object_new_double((double)ETX_SCALE / quality) : NULL);
+			} else {
+				json_object_object_add(jneighbour, "rx", NULL);
+				json_object_object_add(jneighbour, "tx", NULL);
+				json_object_object_add(jneighbour, "etx", NULL);
+			}
+
+			json_object_object_add(jneighbour, "bypassed", json_object_new_boolean(neighbour->etx.bypassed));
+			json_object_array_add(neighbours, jneighbour);
+		}
 	}
 	json_object_object_add(obj, "mmfd_neighbours", neighbours);
 }
 
+void socket_get_stats(struct json_object *obj) {
+	struct stats stats = ctx.stats;
+	seen_cache shared, *seen = &ctx.seen;
+
+	// worker threads count on their own and share a sharded cache
+	if (workers_enabled(&ctx.workers)) {
+		workers_stats(&ctx.workers, &stats, &shared);
+		seen = &shared;
+	}
+
+	struct json_object *jseen = json_object_new_object();
+
+	json_object_object_add(jseen, "entries", json_object_new_int64(seen->len));
+	json_object_object_add(jseen, "capacity", json_object_new_int64(seen->capacity));
+	json_object_object_add(jseen, "max_entries", json_object_new_int64(seen->max_capacity));
+	json_object_object_add(jseen, "window_ms", json_object_new_int64(seen->window));
+	json_object_object_add(jseen, "expired", json_object_new_int64(seen->expired));
+	json_object_object_add(jseen, "evicted_early", json_object_new_int64(seen->evicted_early));
+	json_object_object_add(jseen, "resizes", json_object_new_int64(seen->resizes));
+	json_object_object_add(obj, "seen", jseen);
+
+	struct json_object *jorigins = json_object_new_object();
+
+	json_object_object_add(jorigins, "origins", json_object_new_int64(ctx.origins.len));
+	json_object_object_add(jorigins, "replayed", json_object_new_int64(ctx.origins.replayed));
+	json_object_object_add(jorigins, "too_old", json_object_new_int64(ctx.origins.too_old));
+	json_object_object_add(obj, "sequenced", jorigins);
+
+	struct json_object *jhello = json_object_new_object();
+
+	json_object_object_add(jhello, "rx", json_object_new_int64(stats.hello_rx));
+	json_object_object_add(jhello, "tx", json_object_new_int64(stats.hello_tx));
+	json_object_object_add(jhello, "duplicates", json_object_new_int64(stats.hello_duplicates));
+	json_object_object_add(obj, "hello", jhello);
+
+	struct json_object *jdata = json_object_new_object();
+
+	json_object_object_add(jdata, "rx", json_object_new_int64(stats.data_rx));
+	json_object_object_add(jdata, "duplicates", json_object_new_int64(stats.data_duplicates));
+	json_object_object_add(jdata, "tx", json_object_new_int64(stats.data_tx));
+	json_object_object_add(jdata, "tx_errors", json_object_new_int64(stats.data_tx_errors));
+	json_object_object_add(jdata, "tx_syscalls", json_object_new_int64(stats.data_tx_syscalls));
+	json_object_object_add(jdata, "tx_multicast", json_object_new_int64(stats.data_tx_mcast));
+	json_object_object_add(jdata, "local", json_object_new_int64(stats.local_rx));
+	json_object_object_add(jdata, "bundles_tx", json_object_new_int64(stats.bundles_tx));
+	json_object_object_add(jdata, "bundled_tx", json_object_new_int64(stats.bundled_tx));
+	json_object_object_add(jdata, "bundles_rx", json_object_new_int64(stats.bundles_rx));
+	json_object_object_add(jdata, "bundled_rx", json_object_new_int64(stats.bundled_rx));
+	json_object_object_add(jdata, "gso_sends", json_object_new_int64(stats.gso_sends));
+	json_object_object_add(jdata, "gso_segments", json_object_new_int64(stats.gso_segments));
+	json_object_object_add(jdata, "tx_too_big", json_object_new_int64(stats.tx_too_big));
+	json_object_object_add(jdata, "aggregation_us", json_object_new_int64(ctx.aggregation_us));
+	// copies received per distinct packet, 1 is the ideal
+	json_object_object_add(jdata, "redundancy",
+			       json_object_new_double(stats.data_rx > stats.data_duplicates ?
+						      (double)stats.data_rx / (stats.data_rx - stats.data_duplicates) : 0));
+	json_object_object_add(obj, "data", jdata);
+
+	struct json_object *jmpr = json_object_new_object();
+	size_t relays = 0, selectors = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			relays += VECTOR_INDEX(iface->neighbours, j)->mpr;
+			selectors += VECTOR_INDEX(iface->neighbours, j)->mpr_selector;
+		}
+	}
+
+	json_object_object_add(jmpr, "enabled", json_object_new_boolean(ctx.mpr));
+	json_object_object_add(jmpr, "relays", json_object_new_int64(relays));
+	json_object_object_add(jmpr, "selectors", json_object_new_int64(selectors));
+	json_object_object_add(jmpr, "relayed", json_object_new_int64(stats.mpr_relayed));
+	json_object_object_add(jmpr, "suppressed", json_object_new_int64(stats.mpr_suppressed));
+	json_object_object_add(obj, "mpr", jmpr);
+
+	struct json_object *jgossip = json_object_new_object();
+
+	json_object_object_add(jgossip, "threshold", json_object_new_int64(ctx.gossip.threshold));
+	json_object_object_add(jgossip, "jitter_min_ms", json_object_new_int64(ctx.gossip.jitter_min));
+	json_object_object_add(jgossip, "jitter_max_ms", json_object_new_int64(ctx.gossip.jitter_max));
+	json_object_object_add(jgossip, "pending", json_object_new_int64(ctx.gossip.len));
+	json_object_object_add(jgossip, "scheduled", json_object_new_int64(ctx.gossip.scheduled));
+	json_object_object_add(jgossip, "cancelled", json_object_new_int64(ctx.gossip.cancelled));
+	json_object_object_add(jgossip, "cancellation_rate",
+			       json_object_new_double(ctx.gossip.scheduled ? (double)ctx.gossip.cancelled / ctx.gossip.scheduled : 0));
+	json_object_object_add(obj, "gossip", jgossip);
+
+	struct json_object *jrx = json_object_new_object();
+
+	json_object_object_add(jrx, "datagrams", json_object_new_int64(stats.rx_datagrams));
+	json_object_object_add(jrx, "syscalls", json_object_new_int64(stats.rx_syscalls));
+	json_object_object_add(jrx, "syscalls_per_datagram",
+			       json_object_new_double(stats.rx_datagrams ? (double)stats.rx_syscalls / stats.rx_datagrams : 0));
+	json_object_object_add(jrx, "batch_size", json_object_new_int64(ctx.rx_batch.size));
+	json_object_object_add(jrx, "gro_reads", json_object_new_int64(stats.gro_reads));
+	json_object_object_add(jrx, "gro_segments", json_object_new_int64(stats.gro_segments));
+	json_object_object_add(jrx, "truncated", json_object_new_int64(stats.rx_truncated));
+	json_object_object_add(obj, "rx", jrx);
+
+	struct json_object *jfilter = json_object_new_object();
+
+	json_object_object_add(jfilter, "enabled", json_object_new_boolean(dupfilter_enabled(&ctx.dupfilter)));
+	json_object_object_add(jfilter, "dropped", json_object_new_int64(dupfilter_dropped(&ctx.dupfilter)));
+	json_object_object_add(obj, "kernel_filter", jfilter);
+
+	struct json_object *jengine = json_object_new_object();
+
+	json_object_object_add(jengine, "name", json_object_new_string(uring_enabled(&ctx.uring) ? "uring" : "epoll"));
+	json_object_object_add(jengine, "enters", json_object_new_int64(ctx.uring.enters));
+	json_object_object_add(jengine, "tx_fallbacks", json_object_new_int64(ctx.uring.tx_fallbacks));
+	json_object_object_add(obj, "engine", jengine);
+
+	struct json_object *jfrag = json_object_new_object();
+	struct json_object *jlinks = json_object_new_object();
+	frag_ctx frag = ctx.frag;
+
+	for (unsigned int i = 0; i < ctx.workers.count; i++) {
+		frag_ctx *w = &ctx.workers.workers[i].frag;
+
+		frag.fragmented += __atomic_load_n(&w->fragmented, __ATOMIC_RELAXED);
+		frag.fragments_tx += __atomic_load_n(&w->fragments_tx, __ATOMIC_RELAXED);
+		frag.fragments_rx += __atomic_load_n(&w->fragments_rx, __ATOMIC_RELAXED);
+		frag.reassembled += __atomic_load_n(&w->reassembled, __ATOMIC_RELAXED);
+		frag.timeouts += __atomic_load_n(&w->timeouts, __ATOMIC_RELAXED);
+		frag.evicted += __atomic_load_n(&w->evicted, __ATOMIC_RELAXED);
+		frag.invalid += __atomic_load_n(&w->invalid, __ATOMIC_RELAXED);
+	}
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+		json_object_object_add(jlinks, iface->ifname, json_object_new_int64(iface->mtu));
+	}
+
+	json_object_object_add(jfrag, "enabled", json_object_new_boolean(ctx.fragment));
+	json_object_object_add(jfrag, "tun_mtu", json_object_new_int64(ctx.mtu));
+	json_object_object_add(jfrag, "link_mtu", jlinks);
+	json_object_object_add(jfrag, "fragmented", json_object_new_int64(frag.fragmented));
+	json_object_object_add(jfrag, "fragments_tx", json_object_new_int64(frag.fragments_tx));
+	json_object_object_add(jfrag, "fragments_rx", json_object_new_int64(frag.fragments_rx));
+	json_object_object_add(jfrag, "reassembled", json_object_new_int64(frag.reassembled));
+	json_object_object_add(jfrag, "timeouts", json_object_new_int64(frag.timeouts));
+	json_object_object_add(jfrag, "evicted", json_object_new_int64(frag.evicted));
+	json_object_object_add(jfrag, "invalid", json_object_new_int64(frag.invalid));
+	json_object_object_add(obj, "fragmentation", jfrag);
+
+	struct json_object *jnack = json_object_new_object();
+
+	json_object_object_add(jnack, "enabled", json_object_new_boolean(nack_enabled(&ctx.nack)));
+	json_object_object_add(jnack, "cache_size", json_object_new_int64(ctx.nack.size));
+	json_object_object_add(jnack, "cache_len", json_object_new_int64(ctx.nack.len));
+	json_object_object_add(jnack, "rate", json_object_new_int64(ctx.nack.rate));
+	json_object_object_add(jnack, "gaps", json_object_new_int64(ctx.nack.gaps));
+	json_object_object_add(jnack, "pending", json_object_new_int64(VECTOR_LEN(ctx.nack.pending)));
+	json_object_object_add(jnack, "nacks_tx", json_object_new_int64(ctx.nack.nacks_tx));
+	json_object_object_add(jnack, "nacks_rx", json_object_new_int64(ctx.nack.nacks_rx));
+	json_object_object_add(jnack, "requested", json_object_new_int64(ctx.nack.requested));
+	json_object_object_add(jnack, "retransmitted", json_object_new_int64(ctx.nack.retransmitted));
+	json_object_object_add(jnack, "not_cached", json_object_new_int64(ctx.nack.not_cached));
+	json_object_object_add(jnack, "rate_limited", json_object_new_int64(ctx.nack.rate_limited));
+	json_object_object_add(jnack, "recovered", json_object_new_int64(ctx.nack.recovered));
+	json_object_object_add(jnack, "unrecovered", json_object_new_int64(ctx.nack.unrecovered));
+	json_object_object_add(obj, "nack", jnack);
+
+	struct json_object *jstorm = json_object_new_object();
+	struct json_object *jrules = json_object_new_array();
+	struct json_object *joffenders = json_object_new_array();
+	struct storm_entry *offenders[STORM_OFFENDERS];
+	size_t n = storm_offenders(&ctx.storm, offenders, STORM_OFFENDERS);
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.storm.rules); i++) {
+		struct storm_rule *rule = &VECTOR_INDEX(ctx.storm.rules, i);
+		struct json_object *jrule = json_object_new_object();
+		char prefix[INET6_ADDRSTRLEN + 4];
+
+		snprintf(prefix, sizeof(prefix), "%s/%u", print_ip(&rule->prefix), rule->prefix_len);
+		json_object_object_add(jrule, "prefix", json_object_new_string(prefix));
+		json_object_object_add(jrule, "rate", json_object_new_int64(rule->rate));
+		json_object_object_add(jrule, "burst", json_object_new_int64(rule->burst));
+		json_object_object_add(jrule, "dropped", json_object_new_int64(rule->dropped));
+		json_object_array_add(jrules, jrule);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		struct json_object *joffender = json_object_new_object();
+		char ifname[IFNAMSIZ] = "local";
+
+		if (offenders[i]->ingress.sin6_scope_id)
+			if_indextoname(offenders[i]->ingress.sin6_scope_id, ifname);
+
+		json_object_object_add(joffender, "source", json_object_new_string(print_ip(&offenders[i]->src)));
+		json_object_object_add(joffender, "group", json_object_new_string(print_ip(&offenders[i]->group)));
+		json_object_object_add(joffender, "ingress", json_object_new_string(offenders[i]->ingress.sin6_scope_id ? print_ip(&offenders[i]->ingress.sin6_addr) : "local"));
+		json_object_object_add(joffender, "interface", json_object_new_string(ifname));
+		json_object_object_add(joffender, "passed", json_object_new_int64(offenders[i]->passed));
+		json_object_object_add(joffender, "dropped", json_object_new_int64(offenders[i]->dropped));
+		json_object_array_add(joffenders, joffender);
+	}
+
+	json_object_object_add(jstorm, "enabled", json_object_new_boolean(storm_enabled(&ctx.storm)));
+	json_object_object_add(jstorm, "rules", jrules);
+	json_object_object_add(jstorm, "dropped_local", json_object_new_int64(ctx.storm.dropped_local));
+	json_object_object_add(jstorm, "dropped_remote", json_object_new_int64(ctx.storm.dropped_remote));
+	json_object_object_add(jstorm, "dropped_group", json_object_new_int64(ctx.storm.dropped_group));
+	json_object_object_add(jstorm, "dropped_ingress", json_object_new_int64(ctx.storm.dropped_ingress));
+	json_object_object_add(jstorm, "replaced", json_object_new_int64(ctx.storm.replaced));
+	json_object_object_add(jstorm, "offenders", joffenders);
+	json_object_object_add(obj, "storm_control", jstorm);
+
+	struct json_object *jegress = json_object_new_object();
+	struct json_object *jclasses = json_object_new_array();
+	struct json_object *jclassrules = json_object_new_array();
+
+	for (size_t i = 0; i < EGRESS_CLASSES; i++) {
+		struct egress_class *c = &ctx.egress.classes[i];
+		struct json_object *jclass = json_object_new_object();
+
+		json_object_object_add(jclass, "class", json_object_new_string(egress_class_name(i)));
+		json_object_object_add(jclass, "weight", json_object_new_int64(c->weight));
+		json_object_object_add(jclass, "len", json_object_new_int64(c->len));
+		json_object_object_add(jclass, "max_len", json_object_new_int64(c->max_len));
+		json_object_object_add(jclass, "enqueued", json_object_new_int64(c->enqueued));
+		json_object_object_add(jclass, "sent", json_object_new_int64(c->sent));
+		json_object_object_add(jclass, "dropped", json_object_new_int64(c->dropped));
+		json_object_object_add(jclass, "latency_avg_us", json_object_new_int64(c->sent ? c->latency_sum / c->sent : 0));
+		json_object_object_add(jclass, "latency_max_us", json_object_new_int64(c->latency_max));
+		json_object_array_add(jclasses, jclass);
+	}
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.egress.rules); i++) {
+		struct egress_rule *rule = &VECTOR_INDEX(ctx.egress.rules, i);
+		struct json_object *jrule = json_object_new_object();
+		char prefix[INET6_ADDRSTRLEN + 4];
+
+		snprintf(prefix, sizeof(prefix), "%s/%u", print_ip(&rule->prefix), rule->prefix_len);
+		json_object_object_add(jrule, "prefix", json_object_new_string(prefix));
+		json_object_object_add(jrule, "class", json_object_new_string(egress_class_name(rule->class)));
+		json_object_array_add(jclassrules, jrule);
+	}
+
+	json_object_object_add(jegress, "enabled", json_object_new_boolean(egress_enabled(&ctx.egress)));
+	json_object_object_add(jegress, "scheduler", json_object_new_string(ctx.egress.weighted ? "weighted" : "strict"));
+	json_object_object_add(jegress, "depth", json_object_new_int64(ctx.egress.depth));
+	json_object_object_add(jegress, "budget", json_object_new_int64(EGRESS_BUDGET));
+	json_object_object_add(jegress, "rules", jclassrules);
+	json_object_object_add(jegress, "classes", jclasses);
+	json_object_object_add(obj, "egress", jegress);
+
+	struct json_object *jmld = json_object_new_object();
+	struct json_object *jifnames = json_object_new_array();
+	struct json_object *jgroups = json_object_new_array();
+	size_t pruning = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.mld.ifnames); i++)
+		json_object_array_add(jifnames, json_object_new_string(VECTOR_INDEX(ctx.mld.ifnames, i)));
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.mld.groups) && i < MLD_MAX_GROUPS; i++)
+		json_object_array_add(jgroups, json_object_new_string(print_ip(&VECTOR_INDEX(ctx.mld.groups, i))));
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			if (VECTOR_INDEX(iface->neighbours, j)->groups)
+				pruning++;
+		}
+	}
+
+	json_object_object_add(jmld, "enabled", json_object_new_boolean(mld_enabled(&ctx.mld)));
+	json_object_object_add(jmld, "interfaces", jifnames);
+	json_object_object_add(jmld, "local_groups", jgroups);
+	json_object_object_add(jmld, "listeners_unknown", json_object_new_boolean(ctx.mld.unknown));
+	json_object_object_add(jmld, "neighbours_advertising", json_object_new_int64(pruning));
+	json_object_object_add(jmld, "updates", json_object_new_int64(ctx.mld.updates));
+	json_object_object_add(jmld, "flooded", json_object_new_int64(ctx.mld.flooded));
+	json_object_object_add(jmld, "pruned", json_object_new_int64(ctx.mld.pruned));
+	json_object_object_add(jmld, "unwanted", json_object_new_int64(ctx.mld.unwanted));
+	json_object_object_add(obj, "mld", jmld);
+
+	struct json_object *jversioned = json_object_new_object();
+	size_t versioned = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			if (VECTOR_INDEX(iface->neighbours, j)->versioned)
+				versioned++;
+		}
+	}
+
+	json_object_object_add(jversioned, "enabled", json_object_new_boolean(ctx.versioned));
+	json_object_object_add(jversioned, "version", json_object_new_int(MMFD_PACKET_FORMAT_VERSION));
+	json_object_object_add(jversioned, "hop_limit", json_object_new_int(ctx.hop_limit));
+	json_object_object_add(jversioned, "neighbours_versioned", json_object_new_int64(versioned));
+	json_object_object_add(jversioned, "rx", json_object_new_int64(stats.versioned_rx));
+	json_object_object_add(jversioned, "tx", json_object_new_int64(stats.versioned_tx));
+	json_object_object_add(jversioned, "mismatch", json_object_new_int64(stats.version_mismatch));
+	json_object_object_add(jversioned, "invalid", json_object_new_int64(stats.versioned_invalid));
+	json_object_object_add(jversioned, "unknown_tlv", json_object_new_int64(stats.unknown_tlv));
+	json_object_object_add(jversioned, "expired", json_object_new_int64(stats.hop_limit_expired));
+	json_object_object_add(jversioned, "not_forwarded", json_object_new_int64(stats.hop_limit_exceeded));
+	json_object_object_add(obj, "versioned", jversioned);
+
+	struct json_object *jetx = json_object_new_object();
+	size_t bypassed = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx.interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx.interfaces, i);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++) {
+			if (VECTOR_INDEX(iface->neighbours, j)->etx.bypassed)
+				bypassed++;
+		}
+	}
+
+	json_object_object_add(jetx, "enabled", json_object_new_boolean(etx_enabled(&ctx.etx)));
+	json_object_object_add(jetx, "threshold", json_object_new_double((double)ctx.etx.threshold / ETX_SCALE));
+	json_object_object_add(jetx, "neighbours_bypassed", json_object_new_int64(bypassed));
+	json_object_object_add(jetx, "copies_not_sent", json_object_new_int64(ctx.etx.bypassed));
+	json_object_object_add(obj, "link_quality", jetx);
+
+	struct json_object *jtun = json_object_new_object();
+
+	json_object_object_add(jtun, "vnet_hdr", json_object_new_boolean(ctx.tun_vnet));
+	json_object_object_add(jtun, "coalesce", json_object_new_boolean(ctx.tun_coalesce));
+	json_object_object_add(jtun, "gso_reads", json_object_new_int64(stats.tun_gso_reads));
+	json_object_object_add(jtun, "gso_segments", json_object_new_int64(stats.tun_gso_segments));
+	json_object_object_add(jtun, "coalesced_writes", json_object_new_int64(stats.tun_coalesced_writes));
+	json_object_object_add(jtun, "coalesced_packets", json_object_new_int64(stats.tun_coalesced_packets));
+	json_object_object_add(jtun, "queue_size", json_object_new_int64(ctx.tunqueue.size));
+	json_object_object_add(jtun, "queue_len", json_object_new_int64(ctx.tunqueue.len));
+	json_object_object_add(jtun, "queue_max_len", json_object_new_int64(ctx.tunqueue.max_len));
+	json_object_object_add(jtun, "queue_dropped", json_object_new_int64(ctx.tunqueue.dropped));
+	json_object_object_add(jtun, "write_blocks", json_object_new_int64(ctx.tunqueue.blocks));
+	json_object_object_add(jtun, "write_errors", json_object_new_int64(ctx.tunqueue.errors));
+	json_object_object_add(obj, "tun", jtun);
+
+	struct json_object *jworkers = json_object_new_object();
+	struct json_object *jworker_rx = json_object_new_array();
+	struct json_object *jworker_local = json_object_new_array();
+
+	for (unsigned int i = 0; i < ctx.workers.count; i++) {
+		json_object_array_add(jworker_rx, json_object_new_int64(__atomic_load_n(&ctx.workers.workers[i].stats->rx_datagrams, __ATOMIC_RELAXED)));
+		json_object_array_add(jworker_local, json_object_new_int64(__atomic_load_n(&ctx.workers.workers[i].stats->local_rx, __ATOMIC_RELAXED)));
+	}
+
+	json_object_object_add(jworkers, "threads", json_object_new_int64(ctx.workers.count));
+	json_object_object_add(jworkers, "tun_queues", json_object_new_int64(VECTOR_LEN(ctx.tun_queues) + 1));
+	json_object_object_add(jworkers, "snapshots", json_object_new_int64(ctx.workers.published));
+	json_object_object_add(jworkers, "rx_datagrams", jworker_rx);
+	json_object_object_add(jworkers, "local_rx", jworker_local);
+	json_object_object_add(obj, "workers", jworkers);
+}
+
 void socket_get_meshifs(struct json_object *obj) {
 	struct json_object *jmeshifs = json_object_new_array();
 
@@ -166,6 +545,16 @@ void socket_handle_in(socket_ctx *sctx) {
 			socket_get_neighbours(retval);
 			dprintf(fd, "%s", json_object_to_json_string(retval));
 			break;
+		case SET_MCAST_THRESHOLD:
+			str_meshif = strtok(&line[16], " ");
+			char *threshold = strtok(NULL, " ");
+			if (!str_meshif || !threshold || !if_set_mcast_threshold(str_meshif, strtoul(threshold, NULL, 10)))
+				fprintf(stderr, "Could not set multicast threshold (%s)\n", &line[16]);
+			break;
+		case GET_STATS:
+			socket_get_stats(retval);
+			dprintf(fd, "%s", json_object_to_json_string(retval));
+			break;
 	}
 
 	json_object_put(retval);
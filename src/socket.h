@@ -21,7 +21,9 @@ enum socket_command {
 	DEL_MESHIF,
 	GET_MESHIFS,
 	GET_NEIGHBOURS,
-	SET_VERBOSITY
+	GET_STATS,
+	SET_VERBOSITY,
+	SET_MCAST_THRESHOLD
 };
 
 typedef struct {
@@ -0,0 +1,247 @@
+#include "storm.h"
+#include "alloc.h"
+#include "timespec.h"
+#include "util.h"
+
+#include <linux/ipv6.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * storm_add_rule - limit the groups under a prefix
+ * @storm: the context
+ * @spec: <prefix>[/<length>]=<packets per second>[:<burst>]
+ *
+ * The longest prefix that covers a group applies. The burst defaults to
+ * one second worth of packets.
+ *
+ * Return: false if @spec cannot be parsed
+ */
+bool storm_add_rule(storm_ctx *storm, const char *spec) {
+	const char *eq = strchr(spec, '=');
+	struct storm_rule rule = {};
+	char *end;
+
+	if (!eq || !parse_prefix(spec, eq - spec, &rule.prefix, &rule.prefix_len))
+		return false;
+
+	rule.rate = strtoul(eq + 1, &end, 10);
+	rule.burst = rule.rate;
+
+	if (*end == ':')
+		rule.burst = strtoul(end + 1, &end, 10);
+
+	if (*end || !rule.burst)
+		return false;
+
+	VECTOR_ADD(storm->rules, rule);
+	return true;
+}
+
+/** Prepares the bucket table if there are rules */
+void storm_init(storm_ctx *storm) {
+	if (!VECTOR_LEN(storm->rules))
+		return;
+
+	storm->entries = mmfd_new0_array(STORM_ENTRIES, struct storm_entry);
+	storm->groups = mmfd_new0_array(STORM_AGGREGATES, struct storm_bucket);
+	storm->ingresses = mmfd_new0_array(STORM_AGGREGATES, struct storm_bucket);
+	obtainrandom(&storm->seed, sizeof(storm->seed), 0);
+}
+
+static struct storm_rule *storm_find_rule(storm_ctx *storm, const struct in6_addr *group) {
+	struct storm_rule *best = NULL;
+
+	for (size_t i = 0; i < VECTOR_LEN(storm->rules); i++) {
+		struct storm_rule *rule = &VECTOR_INDEX(storm->rules, i);
+
+		if ((!best || rule->prefix_len > best->prefix_len) && prefix_match(group, &rule->prefix, rule->prefix_len))
+			best = rule;
+	}
+
+	return best;
+}
+
+static uint64_t hash_addr(uint64_t h, const struct in6_addr *addr) {
+	uint64_t w[2];
+
+	memcpy(w, addr, sizeof(w));
+	h = hash64(h ^ w[0]);
+	return hash64(h ^ w[1]);
+}
+
+static bool same_sender(const struct storm_entry *entry, const struct in6_addr *src, const struct in6_addr *group, const struct sockaddr_in6 *ingress) {
+	return !memcmp(&entry->src, src, sizeof(*src)) && !memcmp(&entry->group, group, sizeof(*group)) &&
+	       entry->ingress.sin6_scope_id == ingress->sin6_scope_id &&
+	       !memcmp(&entry->ingress.sin6_addr, &ingress->sin6_addr, sizeof(ingress->sin6_addr));
+}
+
+/** Finds the shared bucket of a group or an ingress or replaces the least recently used one */
+static struct storm_bucket *storm_lookup_bucket(storm_ctx *storm, struct storm_bucket *table, struct storm_rule *rule,
+						const struct in6_addr *addr, uint32_t scope_id, uint64_t now) {
+	uint64_t h = hash_addr(storm->seed ^ hash64((uintptr_t)rule ^ scope_id), addr) | 1;
+	struct storm_bucket *victim = NULL;
+
+	for (size_t i = 0; i < STORM_PROBES; i++) {
+		struct storm_bucket *bucket = &table[(h + i) & (STORM_AGGREGATES - 1)];
+
+		if (bucket->hash == h && bucket->rule == rule && bucket->scope_id == scope_id &&
+		    !memcmp(&bucket->addr, addr, sizeof(*addr)))
+			return bucket;
+
+		if (!victim || bucket->last < victim->last)
+			victim = bucket;
+	}
+
+	*victim = (struct storm_bucket){
+		.hash = h,
+		.addr = *addr,
+		.scope_id = scope_id,
+		.rule = rule,
+		.tokens = 1,
+		.last = now,
+	};
+
+	return victim;
+}
+
+/** Adds the tokens earned since @last, at most @burst of them */
+static double storm_refill(double tokens, uint64_t *last, uint64_t now, uint64_t rate, uint64_t burst) {
+	tokens += (now - *last) * rate / 1000.0;
+	*last = now;
+
+	return tokens > burst ? burst : tokens;
+}
+
+/** Finds the bucket of a sender or replaces the least recently used one */
+static struct storm_entry *storm_lookup(storm_ctx *storm, struct storm_rule *rule, const struct in6_addr *src,
+					const struct in6_addr *group, const struct sockaddr_in6 *ingress, uint64_t now) {
+	uint64_t h = hash_addr(hash_addr(hash_addr(storm->seed ^ ingress->sin6_scope_id, &ingress->sin6_addr), src), group) | 1;
+	struct storm_entry *victim = NULL;
+
+	for (size_t i = 0; i < STORM_PROBES; i++) {
+		struct storm_entry *entry = &storm->entries[(h + i) & (STORM_ENTRIES - 1)];
+
+		if (entry->hash == h && same_sender(entry, src, group, ingress))
+			return entry;
+
+		if (!victim || entry->last < victim->last)
+			victim = entry;
+	}
+
+	if (victim->hash)
+		storm->replaced++;
+
+	*victim = (struct storm_entry){
+		.hash = h,
+		.src = *src,
+		.group = *group,
+		.ingress = *ingress,
+		.rule = rule,
+		.tokens = 1,
+		.last = now,
+	};
+
+	return victim;
+}
+
+/**
+ * storm_check - take a token for a packet
+ * @storm: the context
+ * @ingress: the neighbour the packet came from, NULL for the tun device
+ * @packet: the IPv6 packet
+ * @len: its length
+ *
+ * Return: false if the packet has to be dropped
+ */
+bool storm_check(storm_ctx *storm, const struct sockaddr_in6 *ingress, const uint8_t *packet, size_t len) {
+	if (!storm_enabled(storm) || len < sizeof(struct ipv6hdr))
+		return true;
+
+	const struct ipv6hdr *hdr = (const struct ipv6hdr *)packet;
+	struct storm_rule *rule = storm_find_rule(storm, &hdr->daddr);
+
+	if (!rule)
+		return true;
+
+	static const struct sockaddr_in6 local;
+	uint64_t now = monotonic_ms();
+	uint64_t rate = (uint64_t)rule->rate * STORM_SHARE;
+	uint64_t burst = (uint64_t)rule->burst * STORM_SHARE;
+
+	if (!ingress)
+		ingress = &local;
+
+	// the shared buckets come first, so that packets from made up sources
+	// neither pass them nor push real senders out of the table
+	struct storm_bucket *group = storm_lookup_bucket(storm, storm->groups, rule, &hdr->daddr, 0, now);
+	struct storm_bucket *from = storm_lookup_bucket(storm, storm->ingresses, rule, &ingress->sin6_addr, ingress->sin6_scope_id, now);
+
+	group->tokens = storm_refill(group->tokens, &group->last, now, rate, burst);
+	from->tokens = storm_refill(from->tokens, &from->last, now, rate, burst);
+
+	if (group->tokens < 1) {
+		storm->dropped_group++;
+	} else if (from->tokens < 1) {
+		storm->dropped_ingress++;
+	} else {
+		struct storm_entry *entry = storm_lookup(storm, rule, &hdr->saddr, &hdr->daddr, ingress, now);
+
+		entry->tokens = storm_refill(entry->tokens, &entry->last, now, rule->rate, rule->burst);
+
+		if (entry->tokens >= 1) {
+			entry->tokens--;
+			entry->passed++;
+			group->tokens--;
+			from->tokens--;
+			return true;
+		}
+
+		entry->dropped++;
+	}
+
+	rule->dropped++;
+
+	if (ingress != &local)
+		storm->dropped_remote++;
+	else
+		storm->dropped_local++;
+
+	return false;
+}
+
+static int cmp_dropped(const void *a, const void *b) {
+	const struct storm_entry *x = *(struct storm_entry * const *)a;
+	const struct storm_entry *y = *(struct storm_entry * const *)b;
+
+	return (x->dropped < y->dropped) - (x->dropped > y->dropped);
+}
+
+/**
+ * storm_offenders - find the senders with the most dropped packets
+ * @storm: the context
+ * @offenders: filled with up to @n senders, most drops first
+ * @n: size of @offenders
+ *
+ * Return: number of senders found
+ */
+size_t storm_offenders(storm_ctx *storm, struct storm_entry **offenders, size_t n) {
+	struct storm_entry *found[STORM_ENTRIES];
+	size_t len = 0;
+
+	if (!storm_enabled(storm))
+		return 0;
+
+	for (size_t i = 0; i < STORM_ENTRIES; i++) {
+		if (storm->entries[i].hash && storm->entries[i].dropped)
+			found[len++] = &storm->entries[i];
+	}
+
+	qsort(found, len, sizeof(found[0]), cmp_dropped);
+
+	if (len > n)
+		len = n;
+
+	memcpy(offenders, found, len * sizeof(found[0]));
+	return len;
+}
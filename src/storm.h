@@ -0,0 +1,84 @@
+#pragma once
+
+#include "vector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define STORM_ENTRIES 4096   /* senders tracked at once, a power of two */
+#define STORM_PROBES 8       /* slots looked at before the least recently used one is replaced */
+#define STORM_OFFENDERS 16   /* senders listed in get_stats */
+#define STORM_AGGREGATES 256 /* groups and ingresses tracked at once, a power of two */
+#define STORM_SHARE 8        /* senders worth of tokens a group or an ingress gets */
+
+/** A limit for the multicast groups under a prefix */
+struct storm_rule {
+	struct in6_addr prefix;
+	uint8_t prefix_len;
+	uint32_t rate;        /**< packets per second */
+	uint32_t burst;       /**< packets that may come at once */
+	uint64_t dropped;
+};
+
+/** The shared bucket of a group or of an ingress, the tun device or a neighbour */
+struct storm_bucket {
+	uint64_t hash;        /**< 0 if the slot is free */
+	struct in6_addr addr; /**< the group or the neighbour, all zero for the tun device */
+	uint32_t scope_id;
+	struct storm_rule *rule;
+	double tokens;
+	uint64_t last;        /**< monotonic_ms() of the last packet */
+};
+
+/** The bucket of one sender: source address, group and where the packets came from */
+struct storm_entry {
+	uint64_t hash;        /**< 0 if the slot is free */
+	struct in6_addr src;
+	struct in6_addr group;
+	struct sockaddr_in6 ingress;  /**< the neighbour, all zero for the tun device */
+	struct storm_rule *rule;
+	double tokens;
+	uint64_t last;        /**< monotonic_ms() of the last packet */
+	uint64_t passed;
+	uint64_t dropped;
+};
+
+/**
+ * Token-bucket storm control.
+ *
+ * Packets to groups covered by a rule are counted per source address,
+ * group and ingress, the tun device or a neighbour. Each of those gets a
+ * bucket of burst tokens that refills at rate tokens per second, packets
+ * that find it empty are dropped instead of being relayed. Buckets live in
+ * a fixed table, a new sender replaces the least recently seen one among
+ * STORM_PROBES slots.
+ *
+ * Every group and every ingress also shares a bucket STORM_SHARE times as
+ * large, checked before the one of the sender, so that made up source
+ * addresses cannot pass more than that. A new bucket starts with a single
+ * token instead of a full burst, so replacing one never hands out tokens.
+ */
+typedef struct {
+	VECTOR(struct storm_rule) rules;
+	struct storm_entry *entries;   /**< STORM_ENTRIES slots, NULL without rules */
+	struct storm_bucket *groups;   /**< STORM_AGGREGATES slots */
+	struct storm_bucket *ingresses; /**< STORM_AGGREGATES slots */
+	uint64_t seed;
+
+	uint64_t dropped_local;        /**< packets from the tun device */
+	uint64_t dropped_remote;       /**< packets from neighbours */
+	uint64_t dropped_group;        /**< of those, packets over the limit of their group */
+	uint64_t dropped_ingress;      /**< of those, packets over the limit of their ingress */
+	uint64_t replaced;             /**< buckets given to a new sender */
+} storm_ctx;
+
+void storm_init(storm_ctx *storm);
+bool storm_add_rule(storm_ctx *storm, const char *spec);
+bool storm_check(storm_ctx *storm, const struct sockaddr_in6 *ingress, const uint8_t *packet, size_t len);
+size_t storm_offenders(storm_ctx *storm, struct storm_entry **offenders, size_t n);
+
+static inline bool storm_enabled(storm_ctx *storm) {
+	return storm->entries != NULL;
+}
@@ -37,15 +37,13 @@ struct timespec settime(time_t timeout, long millisecs) {
 	return timeAdd(&due, &t);
 }
 
-/** Enqueues a new task. A task with a timeout of zero is scheduled immediately.
- */
-taskqueue_t *post_task(taskqueue_ctx *ctx, time_t timeout, long millisecs, void (*function)(void *),
-		       void (*cleanup)(void *), void *data) {
+static taskqueue_t *enqueue_task(taskqueue_ctx *ctx, struct timespec due, void (*function)(void *),
+				 void (*cleanup)(void *), void *data) {
 	taskqueue_t *task = mmfd_alloc(sizeof(taskqueue_t));
 	task->children = task->next = NULL;
 	task->pprev = NULL;
 
-	task->due = settime(timeout, millisecs);
+	task->due = due;
 
 	task->function = function;
 	task->cleanup = cleanup;
@@ -56,6 +54,25 @@ taskqueue_t *post_task(taskqueue_ctx *ctx, time_t timeout, long millisecs, void
 	return task;
 }
 
+/** Enqueues a new task. A task with a timeout of zero is scheduled immediately.
+ */
+taskqueue_t *post_task(taskqueue_ctx *ctx, time_t timeout, long millisecs, void (*function)(void *),
+		       void (*cleanup)(void *), void *data) {
+	return enqueue_task(ctx, settime(timeout, millisecs), function, cleanup, data);
+}
+
+/** Enqueues a new task with a timeout given in microseconds.
+ */
+taskqueue_t *post_task_us(taskqueue_ctx *ctx, long microsecs, void (*function)(void *),
+			  void (*cleanup)(void *), void *data) {
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+
+	struct timespec t = {.tv_sec = microsecs / 1000000l, .tv_nsec = (microsecs % 1000000l) * 1000l};
+
+	return enqueue_task(ctx, timeAdd(&due, &t), function, cleanup, data);
+}
+
 void drop_task(taskqueue_t *task) {
 	taskqueue_remove(task);
 
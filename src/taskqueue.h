@@ -44,6 +44,8 @@ void taskqueue_schedule(taskqueue_ctx *ctx);
 taskqueue_t *post_task(taskqueue_ctx *ctx, time_t timeout,
 		       long millisecs, void (*function)(void *),
 		       void (*cleanup)(void *), void *data);
+taskqueue_t *post_task_us(taskqueue_ctx *ctx, long microsecs, void (*function)(void *),
+			  void (*cleanup)(void *), void *data);
 void drop_task(taskqueue_t *task);
 bool reschedule_task(taskqueue_ctx *ctx, taskqueue_t *task,
 		     time_t timeout, long millisecs);
@@ -5,6 +5,7 @@
  *
  * SPDX-License-Identifier: BSD-2-Clause
  */
+#include <stdint.h>
 #include <time.h>
 
 #define BILLION 1000000000l
@@ -30,3 +31,10 @@ int timespec_cmp(struct timespec a, struct timespec b) {
 
 	return 0;
 }
+
+/** returns a coarse monotonic timestamp in milliseconds, cheap enough for the packet path */
+uint64_t monotonic_ms() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &t);
+	return t.tv_sec * 1000ull + t.tv_nsec / 1000000;
+}
@@ -6,7 +6,9 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 #pragma once
+#include <stdint.h>
 #include <time.h>
 
 struct timespec timeAdd(struct timespec *t1, struct timespec *t2);
 int timespec_cmp(struct timespec a, struct timespec b);
+uint64_t monotonic_ms();
@@ -0,0 +1,150 @@
+#include "tunqueue.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * tunqueue_init - set up the queue for the tun device
+ * @queue: the queue
+ * @size: number of packets it holds, 0 to write them right away
+ * @slot_size: largest packet it holds, bigger ones are written right away
+ */
+void tunqueue_init(tunqueue_ctx *queue, size_t size, size_t slot_size) {
+	*queue = (tunqueue_ctx){
+		.size = size,
+		.slot_size = slot_size,
+	};
+
+	if (!size)
+		return;
+
+	queue->slots = mmfd_alloc(size * slot_size);
+	queue->lens = mmfd_alloc(size * sizeof(*queue->lens));
+}
+
+/** Writes a packet, returns false if the device did not take it for now */
+static bool tunqueue_write(struct context *ctx, const uint8_t *packet, size_t len) {
+	tunqueue_ctx *queue = &ctx->tunqueue;
+
+	if (ctx->tun_vnet) {
+		if (vnet_write(ctx, packet, len))
+			return true;
+
+		queue->blocks++;
+		return false;
+	}
+
+	if (uring_enabled(&ctx->uring) && uring_write(&ctx->uring, ctx->tunfd, packet, len))
+		return true;
+
+	if (write(ctx->tunfd, packet, len) >= 0)
+		return true;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		queue->blocks++;
+		return false;
+	}
+
+	log_verbose("write to tun device: %s\n", strerror(errno));
+	queue->errors++;
+	return true;
+}
+
+/** Waits for the device to become writable, tunqueue_writable() continues */
+static void tunqueue_block(struct context *ctx) {
+	ctx->tunqueue.blocked = true;
+
+	if (uring_enabled(&ctx->uring))
+		uring_poll_writable(&ctx->uring, ctx->tunfd);
+	else
+		change_fd(ctx->efd, ctx->tunfd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+/** Writes the queued packets up to the first one the device does not take */
+static void tunqueue_drain(struct context *ctx) {
+	tunqueue_ctx *queue = &ctx->tunqueue;
+
+	if (queue->blocked)
+		return;
+
+	while (queue->len) {
+		if (!tunqueue_write(ctx, queue->slots + queue->head * queue->slot_size, queue->lens[queue->head])) {
+			tunqueue_block(ctx);
+			return;
+		}
+
+		queue->head = (queue->head + 1) % queue->size;
+		queue->len--;
+	}
+}
+
+/**
+ * tunqueue_add - queue a packet received from a neighbour
+ * @ctx: the mmfd context
+ * @packet: the packet, it is copied
+ * @len: its length
+ */
+void tunqueue_add(struct context *ctx, const uint8_t *packet, size_t len) {
+	tunqueue_ctx *queue = &ctx->tunqueue;
+
+	if (!queue->size || len > queue->slot_size) {
+		// packets that do not fit into a slot may not overtake the queued ones
+		tunqueue_drain(ctx);
+
+		if (queue->len || !tunqueue_write(ctx, packet, len))
+			queue->dropped++;
+		return;
+	}
+
+	if (queue->len == queue->size) {
+		queue->dropped++;
+		return;
+	}
+
+	size_t slot = (queue->head + queue->len) % queue->size;
+
+	memcpy(queue->slots + slot * queue->slot_size, packet, len);
+	queue->lens[slot] = len;
+	queue->len++;
+
+	if (queue->len > queue->max_len)
+		queue->max_len = queue->len;
+}
+
+/**
+ * tunqueue_flush - write the queued packets
+ * @ctx: the mmfd context
+ *
+ * Stops at the first packet the device does not take and waits until it
+ * is writable again. With -O the packets of one flow that left the queue
+ * are written as one at the end of the turn, a train the device does not
+ * take waits the same way.
+ */
+void tunqueue_flush(struct context *ctx) {
+	tunqueue_drain(ctx);
+
+	if (ctx->tun_vnet && !ctx->tunqueue.blocked && !vnet_flush(ctx)) {
+		ctx->tunqueue.blocks++;
+		tunqueue_block(ctx);
+	}
+}
+
+/**
+ * tunqueue_writable - the tun device takes packets again
+ * @ctx: the mmfd context
+ */
+void tunqueue_writable(struct context *ctx) {
+	if (!ctx->tunqueue.blocked)
+		return;
+
+	ctx->tunqueue.blocked = false;
+
+	if (!uring_enabled(&ctx->uring))
+		change_fd(ctx->efd, ctx->tunfd, EPOLL_CTL_MOD, EPOLLIN | EPOLLET);
+
+	tunqueue_flush(ctx);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TUNQUEUE_SIZE 256
+
+struct context;
+
+/**
+ * Packets for the tun device.
+ *
+ * Packets accepted from the neighbours wait here until the turn of the
+ * event loop is over and are written after all relaying is done. If the
+ * device does not take more (EAGAIN) the rest stays queued until it is
+ * writable again. Once the queue is full, new packets are dropped.
+ */
+typedef struct {
+	uint8_t *slots;      /**< size slots of slot_size bytes */
+	uint16_t *lens;
+	size_t size;         /**< 0 if packets are written right away */
+	size_t slot_size;    /**< the tun MTU */
+	size_t head;
+	size_t len;
+	bool blocked;        /**< waiting for the device to become writable */
+
+	uint64_t dropped;    /**< packets that found the queue full */
+	uint64_t blocks;     /**< writes that returned EAGAIN */
+	uint64_t errors;
+	size_t max_len;      /**< deepest the queue has been */
+} tunqueue_ctx;
+
+void tunqueue_init(tunqueue_ctx *queue, size_t size, size_t slot_size);
+void tunqueue_add(struct context *ctx, const uint8_t *packet, size_t len);
+void tunqueue_flush(struct context *ctx);
+void tunqueue_writable(struct context *ctx);
@@ -0,0 +1,573 @@
+#include "uring.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+#include "gso.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RX_GROUP 0
+#define TUN_GROUP 1
+
+/* IORING_OP_READ_MULTISHOT from Linux 6.7, older headers lack it */
+#define OP_READ_MULTISHOT 49
+
+/* room for the source address in front of the control messages, keeps them aligned */
+#define NAME_SIZE 32
+
+enum uring_op {
+	OP_RECV = 1,
+	OP_TUN_READ,
+	OP_TUN_POLL,
+	OP_POLL,
+	OP_SEND,
+	OP_WRITE,
+	OP_CANCEL,
+	OP_TUN_WRITABLE,
+};
+
+#define USER_DATA(op, arg) ((uint64_t)(op) << 32 | (uint32_t)(arg))
+#define USER_OP(data) ((uint32_t)((data) >> 32))
+#define USER_ARG(data) ((uint32_t)(data))
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_submit(uring_ctx *uring) {
+	if (!uring->queued)
+		return;
+
+	int rc = sys_io_uring_enter(uring->fd, uring->queued, 0, 0);
+	uring->enters++;
+
+	if (rc < 0)
+		log_error("io_uring_enter: %s\n", strerror(errno));
+	else
+		uring->queued -= rc;
+}
+
+/** Returns a cleared SQE, submitting what is queued if the ring is full */
+static struct io_uring_sqe *uring_sqe(uring_ctx *uring) {
+	unsigned int tail = *uring->sq_tail;
+
+	if (tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) > *uring->sq_mask)
+		uring_submit(uring);
+
+	unsigned int index = tail & *uring->sq_mask;
+	struct io_uring_sqe *sqe = &uring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	uring->sq_array[index] = index;
+
+	return sqe;
+}
+
+/** Hands the SQE from the last uring_sqe() to the kernel with the next submit */
+static void uring_queue(uring_ctx *uring) {
+	__atomic_store_n(uring->sq_tail, *uring->sq_tail + 1, __ATOMIC_RELEASE);
+	uring->queued++;
+}
+
+static void uring_buffer_return(struct uring_buffers *buffers, uint16_t bid) {
+	uint16_t tail = buffers->ring->tail;
+	struct io_uring_buf *buf = &buffers->ring->bufs[tail & (buffers->entries - 1)];
+
+	// the tail shares its memory with bufs[0].resv, so never write that
+	buf->addr = (uintptr_t)(buffers->data + bid * buffers->buffer_size);
+	buf->len = buffers->buffer_size;
+	buf->bid = bid;
+
+	__atomic_store_n(&buffers->ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static bool uring_buffers_init(uring_ctx *uring, struct uring_buffers *buffers, uint16_t group, unsigned int entries, size_t size) {
+	buffers->ring = mmap(NULL, entries * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (buffers->ring == MAP_FAILED) {
+		buffers->ring = NULL;
+		return false;
+	}
+
+	buffers->entries = entries;
+	buffers->group = group;
+	buffers->buffer_size = (size + 63) & ~(size_t)63;
+	buffers->data = mmfd_alloc(entries * buffers->buffer_size);
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t)buffers->ring,
+		.ring_entries = entries,
+		.bgid = group,
+	};
+
+	if (sys_io_uring_register(uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return false;
+
+	for (unsigned int i = 0; i < entries; i++)
+		uring_buffer_return(buffers, i);
+
+	return true;
+}
+
+static void uring_buffers_free(struct uring_buffers *buffers) {
+	if (buffers->ring)
+		munmap(buffers->ring, buffers->entries * sizeof(struct io_uring_buf));
+
+	free(buffers->data);
+	memset(buffers, 0, sizeof(*buffers));
+}
+
+static void uring_free(uring_ctx *uring) {
+	uring_buffers_free(&uring->rx);
+	uring_buffers_free(&uring->tun);
+
+	if (uring->sqes)
+		munmap(uring->sqes, uring->sqes_size);
+	if (uring->sq_ring)
+		munmap(uring->sq_ring, uring->sq_ring_size);
+	if (uring->fd >= 0)
+		close(uring->fd);
+
+	free(uring->tx_data);
+	free(uring->tx);
+
+	memset(uring, 0, sizeof(*uring));
+	uring->fd = -1;
+}
+
+/**
+ * uring_init - set up the io_uring engine
+ * @uring: the engine to initialize
+ * @rx_buffer_size: largest datagram read from an intercom socket
+ * @tun_buffer_size: largest packet read from the tun device
+ *
+ * Return: true on success, false if the kernel lacks something the engine
+ * needs, in which case mmfd stays on epoll
+ */
+bool uring_init(uring_ctx *uring, size_t rx_buffer_size, size_t tun_buffer_size) {
+	struct io_uring_params params = {};
+
+	memset(uring, 0, sizeof(*uring));
+
+	uring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+	if (uring->fd < 0)
+		goto error;
+
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+		errno = ENOSYS;
+		goto error;
+	}
+
+	uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (uring->cq_ring_size > uring->sq_ring_size)
+		uring->sq_ring_size = uring->cq_ring_size;
+
+	uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQ_RING);
+	if (uring->sq_ring == MAP_FAILED) {
+		uring->sq_ring = NULL;
+		goto error;
+	}
+	uring->cq_ring = uring->sq_ring;
+
+	uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+	if (uring->sqes == MAP_FAILED) {
+		uring->sqes = NULL;
+		goto error;
+	}
+
+	uint8_t *sq = uring->sq_ring, *cq = uring->cq_ring;
+
+	uring->sq_head = (unsigned int *)(sq + params.sq_off.head);
+	uring->sq_tail = (unsigned int *)(sq + params.sq_off.tail);
+	uring->sq_mask = (unsigned int *)(sq + params.sq_off.ring_mask);
+	uring->sq_array = (unsigned int *)(sq + params.sq_off.array);
+	uring->cq_head = (unsigned int *)(cq + params.cq_off.head);
+	uring->cq_tail = (unsigned int *)(cq + params.cq_off.tail);
+	uring->cq_mask = (unsigned int *)(cq + params.cq_off.ring_mask);
+	uring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	uring->rx_message = (struct msghdr){
+		.msg_namelen = NAME_SIZE,
+		.msg_controllen = RX_CONTROL_SIZE,
+	};
+
+	size_t rx_size = sizeof(struct io_uring_recvmsg_out) + NAME_SIZE + RX_CONTROL_SIZE + rx_buffer_size;
+
+	if (!uring_buffers_init(uring, &uring->rx, RX_GROUP, URING_RX_BUFFERS, rx_size) ||
+	    !uring_buffers_init(uring, &uring->tun, TUN_GROUP, URING_TUN_BUFFERS, tun_buffer_size))
+		goto error;
+
+	uring->tx_data = mmfd_alloc(URING_TX_SLOTS * URING_TX_SLOT_SIZE);
+	uring->tx = mmfd_new0_array(URING_TX_SLOTS, struct uring_tx);
+
+	struct iovec registered = {
+		.iov_base = uring->tx_data,
+		.iov_len = URING_TX_SLOTS * URING_TX_SLOT_SIZE,
+	};
+
+	if (sys_io_uring_register(uring->fd, IORING_REGISTER_BUFFERS, &registered, 1))
+		goto error;
+
+	for (int i = 0; i < URING_TX_SLOTS; i++)
+		uring->tx[i].next_free = i + 1 < URING_TX_SLOTS ? i + 1 : -1;
+
+	uring->tx_free = 0;
+	uring->tun_multishot = true;
+
+	return true;
+
+error:
+	log_error("io_uring unavailable, using epoll: %s\n", strerror(errno));
+	uring_free(uring);
+	return false;
+}
+
+/** Takes a free transmit slot for len bytes, or returns -1 */
+static int uring_tx_get(uring_ctx *uring, size_t len) {
+	int slot = uring->tx_free;
+
+	if (slot < 0 || len > URING_TX_SLOT_SIZE) {
+		uring->tx_fallbacks++;
+		return -1;
+	}
+
+	uring->tx_free = uring->tx[slot].next_free;
+	return slot;
+}
+
+static void uring_tx_put(uring_ctx *uring, int slot) {
+	uring->tx[slot].next_free = uring->tx_free;
+	uring->tx_free = slot;
+}
+
+static uint8_t *uring_tx_data(uring_ctx *uring, int slot) {
+	return uring->tx_data + (size_t)slot * URING_TX_SLOT_SIZE;
+}
+
+/**
+ * uring_send - queue datagrams for sending
+ * @uring: the engine
+ * @fd: the socket to send on
+ * @msgs: the messages, with a destination address each
+ * @n: number of messages
+ *
+ * The datagrams are copied, the caller may reuse all buffers right away.
+ *
+ * Return: the number of messages queued, the rest has to be sent by the caller
+ */
+unsigned int uring_send(uring_ctx *uring, int fd, struct mmsghdr *msgs, unsigned int n) {
+	for (unsigned int i = 0; i < n; i++) {
+		struct msghdr *message = &msgs[i].msg_hdr;
+		size_t len = 0;
+
+		for (size_t j = 0; j < message->msg_iovlen; j++)
+			len += message->msg_iov[j].iov_len;
+
+		int slot = uring_tx_get(uring, len);
+		if (slot < 0)
+			return i;
+
+		struct uring_tx *tx = &uring->tx[slot];
+		uint8_t *p = uring_tx_data(uring, slot);
+
+		for (size_t j = 0; j < message->msg_iovlen; j++) {
+			memcpy(p, message->msg_iov[j].iov_base, message->msg_iov[j].iov_len);
+			p += message->msg_iov[j].iov_len;
+		}
+
+		memcpy(&tx->address, message->msg_name, sizeof(tx->address));
+		tx->iov = (struct iovec){
+			.iov_base = uring_tx_data(uring, slot),
+			.iov_len = len,
+		};
+		tx->message = (struct msghdr){
+			.msg_name = &tx->address,
+			.msg_namelen = sizeof(tx->address),
+			.msg_iov = &tx->iov,
+			.msg_iovlen = 1,
+		};
+
+		struct io_uring_sqe *sqe = uring_sqe(uring);
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)&tx->message;
+		sqe->len = 1;
+		sqe->user_data = USER_DATA(OP_SEND, slot);
+		uring_queue(uring);
+	}
+
+	return n;
+}
+
+/**
+ * uring_write - queue a write to the tun device
+ * @uring: the engine
+ * @fd: the tun device
+ * @data: the packet, it is copied
+ * @len: length of the packet
+ *
+ * Return: false if the packet has to be written by the caller
+ */
+bool uring_write(uring_ctx *uring, int fd, const void *data, size_t len) {
+	int slot = uring_tx_get(uring, len);
+	if (slot < 0)
+		return false;
+
+	memcpy(uring_tx_data(uring, slot), data, len);
+
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+	sqe->opcode = IORING_OP_WRITE_FIXED;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)uring_tx_data(uring, slot);
+	sqe->len = len;
+	sqe->buf_index = 0;
+	sqe->user_data = USER_DATA(OP_WRITE, slot);
+	uring_queue(uring);
+
+	return true;
+}
+
+/**
+ * uring_watch_socket - start receiving on an intercom socket
+ * @uring: the engine
+ * @fd: the socket
+ */
+void uring_watch_socket(uring_ctx *uring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)&uring->rx_message;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = RX_GROUP;
+	sqe->user_data = USER_DATA(OP_RECV, fd);
+	uring_queue(uring);
+}
+
+/** Stops receiving on a socket, to be called before it is closed */
+void uring_unwatch_socket(uring_ctx *uring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = USER_DATA(OP_RECV, fd);
+	sqe->user_data = USER_DATA(OP_CANCEL, fd);
+	uring_queue(uring);
+	uring_submit(uring);
+}
+
+static void uring_poll(uring_ctx *uring, int fd, enum uring_op op, bool multishot) {
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLIN;
+	sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = USER_DATA(op, fd);
+	uring_queue(uring);
+}
+
+/**
+ * uring_poll_writable - wait until the tun device takes packets again
+ * @uring: the engine
+ * @fd: the tun device
+ *
+ * tunqueue_writable() is called once it does.
+ */
+void uring_poll_writable(uring_ctx *uring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = USER_DATA(OP_TUN_WRITABLE, fd);
+	uring_queue(uring);
+}
+
+static void uring_read_tun(uring_ctx *uring, int fd) {
+	struct io_uring_sqe *sqe = uring_sqe(uring);
+
+	sqe->opcode = uring->tun_multishot ? OP_READ_MULTISHOT : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->len = uring->tun_multishot ? 0 : uring->tun.buffer_size;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = TUN_GROUP;
+	sqe->user_data = USER_DATA(OP_TUN_READ, fd);
+	uring_queue(uring);
+}
+
+static void uring_handle_recv(struct context *ctx, int fd, struct io_uring_cqe *cqe) {
+	uring_ctx *uring = &ctx->uring;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		uint8_t *buffer = uring->rx.data + bid * uring->rx.buffer_size;
+		struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *)buffer;
+		uint8_t *name = buffer + sizeof(*out);
+		uint8_t *control = name + NAME_SIZE;
+		uint8_t *payload = control + RX_CONTROL_SIZE;
+		size_t available = cqe->res - (payload - buffer);
+
+		struct msghdr message = {
+			.msg_name = name,
+			.msg_namelen = out->namelen,
+			.msg_control = control,
+			.msg_controllen = out->controllen,
+			.msg_flags = out->flags,
+		};
+
+		ctx->stats.rx_datagrams++;
+		udp_handle_message(ctx, &message, payload, out->payloadlen < available ? out->payloadlen : available);
+		uring_buffer_return(&uring->rx, bid);
+	} else if (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+		log_error("io_uring receive on fd %d: %s\n", fd, strerror(-cqe->res));
+	}
+
+	// a cancelled receive belongs to a socket that is gone, even if
+	// its number has already been reused
+	if (!(cqe->flags & IORING_CQE_F_MORE) && cqe->res != -ECANCELED && is_nic_fd(fd))
+		uring_watch_socket(uring, fd);
+}
+
+static void uring_handle_tun(struct context *ctx, int fd, struct io_uring_cqe *cqe) {
+	uring_ctx *uring = &ctx->uring;
+
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if (cqe->res > 0)
+			tun_handle_packet(ctx, uring->tun.data + bid * uring->tun.buffer_size, cqe->res);
+
+		uring_buffer_return(&uring->tun, bid);
+	}
+
+	if (cqe->flags & IORING_CQE_F_MORE)
+		return;
+
+	if (cqe->res == -EINVAL && uring->tun_multishot) {
+		log_verbose("no multishot reads from the tun device, reading one packet at a time\n");
+		uring->tun_multishot = false;
+	} else if (cqe->res == -EAGAIN) {
+		uring_poll(uring, fd, OP_TUN_POLL, false);
+		return;
+	} else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+		log_error("io_uring read from tun device: %s\n", strerror(-cqe->res));
+	}
+
+	uring_read_tun(uring, fd);
+}
+
+static void uring_complete(struct context *ctx, struct io_uring_cqe *cqe) {
+	uring_ctx *uring = &ctx->uring;
+	int arg = USER_ARG(cqe->user_data);
+
+	switch (USER_OP(cqe->user_data)) {
+		case OP_RECV:
+			uring_handle_recv(ctx, arg, cqe);
+			break;
+		case OP_TUN_READ:
+			uring_handle_tun(ctx, arg, cqe);
+			break;
+		case OP_TUN_POLL:
+			uring_read_tun(uring, arg);
+			break;
+		case OP_POLL:
+			if (arg == ctx->taskqueue_ctx.fd)
+				taskqueue_run(&ctx->taskqueue_ctx);
+			else if (arg == ctx->socket_ctx.fd)
+				socket_handle_in(&ctx->socket_ctx);
+
+			if (!(cqe->flags & IORING_CQE_F_MORE))
+				uring_poll(uring, arg, OP_POLL, true);
+			break;
+		case OP_SEND:
+			if (cqe->res < 0) {
+				struct sockaddr_in6 *dst = &uring->tx[arg].address;
+				log_error("io_uring send to %s: %s\n", print_ip(&dst->sin6_addr), strerror(-cqe->res));
+				ctx->stats.data_tx_errors++;
+			} else {
+				ctx->stats.data_tx++;
+			}
+
+			uring_tx_put(uring, arg);
+			break;
+		case OP_WRITE:
+			if (cqe->res < 0)
+				log_error("io_uring write to tun device: %s\n", strerror(-cqe->res));
+
+			uring_tx_put(uring, arg);
+			break;
+		case OP_TUN_WRITABLE:
+			tunqueue_writable(ctx);
+			break;
+		case OP_CANCEL:
+			break;
+	}
+}
+
+/**
+ * uring_loop - the main loop of the io_uring engine
+ * @ctx: the mmfd context
+ *
+ * Everything queued while handling completions is submitted together with
+ * the next wait, in a single io_uring_enter().
+ */
+void uring_loop(struct context *ctx) {
+	uring_ctx *uring = &ctx->uring;
+
+	uring_poll(uring, ctx->taskqueue_ctx.fd, OP_POLL, true);
+
+	if (ctx->socket_ctx.fd)
+		uring_poll(uring, ctx->socket_ctx.fd, OP_POLL, true);
+
+	uring_read_tun(uring, ctx->tunfd);
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->tun_queues); i++)
+		uring_read_tun(uring, VECTOR_INDEX(ctx->tun_queues, i));
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++)
+		uring_watch_socket(uring, VECTOR_INDEX(ctx->interfaces, i).unicastfd);
+
+	while (1) {
+		// packets left over by the scheduler go out in the next turn
+		int rc = sys_io_uring_enter(uring->fd, uring->queued, egress_backlog(&ctx->egress) ? 0 : 1, IORING_ENTER_GETEVENTS);
+		uring->enters++;
+
+		if (rc < 0) {
+			if (errno != EINTR)
+				log_error("io_uring_enter: %s\n", strerror(errno));
+		} else {
+			uring->queued -= rc;
+		}
+
+		unsigned int head = *uring->cq_head;
+		unsigned int tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe cqe = uring->cqes[head & *uring->cq_mask];
+
+			uring_complete(ctx, &cqe);
+		}
+
+		__atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+
+		egress_flush(ctx);
+		gso_flush(ctx);
+		tunqueue_flush(ctx);
+	}
+}
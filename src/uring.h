@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 256
+#define URING_RX_BUFFERS 64   /* power of two */
+#define URING_TUN_BUFFERS 16  /* power of two */
+#define URING_TX_SLOTS 256
+#define URING_TX_SLOT_SIZE 2048
+
+struct context;
+struct interface;
+
+/** A ring of buffers the kernel picks from for reads, see IORING_REGISTER_PBUF_RING */
+struct uring_buffers {
+	struct io_uring_buf_ring *ring;
+	uint8_t *data;
+	size_t buffer_size;
+	unsigned int entries;
+	uint16_t group;
+};
+
+/** A datagram or tun write in flight, its memory belongs to the kernel until it completes */
+struct uring_tx {
+	struct msghdr message;
+	struct iovec iov;
+	struct sockaddr_in6 address;
+	int next_free;
+};
+
+/**
+ * An I/O engine on io_uring, used instead of epoll when selected with -e.
+ *
+ * Intercom sockets are read with multishot recvmsg into a provided buffer
+ * ring, the tun device with (multishot) reads into another one. Fan-out
+ * sends and tun writes are copied into slots of a registered buffer and
+ * queued, all of them are submitted with the next wait for completions.
+ * The other file descriptors are watched with multishot polls.
+ */
+typedef struct {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int queued;   /**< SQEs written but not yet submitted */
+
+	struct uring_buffers rx;
+	struct uring_buffers tun;
+	struct msghdr rx_message; /**< layout for multishot recvmsg */
+	bool tun_multishot;
+
+	uint8_t *tx_data;      /**< URING_TX_SLOTS slots, registered as fixed buffer 0 */
+	struct uring_tx *tx;
+	int tx_free;           /**< first free slot, -1 if all are in flight */
+
+	uint64_t enters;       /**< io_uring_enter() calls */
+	uint64_t tx_fallbacks; /**< sends done synchronously since all slots were in flight */
+} uring_ctx;
+
+bool uring_init(uring_ctx *uring, size_t rx_buffer_size, size_t tun_buffer_size);
+void uring_loop(struct context *ctx);
+void uring_watch_socket(uring_ctx *uring, int fd);
+void uring_unwatch_socket(uring_ctx *uring, int fd);
+unsigned int uring_send(uring_ctx *uring, int fd, struct mmsghdr *msgs, unsigned int n);
+bool uring_write(uring_ctx *uring, int fd, const void *data, size_t len);
+void uring_poll_writable(uring_ctx *uring, int fd);
+
+static inline bool uring_enabled(uring_ctx *uring) {
+	return uring->fd >= 0;
+}
@@ -3,6 +3,8 @@
 #include "error.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/syscall.h>
 #include <unistd.h>
 
@@ -50,6 +52,55 @@ const char *print_ip(const struct in6_addr *addr) {
 	return inet_ntop(AF_INET6, &(addr->s6_addr), strbuffer.element[str_bufferoffset], STRBUFELEMENTLEN);
 }
 
+/**
+ * parse_prefix - parse <address>[/<length>]
+ * @str: the text, need not be terminated
+ * @len: its length
+ * @prefix: set to the address
+ * @prefix_len: set to the length, 128 if there is none
+ *
+ * Return: false if @str is not a prefix
+ */
+bool parse_prefix(const char *str, size_t len, struct in6_addr *prefix, uint8_t *prefix_len) {
+	char addr[INET6_ADDRSTRLEN + 4];
+	char *slash, *end;
+
+	if (len >= sizeof(addr))
+		return false;
+
+	memcpy(addr, str, len);
+	addr[len] = '\0';
+	*prefix_len = 128;
+
+	slash = strchr(addr, '/');
+	if (slash) {
+		unsigned long l = strtoul(slash + 1, &end, 10);
+
+		if (end == slash + 1 || *end || l > 128)
+			return false;
+
+		*prefix_len = l;
+		*slash = '\0';
+	}
+
+	return inet_pton(AF_INET6, addr, prefix) == 1;
+}
+
+/** Returns true if the first len bits of addr and prefix are the same */
+bool prefix_match(const struct in6_addr *addr, const struct in6_addr *prefix, unsigned int len) {
+	unsigned int bytes = len / 8, bits = len % 8;
+
+	if (memcmp(addr, prefix, bytes))
+		return false;
+
+	if (!bits)
+		return true;
+
+	uint8_t mask = 0xff << (8 - bits);
+
+	return !((addr->s6_addr[bytes] ^ prefix->s6_addr[bytes]) & mask);
+}
+
 void print_packet(unsigned char *buf, int size) {
 	if (!ctx.debug)
 		return;
@@ -7,6 +7,13 @@
 #define STRBUFLEN 256
 #define STRBUFELEMENTS (STRBUFLEN / STRBUFELEMENTLEN)
 
+/** Mixes the bits of a 64 bit value (splitmix64 finalizer) for use as a hash */
+static inline uint64_t hash64(uint64_t x) {
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+	return x ^ (x >> 31);
+}
+
 union buffer {
 	char element[STRBUFLEN / STRBUFELEMENTLEN][STRBUFELEMENTLEN];
 	char allofit[STRBUFLEN];
@@ -17,6 +24,8 @@ void log_error(const char *format, ...);
 void log_verbose(const char *format, ...);
 void log_debug(const char *format, ...);
 const char *print_ip(const struct in6_addr *addr);
+bool parse_prefix(const char *str, size_t len, struct in6_addr *prefix, uint8_t *prefix_len);
+bool prefix_match(const struct in6_addr *addr, const struct in6_addr *prefix, unsigned int len);
 void print_packet(unsigned char *buf, int size);
 int obtainrandom(void *buf, size_t buflen, unsigned int flags);
 
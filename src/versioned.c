@@ -0,0 +1,115 @@
+#include "versioned.h"
+#include "mmfd.h"
+#include "intercom.h"
+
+#include <string.h>
+
+/**
+ * versioned_wrap - build the versioned header of a datagram
+ * @vh: the header to fill
+ * @hdr: the bare or sequence header of the packet
+ * @hdrlen: its length
+ * @hop_limit: hops the datagram may travel
+ *
+ * Return: length of @vh
+ */
+size_t versioned_wrap(struct versioned_header *vh, const struct header *hdr, size_t hdrlen, uint8_t hop_limit) {
+	*vh = (struct versioned_header){
+		.magic = VERSIONED_MAGIC,
+		.version = MMFD_PACKET_FORMAT_VERSION,
+		.type = VERSIONED_DATA,
+		.hop_limit = hop_limit,
+		.id.nonce = hdr->nonce,
+	};
+
+	if (hdrlen == sizeof(struct seq_header)) {
+		const struct seq_header *shdr = (const struct seq_header *)hdr;
+
+		vh->flags |= VERSIONED_SEQUENCED;
+		vh->id.origin = shdr->origin;
+		vh->id.seq = shdr->seq;
+	}
+
+	return sizeof(*vh);
+}
+
+/**
+ * versioned_unwrap - turn a datagram with the versioned header into one with the bare header
+ * @buffer: the datagram, its header is rewritten in place
+ * @len: its length
+ * @hop_limit: set to the hop limit it arrived with
+ *
+ * The bare or sequence header is written right in front of the packet, so
+ * the datagram can be handled like one from an older neighbour.
+ *
+ * Return: offset of the rewritten datagram in @buffer, or one of
+ * VERSIONED_INVALID, VERSIONED_MISMATCH, VERSIONED_UNKNOWN_TLV and
+ * VERSIONED_EXPIRED
+ */
+ssize_t versioned_unwrap(uint8_t *buffer, size_t len, uint8_t *hop_limit) {
+	struct versioned_header vh;
+
+	if (len < sizeof(vh))
+		return VERSIONED_INVALID;
+
+	memcpy(&vh, buffer, sizeof(vh));
+
+	if (vh.version != MMFD_PACKET_FORMAT_VERSION)
+		return VERSIONED_MISMATCH;
+
+	size_t tlv_len = ntohs(vh.tlv_len);
+
+	if (vh.type != VERSIONED_DATA || sizeof(vh) + tlv_len > len)
+		return VERSIONED_INVALID;
+
+	if (!vh.hop_limit)
+		return VERSIONED_EXPIRED;
+
+	size_t offset = sizeof(vh);
+
+	// no extensions are defined yet besides padding
+	while (offset < sizeof(vh) + tlv_len) {
+		uint8_t type = buffer[offset];
+
+		if (type == TLV_PAD) {
+			offset++;
+			continue;
+		}
+
+		if (type & TLV_CRITICAL)
+			return VERSIONED_UNKNOWN_TLV;
+
+		if (offset + 2 > sizeof(vh) + tlv_len)
+			return VERSIONED_INVALID;
+
+		offset += 2 + buffer[offset + 1];
+	}
+
+	// an option running past the others would reach into the packet
+	if (offset != sizeof(vh) + tlv_len)
+		return VERSIONED_INVALID;
+
+	size_t start = sizeof(vh) + tlv_len;
+
+	if (vh.flags & VERSIONED_SEQUENCED) {
+		struct seq_header shdr = {
+			.hdr.nonce = SEQ_MAGIC,
+			.origin = vh.id.origin,
+			.seq = vh.id.seq,
+		};
+
+		start -= sizeof(shdr);
+		memcpy(buffer + start, &shdr, sizeof(shdr));
+	} else {
+		// nonces that collide with a magic are never sent
+		if (vh.id.nonce == SEQ_MAGIC || vh.id.nonce == BUNDLE_MAGIC || vh.id.nonce == FRAG_MAGIC ||
+		    vh.id.nonce == NACK_MAGIC || vh.id.nonce == VERSIONED_MAGIC)
+			return VERSIONED_INVALID;
+
+		start -= sizeof(struct header);
+		memcpy(buffer + start, &vh.id.nonce, sizeof(vh.id.nonce));
+	}
+
+	*hop_limit = vh.hop_limit;
+	return start;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define DEFAULT_HOP_LIMIT 32
+
+#define VERSIONED_DATA 0x01       /* type: a packet for the tun device */
+#define VERSIONED_SEQUENCED 0x01  /* flag: id holds origin id and sequence number instead of a nonce */
+#define TLV_CRITICAL 0x80         /* type bit: receivers that do not know the TLV drop the packet */
+#define TLV_PAD 0x00              /* type: padding, no length and no value */
+
+struct header;
+
+/**
+ * The versioned header, marked by VERSIONED_MAGIC. It is followed by
+ * tlv_len bytes of extensions, each a type and length byte and a value,
+ * and then the packet.
+ */
+struct __attribute__((__packed__)) versioned_header {
+	uint64_t magic;       /**< VERSIONED_MAGIC */
+	uint8_t version;      /**< MMFD_PACKET_FORMAT_VERSION */
+	uint8_t type;
+	uint8_t flags;
+	uint8_t hop_limit;    /**< hops the datagram may still travel, every forwarder decrements it */
+	uint16_t tlv_len;     /**< network byte order */
+	uint16_t reserved;
+	union {
+		uint64_t nonce;
+		struct {
+			uint32_t origin;  /**< network byte order */
+			uint32_t seq;     /**< network byte order */
+		};
+	} id;
+};
+
+/** Outcome of versioned_unwrap() other than an offset */
+enum {
+	VERSIONED_INVALID = -1,     /**< truncated or of an unknown type */
+	VERSIONED_MISMATCH = -2,    /**< of another version */
+	VERSIONED_UNKNOWN_TLV = -3, /**< has a critical extension we do not know */
+	VERSIONED_EXPIRED = -4,     /**< its hop limit is used up */
+};
+
+size_t versioned_wrap(struct versioned_header *vh, const struct header *hdr, size_t hdrlen, uint8_t hop_limit);
+ssize_t versioned_unwrap(uint8_t *buffer, size_t len, uint8_t *hop_limit);
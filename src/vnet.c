@@ -0,0 +1,344 @@
+#include "vnet.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <linux/if_tun.h>
+#include <linux/ipv6.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+/* Not in older headers, both USO flags are needed for UDP GSO on the device */
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#define TUN_F_USO6 0x40
+#endif
+
+#ifndef VIRTIO_NET_HDR_GSO_UDP_L4
+#define VIRTIO_NET_HDR_GSO_UDP_L4 5
+#endif
+
+#define VNET_HDR_LEN sizeof(struct virtio_net_hdr)
+#define UDP6_HDR_LEN (sizeof(struct ipv6hdr) + sizeof(struct udphdr))
+
+/**
+ * vnet_setup - enable the offloads of a tun device opened with IFF_VNET_HDR
+ * @fd: the device
+ *
+ * Kernels without UDP segmentation on tun devices still get partial
+ * checksums, which are completed in vnet_segment().
+ *
+ * Return: true if the kernel may hand over UDP GSO super-packets
+ */
+bool vnet_setup(int fd) {
+	if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM | TUN_F_USO4 | TUN_F_USO6) == 0)
+		return true;
+
+	log_error("UDP segmentation offload not available on the tun device: %s\n", strerror(errno));
+
+	if (ioctl(fd, TUNSETOFFLOAD, TUN_F_CSUM) < 0)
+		log_error("checksum offload not available on the tun device: %s\n", strerror(errno));
+
+	return false;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *data, size_t len) {
+	for (; len > 1; data += 2, len -= 2)
+		sum += data[0] << 8 | data[1];
+
+	if (len)
+		sum += data[0] << 8;
+
+	return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum) {
+	while (sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+/** Sum of the IPv6 pseudo header of an UDP packet */
+static uint32_t csum_pseudo(const struct ipv6hdr *ip, size_t udp_len) {
+	uint32_t sum = csum_add(0, (const uint8_t *)&ip->saddr, 2 * sizeof(struct in6_addr));
+
+	return sum + (udp_len >> 16) + (udp_len & 0xffff) + IPPROTO_UDP;
+}
+
+static void csum_store(uint8_t *field, uint32_t sum) {
+	uint16_t csum = ~csum_fold(sum);
+
+	// zero means no checksum for UDP, ~0 is the same in one's complement
+	if (!csum)
+		csum = 0xffff;
+
+	field[0] = csum >> 8;
+	field[1] = csum & 0xff;
+}
+
+/**
+ * vnet_segment - turn a read from the tun device into single packets
+ * @buf: what was read, starting with the virtio header
+ * @len: length of the read
+ * @fn: called with every packet, which is only valid until it returns
+ * @arg: passed to @fn
+ *
+ * Partial checksums are completed. A super-packet is split up in place,
+ * the headers of every further segment overwrite the end of the payload
+ * of the one before, so @fn must be done with a packet when it returns.
+ *
+ * Return: number of packets passed to @fn
+ */
+unsigned int vnet_segment(uint8_t *buf, size_t len, vnet_packet_fn fn, void *arg) {
+	struct virtio_net_hdr vh;
+
+	if (len < VNET_HDR_LEN)
+		return 0;
+
+	memcpy(&vh, buf, sizeof(vh));
+
+	uint8_t *packet = buf + VNET_HDR_LEN;
+	len -= VNET_HDR_LEN;
+
+	if (vh.gso_type == VIRTIO_NET_HDR_GSO_NONE) {
+		if (vh.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM) {
+			if ((size_t)vh.csum_start + vh.csum_offset + 2 > len)
+				return 0;
+
+			csum_store(packet + vh.csum_start + vh.csum_offset,
+				   csum_add(0, packet + vh.csum_start, len - vh.csum_start));
+		}
+
+		fn(arg, packet, len);
+		return 1;
+	}
+
+	size_t hlen = vh.csum_start + sizeof(struct udphdr);
+	struct ipv6hdr *ip = (struct ipv6hdr *)packet;
+
+	if ((vh.gso_type & ~VIRTIO_NET_HDR_GSO_ECN) != VIRTIO_NET_HDR_GSO_UDP_L4 ||
+	    vh.csum_start < sizeof(struct ipv6hdr) || hlen > VNET_MAX_HEADERS || hlen >= len ||
+	    !vh.gso_size || ip->version != 6) {
+		log_verbose("Dropping super-packet of GSO type %u from the tun device.\n", vh.gso_type);
+		return 0;
+	}
+
+	uint8_t headers[VNET_MAX_HEADERS];
+	unsigned int n = 0;
+
+	memcpy(headers, packet, hlen);
+
+	for (size_t offset = hlen; offset < len; offset += vh.gso_size, n++) {
+		size_t payload = len - offset < vh.gso_size ? len - offset : vh.gso_size;
+		uint8_t *segment = packet + offset - hlen;
+		struct ipv6hdr *sip = (struct ipv6hdr *)segment;
+		struct udphdr *udp = (struct udphdr *)(segment + vh.csum_start);
+
+		memcpy(segment, headers, hlen);
+
+		sip->payload_len = htons(hlen - sizeof(struct ipv6hdr) + payload);
+		udp->len = htons(sizeof(struct udphdr) + payload);
+		udp->check = 0;
+
+		csum_store((uint8_t *)&udp->check,
+			   csum_add(csum_pseudo(sip, sizeof(struct udphdr) + payload),
+				    (uint8_t *)udp, sizeof(struct udphdr) + payload));
+
+		fn(arg, segment, hlen + payload);
+	}
+
+	return n;
+}
+
+/**
+ * vnet_write_single - write a packet with an empty virtio header
+ * @fd: the tun device
+ * @packet: the packet
+ * @len: its length
+ *
+ * Return: the result of writev()
+ */
+ssize_t vnet_write_single(int fd, const uint8_t *packet, size_t len) {
+	struct virtio_net_hdr vh = {
+		.gso_type = VIRTIO_NET_HDR_GSO_NONE,
+	};
+	struct iovec iov[2] = {
+		{
+			.iov_base = &vh,
+			.iov_len = sizeof(vh),
+		},
+		{
+			.iov_base = (void *)packet,
+			.iov_len = len,
+		}
+	};
+
+	return writev(fd, iov, 2);
+}
+
+/** Returns true for IPv6 packets that carry UDP right after the fixed header */
+static bool vnet_coalescable(const uint8_t *packet, size_t len) {
+	const struct ipv6hdr *ip = (const struct ipv6hdr *)packet;
+	const struct udphdr *udp = (const struct udphdr *)(packet + sizeof(*ip));
+
+	return len > UDP6_HDR_LEN && len - UDP6_HDR_LEN <= UINT16_MAX &&
+		ip->version == 6 && ip->nexthdr == IPPROTO_UDP &&
+		ntohs(ip->payload_len) == len - sizeof(*ip) &&
+		ntohs(udp->len) == len - sizeof(*ip);
+}
+
+/** Traffic class, flow label, hop limit, addresses and ports have to match */
+static bool vnet_same_flow(const uint8_t *a, const uint8_t *b) {
+	return !memcmp(a, b, 4) && !memcmp(a + 6, b + 6, UDP6_HDR_LEN - 6 - 4);
+}
+
+/** Writes a single packet, returns false if the device did not take it for now */
+static bool vnet_write_packet(struct context *ctx, const uint8_t *packet, size_t len) {
+	if (vnet_write_single(ctx->tunfd, packet, len) >= 0)
+		return true;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return false;
+
+	log_verbose("write to tun device: %s\n", strerror(errno));
+	ctx->tunqueue.errors++;
+	return true;
+}
+
+static void vnet_write_cb(void *arg, uint8_t *packet, size_t len) {
+	struct context *ctx = arg;
+
+	if (!vnet_write_packet(ctx, packet, len)) {
+		ctx->tunqueue.blocks++;
+		ctx->tunqueue.dropped++;
+	}
+}
+
+/**
+ * vnet_flush - write the packets waiting in the train
+ * @ctx: the mmfd context
+ *
+ * If the kernel refuses the super-packet it is split up here and written
+ * one packet at a time, later packets are not queued any more.
+ *
+ * Return: false if the device did not take the train for now, it stays
+ * until the next call
+ */
+bool vnet_flush(struct context *ctx) {
+	struct vnet_train *train = &ctx->tun_train;
+
+	if (!train->count)
+		return true;
+
+	uint8_t *packet = train->buffer + VNET_HDR_LEN;
+	size_t len = train->len - VNET_HDR_LEN;
+
+	if (train->count == 1) {
+		if (!vnet_write_packet(ctx, packet, len))
+			return false;
+		goto out;
+	}
+
+	struct ipv6hdr *ip = (struct ipv6hdr *)packet;
+	struct udphdr *udp = (struct udphdr *)(packet + sizeof(*ip));
+	size_t udp_len = len - sizeof(*ip);
+
+	ip->payload_len = htons(udp_len);
+	udp->len = htons(udp_len);
+
+	// the kernel completes the checksum of every segment from the pseudo header sum
+	uint16_t pseudo = csum_fold(csum_pseudo(ip, udp_len));
+	((uint8_t *)&udp->check)[0] = pseudo >> 8;
+	((uint8_t *)&udp->check)[1] = pseudo & 0xff;
+
+	struct virtio_net_hdr vh = {
+		.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM,
+		.gso_type = VIRTIO_NET_HDR_GSO_UDP_L4,
+		.hdr_len = UDP6_HDR_LEN,
+		.gso_size = train->segment,
+		.csum_start = sizeof(*ip),
+		.csum_offset = offsetof(struct udphdr, check),
+	};
+
+	memcpy(train->buffer, &vh, sizeof(vh));
+
+	// the headers above come out the same when the train is written again
+	if (write(ctx->tunfd, train->buffer, train->len) < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return false;
+
+		if (errno == EINVAL) {
+			log_error("tun device does not take UDP super-packets, writing packets one by one from now on\n");
+			ctx->tun_coalesce = false;
+			vnet_segment(train->buffer, train->len, vnet_write_cb, ctx);
+		} else {
+			log_verbose("write to tun device: %s\n", strerror(errno));
+			ctx->tunqueue.errors++;
+		}
+
+		goto out;
+	}
+
+	ctx->stats.tun_coalesced_writes++;
+	ctx->stats.tun_coalesced_packets += train->count;
+
+out:
+	train->len = 0;
+	train->count = 0;
+	return true;
+}
+
+/**
+ * vnet_write - queue a packet received from a neighbour for the tun device
+ * @ctx: the mmfd context
+ * @packet: the packet
+ * @len: its length
+ *
+ * UDP packets of one flow join a train as long as all of them but the last
+ * have the same payload size, everything else flushes the train and is
+ * written right away.
+ *
+ * Return: false if the device did not take the train or the packet for
+ * now, the packet is not kept then
+ */
+bool vnet_write(struct context *ctx, const uint8_t *packet, size_t len) {
+	struct vnet_train *train = &ctx->tun_train;
+
+	if (ctx->tunqueue.blocked)
+		return false;
+
+	if (!ctx->tun_coalesce || !vnet_coalescable(packet, len))
+		return vnet_flush(ctx) && vnet_write_packet(ctx, packet, len);
+
+	size_t payload = len - UDP6_HDR_LEN;
+
+	if (train->count &&
+	    (!vnet_same_flow(train->buffer + VNET_HDR_LEN, packet) ||
+	     payload > train->segment ||
+	     (train->len - VNET_HDR_LEN - UDP6_HDR_LEN) % train->segment ||
+	     train->count == VNET_MAX_SEGMENTS ||
+	     train->len + payload > VNET_BUFFER_SIZE) &&
+	    !vnet_flush(ctx))
+		return false;
+
+	if (!train->buffer)
+		train->buffer = mmfd_alloc(VNET_BUFFER_SIZE);
+
+	if (!train->count) {
+		memcpy(train->buffer + VNET_HDR_LEN, packet, len);
+		train->len = VNET_HDR_LEN + len;
+		train->segment = payload;
+	} else {
+		memcpy(train->buffer + train->len, packet + UDP6_HDR_LEN, payload);
+		train->len += payload;
+	}
+
+	train->count++;
+	return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/virtio_net.h>
+
+#define VNET_BUFFER_SIZE (sizeof(struct virtio_net_hdr) + 65535)
+#define VNET_MAX_HEADERS 256   /* IPv6 with extension headers and UDP */
+#define VNET_MAX_SEGMENTS 64
+
+struct context;
+
+/** Packets of one UDP flow waiting to be written to the tun device as one */
+struct vnet_train {
+	uint8_t *buffer;     /**< virtio header, IPv6 and UDP header of the first packet, the payloads */
+	size_t len;
+	uint16_t segment;    /**< UDP payload size of every packet but the last */
+	unsigned int count;
+};
+
+typedef void (*vnet_packet_fn)(void *arg, uint8_t *packet, size_t len);
+
+/**
+ * Offloads of the tun device with IFF_VNET_HDR.
+ *
+ * Every read and write on the device starts with a struct virtio_net_hdr.
+ * Local senders using UDP_SEGMENT hand over a whole burst as one UDP GSO
+ * super-packet, which is split up here since the neighbours expect one
+ * packet per datagram. Packets of one flow received from the neighbours
+ * during a turn of the event loop are written back as a super-packet for
+ * the kernel to split.
+ */
+
+bool vnet_setup(int fd);
+unsigned int vnet_segment(uint8_t *buf, size_t len, vnet_packet_fn fn, void *arg);
+ssize_t vnet_write_single(int fd, const uint8_t *packet, size_t len);
+bool vnet_write(struct context *ctx, const uint8_t *packet, size_t len);
+bool vnet_flush(struct context *ctx);
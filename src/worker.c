@@ -0,0 +1,742 @@
+#include "worker.h"
+#include "mmfd.h"
+#include "alloc.h"
+#include "error.h"
+#include "intercom.h"
+#include "util.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+static worker_shard *workers_shard(workers_ctx *workers, uint64_t key) {
+	return &workers->shards[hash64(key) & (WORKER_SEEN_SHARDS - 1)];
+}
+
+/**
+ * workers_seen_add - remember a data packet in the shared duplicate cache
+ * @workers: the workers
+ * @key: nonce, or origin and sequence number of the packet
+ *
+ * Return: true if the packet is new
+ */
+bool workers_seen_add(workers_ctx *workers, uint64_t key) {
+	worker_shard *shard = workers_shard(workers, key);
+
+	pthread_mutex_lock(&shard->lock);
+	bool is_new = seen_add(&shard->cache, key);
+	pthread_mutex_unlock(&shard->lock);
+
+	return is_new;
+}
+
+void workers_expire(workers_ctx *workers) {
+	for (size_t i = 0; i < WORKER_SEEN_SHARDS; i++) {
+		pthread_mutex_lock(&workers->shards[i].lock);
+		seen_expire(&workers->shards[i].cache);
+		pthread_mutex_unlock(&workers->shards[i].lock);
+	}
+}
+
+/**
+ * workers_stats - add up what the workers counted
+ * @workers: the workers
+ * @stats: the counters of the main thread, the workers' are added to them
+ * @seen: filled with the sum over all duplicate cache shards
+ */
+void workers_stats(workers_ctx *workers, struct stats *stats, seen_cache *seen) {
+	memset(seen, 0, sizeof(*seen));
+
+	for (size_t i = 0; i < WORKER_SEEN_SHARDS; i++) {
+		worker_shard *shard = &workers->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		seen->len += shard->cache.len;
+		seen->capacity += shard->cache.capacity;
+		seen->max_capacity += shard->cache.max_capacity;
+		seen->window = shard->cache.window;
+		seen->expired += shard->cache.expired;
+		seen->evicted_early += shard->cache.evicted_early;
+		seen->resizes += shard->cache.resizes;
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	for (unsigned int i = 0; i < workers->count; i++) {
+		struct stats *w = workers->workers[i].stats;
+
+		stats->data_rx += __atomic_load_n(&w->data_rx, __ATOMIC_RELAXED);
+		stats->data_duplicates += __atomic_load_n(&w->data_duplicates, __ATOMIC_RELAXED);
+		stats->data_tx += __atomic_load_n(&w->data_tx, __ATOMIC_RELAXED);
+		stats->data_tx_errors += __atomic_load_n(&w->data_tx_errors, __ATOMIC_RELAXED);
+		stats->data_tx_syscalls += __atomic_load_n(&w->data_tx_syscalls, __ATOMIC_RELAXED);
+		stats->data_tx_mcast += __atomic_load_n(&w->data_tx_mcast, __ATOMIC_RELAXED);
+		stats->bundles_rx += __atomic_load_n(&w->bundles_rx, __ATOMIC_RELAXED);
+		stats->bundled_rx += __atomic_load_n(&w->bundled_rx, __ATOMIC_RELAXED);
+		stats->rx_datagrams += __atomic_load_n(&w->rx_datagrams, __ATOMIC_RELAXED);
+		stats->rx_syscalls += __atomic_load_n(&w->rx_syscalls, __ATOMIC_RELAXED);
+		stats->local_rx += __atomic_load_n(&w->local_rx, __ATOMIC_RELAXED);
+		stats->tun_gso_reads += __atomic_load_n(&w->tun_gso_reads, __ATOMIC_RELAXED);
+		stats->tun_gso_segments += __atomic_load_n(&w->tun_gso_segments, __ATOMIC_RELAXED);
+		stats->rx_truncated += __atomic_load_n(&w->rx_truncated, __ATOMIC_RELAXED);
+		stats->versioned_rx += __atomic_load_n(&w->versioned_rx, __ATOMIC_RELAXED);
+		stats->version_mismatch += __atomic_load_n(&w->version_mismatch, __ATOMIC_RELAXED);
+		stats->versioned_invalid += __atomic_load_n(&w->versioned_invalid, __ATOMIC_RELAXED);
+		stats->unknown_tlv += __atomic_load_n(&w->unknown_tlv, __ATOMIC_RELAXED);
+		stats->hop_limit_expired += __atomic_load_n(&w->hop_limit_expired, __ATOMIC_RELAXED);
+		stats->hop_limit_exceeded += __atomic_load_n(&w->hop_limit_exceeded, __ATOMIC_RELAXED);
+	}
+}
+
+/** Counters of a worker are only written by the worker itself */
+#define WORKER_COUNT(w, field, n) __atomic_store_n(&(w)->stats->field, (w)->stats->field + (n), __ATOMIC_RELAXED)
+
+static void worker_send(struct worker *w, int fd, struct mmsghdr *msgs, unsigned int n) {
+	unsigned int done = 0;
+
+	while (done < n) {
+		int rc = sendmmsg(fd, &msgs[done], n - done, 0);
+		WORKER_COUNT(w, data_tx_syscalls, 1);
+
+		if (rc < 0) {
+			log_error("sendmmsg in worker %u: %s\n", w->index, strerror(errno));
+			WORKER_COUNT(w, data_tx_errors, 1);
+			done++;
+			continue;
+		}
+
+		WORKER_COUNT(w, data_tx, rc);
+		done += rc;
+	}
+}
+
+static bool same_peer(const struct sockaddr_in6 *a, const struct sockaddr_in6 *b) {
+	return a->sin6_scope_id == b->sin6_scope_id && !memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr));
+}
+
+/** Prepares one message per fragment, or one for the whole datagram if fragments is 0 */
+static unsigned int worker_fill(struct worker *w, struct mmsghdr *msgs, struct sockaddr_in6 *dst, struct iovec *iov, size_t iovlen, unsigned int fragments) {
+	unsigned int n = fragments ? fragments : 1;
+
+	for (unsigned int i = 0; i < n; i++) {
+		msgs[i] = (struct mmsghdr){
+			.msg_hdr = {
+				.msg_name = dst,
+				.msg_namelen = sizeof(struct sockaddr_in6),
+				.msg_iov = fragments ? w->frag.iovs[i] : iov,
+				.msg_iovlen = fragments ? 2 : iovlen,
+			},
+		};
+	}
+
+	return n;
+}
+
+/**
+ * Sends a datagram to every neighbour in the snapshot but the one it came
+ * from, src_addr is NULL for local packets
+ */
+static void worker_forward(struct worker *w, struct worker_snapshot *snapshot, struct sockaddr_in6 *src_addr, struct iovec *iov, size_t iovlen) {
+	size_t len = 0;
+
+	for (size_t i = 0; i < iovlen; i++)
+		len += iov[i].iov_len;
+
+	for (size_t i = 0; i < snapshot->links_len; i++) {
+		struct worker_link *link = &snapshot->links[i];
+		int fd = link->fds[w->index];
+		size_t recipients = link->count;
+		unsigned int n = 0, fragments = 0;
+
+		// a sender that is not one of the listed neighbours takes no copy away
+		if (src_addr && src_addr->sin6_scope_id == (uint32_t)link->ifindex) {
+			for (size_t j = link->first; j < link->first + link->count; j++) {
+				if (same_peer(&snapshot->peers[j], src_addr)) {
+					recipients--;
+					break;
+				}
+			}
+		}
+
+		if (link->room && recipients && len > link->room) {
+			fragments = frag_split(&w->frag, iov, iovlen, link->room);
+			if (!fragments)
+				continue;
+		}
+
+		if (link->mcast_threshold && recipients >= link->mcast_threshold) {
+			struct sockaddr_in6 group = w->ctx->groupaddr;
+			group.sin6_scope_id = link->ifindex;
+
+			VECTOR_RESIZE(w->fanout, fragments ? fragments : 1);
+			n = worker_fill(w, &VECTOR_INDEX(w->fanout, 0), &group, iov, iovlen, fragments);
+
+			worker_send(w, fd, &VECTOR_INDEX(w->fanout, 0), n);
+			WORKER_COUNT(w, data_tx_mcast, 1);
+			continue;
+		}
+
+		VECTOR_RESIZE(w->fanout, link->count * (fragments ? fragments : 1));
+
+		for (size_t j = link->first; j < link->first + link->count; j++) {
+			struct sockaddr_in6 *peer = &snapshot->peers[j];
+
+			if (src_addr && same_peer(peer, src_addr))
+				continue;
+
+			n += worker_fill(w, &VECTOR_INDEX(w->fanout, n), peer, iov, iovlen, fragments);
+		}
+
+		worker_send(w, fd, &VECTOR_INDEX(w->fanout, 0), n);
+	}
+}
+
+static void worker_handle_data(struct worker *w, struct worker_snapshot *snapshot, struct sockaddr_in6 *src_addr, uint8_t *buffer, size_t count) {
+	struct context *ctx = w->ctx;
+	struct header *hdr = (struct header *)buffer;
+	uint8_t hop_limit = 0;
+
+	if (count < sizeof(*hdr))
+		return;
+
+	WORKER_COUNT(w, data_rx, 1);
+
+	// the workers forward the bare header, only a used up hop limit
+	// is honoured
+	if (hdr->nonce == VERSIONED_MAGIC) {
+		ssize_t start = versioned_unwrap(buffer, count, &hop_limit);
+
+		switch (start) {
+		case VERSIONED_MISMATCH:
+			WORKER_COUNT(w, version_mismatch, 1);
+			return;
+		case VERSIONED_UNKNOWN_TLV:
+			WORKER_COUNT(w, unknown_tlv, 1);
+			return;
+		case VERSIONED_EXPIRED:
+			WORKER_COUNT(w, hop_limit_expired, 1);
+			return;
+		case VERSIONED_INVALID:
+			WORKER_COUNT(w, versioned_invalid, 1);
+			return;
+		}
+
+		WORKER_COUNT(w, versioned_rx, 1);
+		buffer += start;
+		count -= start;
+		hdr = (struct header *)buffer;
+	}
+
+	struct seq_header *shdr = (struct seq_header *)buffer;
+	size_t hdrlen = sizeof(*hdr);
+	uint64_t key = hdr->nonce;
+
+	if (hdr->nonce == SEQ_MAGIC) {
+		if (count < sizeof(*shdr))
+			return;
+
+		hdrlen = sizeof(*shdr);
+		key = (uint64_t)ntohl(shdr->origin) << 32 | ntohl(shdr->seq);
+	}
+
+	if (!workers_seen_add(&ctx->workers, key)) {
+		WORKER_COUNT(w, data_duplicates, 1);
+		return;
+	}
+
+	if (hdrlen == sizeof(*hdr))
+		dupfilter_add(&ctx->dupfilter, hdr->nonce);
+
+	struct iovec iov = {
+		.iov_base = buffer,
+		.iov_len = count,
+	};
+
+	if (hop_limit == 1)
+		WORKER_COUNT(w, hop_limit_exceeded, 1);
+	else
+		worker_forward(w, snapshot, src_addr, &iov, 1);
+
+	ssize_t rc = ctx->tun_vnet ? vnet_write_single(ctx->tunfd, buffer + hdrlen, count - hdrlen) :
+		write(ctx->tunfd, buffer + hdrlen, count - hdrlen);
+
+	if (rc < 0)
+		log_verbose("write to tun device in worker %u: %s\n", w->index, strerror(errno));
+}
+
+static void worker_handle_datagram(struct worker *w, struct worker_snapshot *snapshot, struct msghdr *message, uint8_t *buffer, size_t count) {
+	struct sockaddr_in6 *src_addr = message->msg_name;
+	struct header *hdr = (struct header *)buffer;
+
+	if (message->msg_flags & MSG_TRUNC) {
+		WORKER_COUNT(w, rx_truncated, 1);
+		return;
+	}
+
+	if (count < sizeof(*hdr))
+		return;
+
+	// hellos reach every socket of the group, the main thread handles them
+	if (intercom_is_hello(buffer, count))
+		return;
+
+	if (hdr->nonce == FRAG_MAGIC) {
+		buffer = frag_input(&w->frag, src_addr, buffer, count, &count);
+		if (!buffer)
+			return;
+
+		hdr = (struct header *)buffer;
+		if (hdr->nonce == FRAG_MAGIC)
+			return;
+	}
+
+	// retransmissions are not available with worker threads
+	if (hdr->nonce == NACK_MAGIC)
+		return;
+
+	if (hdr->nonce != BUNDLE_MAGIC) {
+		worker_handle_data(w, snapshot, src_addr, buffer, count);
+		return;
+	}
+
+	WORKER_COUNT(w, bundles_rx, 1);
+
+	for (size_t offset = sizeof(*hdr); offset + sizeof(struct bundle_entry) <= count;) {
+		struct bundle_entry *entry = (struct bundle_entry *)(buffer + offset);
+		size_t len = ntohs(entry->len);
+
+		offset += sizeof(*entry) + len;
+
+		if (offset > count)
+			return;
+
+		if (len >= sizeof(*hdr) && ((struct header *)entry->data)->nonce == BUNDLE_MAGIC)
+			continue;
+
+		WORKER_COUNT(w, bundled_rx, 1);
+		worker_handle_data(w, snapshot, src_addr, entry->data, len);
+	}
+}
+
+static void worker_handle_in(struct worker *w, struct worker_snapshot *snapshot, int fd) {
+	struct rx_batch *batch = w->batch;
+
+	while (1) {
+		for (size_t i = 0; i < batch->size; i++) {
+			batch->iovs[i] = (struct iovec){
+				.iov_base = batch->buffers + i * batch->buffer_size,
+				.iov_len = batch->buffer_size,
+			};
+
+			batch->msgs[i].msg_hdr = (struct msghdr){
+				.msg_name = &batch->addrs[i],
+				.msg_namelen = sizeof(struct sockaddr_in6),
+				.msg_iov = &batch->iovs[i],
+				.msg_iovlen = 1,
+				.msg_control = batch->control + i * RX_CONTROL_SIZE,
+				.msg_controllen = RX_CONTROL_SIZE,
+			};
+		}
+
+		int n = recvmmsg(fd, batch->msgs, batch->size, 0, NULL);
+		WORKER_COUNT(w, rx_syscalls, 1);
+
+		if (n == -1) {
+			if (errno != EAGAIN)
+				log_error("recvmmsg in worker %u: %s\n", w->index, strerror(errno));
+			break;
+		}
+
+		WORKER_COUNT(w, rx_datagrams, n);
+
+		for (int i = 0; i < n; i++)
+			worker_handle_datagram(w, snapshot, &batch->msgs[i].msg_hdr, batch->iovs[i].iov_base, batch->msgs[i].msg_len);
+
+		if ((size_t)n < batch->size)
+			break;
+	}
+}
+
+/** Puts a header in front of a local packet and sends it, see handle_packet() */
+static void worker_handle_local(struct worker *w, struct worker_snapshot *snapshot, uint8_t *packet, size_t len) {
+	struct context *ctx = w->ctx;
+	struct seq_header shdr;
+	size_t hdrlen = sizeof(shdr.hdr);
+	uint64_t key;
+
+	WORKER_COUNT(w, local_rx, 1);
+
+	if (ctx->seqmode) {
+		uint32_t seq = __atomic_add_fetch(&ctx->seqno, 1, __ATOMIC_RELAXED);
+
+		shdr = (struct seq_header){
+			.hdr.nonce = SEQ_MAGIC,
+			.origin = htonl(ctx->origin_id),
+			.seq = htonl(seq),
+		};
+		hdrlen = sizeof(shdr);
+		key = (uint64_t)ctx->origin_id << 32 | seq;
+	} else {
+		obtainrandom(&shdr.hdr.nonce, sizeof(shdr.hdr.nonce), 0);
+		key = shdr.hdr.nonce;
+		dupfilter_add(&ctx->dupfilter, key);
+	}
+
+	workers_seen_add(&ctx->workers, key);
+
+	struct iovec iov[2] = {
+		{
+			.iov_base = &shdr,
+			.iov_len = hdrlen,
+		},
+		{
+			.iov_base = packet,
+			.iov_len = len,
+		}
+	};
+
+	worker_forward(w, snapshot, NULL, iov, 2);
+}
+
+struct worker_segment_arg {
+	struct worker *w;
+	struct worker_snapshot *snapshot;
+};
+
+static void worker_handle_segment(void *arg, uint8_t *packet, size_t len) {
+	struct worker_segment_arg *a = arg;
+
+	if (tun_packet_valid(packet, len))
+		worker_handle_local(a->w, a->snapshot, packet, len);
+}
+
+static void worker_handle_tun(struct worker *w, struct worker_snapshot *snapshot, int fd) {
+	bool vnet = w->ctx->tun_vnet;
+	size_t size = vnet ? VNET_BUFFER_SIZE : w->ctx->mtu;
+
+	while (1) {
+		ssize_t count = read(fd, w->tun_buffer, size);
+
+		if (count <= 0) {
+			if (count < 0 && errno != EAGAIN)
+				log_error("read from tun queue in worker %u: %s\n", w->index, strerror(errno));
+			break;
+		}
+
+		if (vnet) {
+			struct worker_segment_arg arg = {
+				.w = w,
+				.snapshot = snapshot,
+			};
+			unsigned int n = vnet_segment(w->tun_buffer, count, worker_handle_segment, &arg);
+
+			if (n > 1) {
+				WORKER_COUNT(w, tun_gso_reads, 1);
+				WORKER_COUNT(w, tun_gso_segments, n);
+			}
+		} else if (tun_packet_valid(w->tun_buffer, count)) {
+			worker_handle_local(w, snapshot, w->tun_buffer, count);
+		}
+	}
+}
+
+static bool worker_owns_tun(struct worker *w, int fd) {
+	for (size_t i = 0; i < VECTOR_LEN(w->tun_fds); i++) {
+		if (VECTOR_INDEX(w->tun_fds, i) == fd)
+			return true;
+	}
+
+	return false;
+}
+
+/** Returns true if fd is a socket of this worker in the snapshot */
+static bool worker_owns_fd(struct worker *w, struct worker_snapshot *snapshot, int fd) {
+	for (size_t i = 0; i < snapshot->links_len; i++) {
+		if (snapshot->links[i].fds[w->index] == fd)
+			return true;
+	}
+
+	return false;
+}
+
+static void *worker_run(void *arg) {
+	struct worker *w = arg;
+	struct epoll_event events[64];
+
+	while (1) {
+		int n = epoll_wait(w->efd, events, 64, -1);
+
+		__atomic_add_fetch(&w->epoch, 1, __ATOMIC_SEQ_CST);
+		struct worker_snapshot *snapshot = __atomic_load_n(&w->ctx->workers.snapshot, __ATOMIC_SEQ_CST);
+
+		// an event may still name a socket whose interface was
+		// removed, and the descriptor may be in use for something else
+		for (int i = 0; i < n; i++) {
+			if (worker_owns_tun(w, events[i].data.fd))
+				worker_handle_tun(w, snapshot, events[i].data.fd);
+			else if (worker_owns_fd(w, snapshot, events[i].data.fd))
+				worker_handle_in(w, snapshot, events[i].data.fd);
+		}
+
+		__atomic_add_fetch(&w->epoch, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * workers_init - prepare the worker threads
+ * @workers: the workers
+ * @ctx: the mmfd context
+ * @count: number of workers
+ * @window: milliseconds a packet is remembered as seen
+ * @max_entries: most packets remembered, shared by all shards
+ * @batch_size: datagrams per recvmmsg() of each worker
+ *
+ * The threads are started by workers_start() once the interfaces are set up.
+ *
+ * Return: false if the threads cannot be set up
+ */
+bool workers_init(workers_ctx *workers, struct context *ctx, unsigned int count, uint64_t window, size_t max_entries, size_t batch_size) {
+	size_t shard_entries = max_entries / WORKER_SEEN_SHARDS;
+
+	if (shard_entries < SEEN_MIN_CAPACITY)
+		shard_entries = SEEN_MIN_CAPACITY;
+
+	workers->shards = mmfd_alloc_aligned(WORKER_SEEN_SHARDS * sizeof(worker_shard), 64);
+	for (size_t i = 0; i < WORKER_SEEN_SHARDS; i++) {
+		pthread_mutex_init(&workers->shards[i].lock, NULL);
+		seen_init(&workers->shards[i].cache, window, shard_entries);
+	}
+
+	workers->workers = mmfd_alloc_aligned(count * sizeof(struct worker), 64);
+	memset(workers->workers, 0, count * sizeof(struct worker));
+
+	for (unsigned int i = 0; i < count; i++) {
+		struct worker *w = &workers->workers[i];
+
+		w->ctx = ctx;
+		w->index = i;
+		w->efd = epoll_create1(EPOLL_CLOEXEC);
+		if (w->efd < 0) {
+			log_error("epoll_create for worker %u: %s\n", i, strerror(errno));
+			return false;
+		}
+
+		w->batch = mmfd_new0(struct rx_batch);
+		rx_batch_init(w->batch, batch_size, rx_buffer_size(ctx));
+		w->stats = mmfd_alloc_aligned(sizeof(struct stats), 64);
+		memset(w->stats, 0, sizeof(struct stats));
+		frag_init(&w->frag);
+	}
+
+	workers->count = count;
+	workers->dirty = true;
+	return true;
+}
+
+/**
+ * workers_add_tun - let a worker read a queue of the tun device
+ * @workers: the workers
+ * @fd: the queue
+ *
+ * Queues are spread over the workers in turn. Only to be called before
+ * workers_start().
+ */
+void workers_add_tun(workers_ctx *workers, int fd) {
+	struct worker *w = &workers->workers[workers->tun_next++ % workers->count];
+
+	if (!w->tun_buffer)
+		w->tun_buffer = mmfd_alloc(VNET_BUFFER_SIZE);
+
+	VECTOR_ADD(w->tun_fds, fd);
+	change_fd(w->efd, fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+}
+
+/** Starts the worker threads */
+void workers_start(workers_ctx *workers) {
+	for (unsigned int i = 0; i < workers->count; i++) {
+		int rc = pthread_create(&workers->workers[i].thread, NULL, worker_run, &workers->workers[i]);
+
+		if (rc)
+			exit_error("pthread_create");
+	}
+}
+
+/**
+ * workers_add_interface - open the sockets of the workers on an interface
+ * @workers: the workers
+ * @iface: the interface, already in ctx.interfaces
+ */
+void workers_add_interface(workers_ctx *workers, struct interface *iface) {
+	struct sockaddr_in6 server_addr = {
+		.sin6_family = AF_INET6,
+		.sin6_addr = in6addr_any,
+		.sin6_port = htons(PORT),
+	};
+
+	iface->worker_fds = mmfd_new0_array(workers->count, int);
+
+	for (unsigned int i = 0; i < workers->count; i++) {
+		int fd = socket_prepare(iface);
+
+		dupfilter_attach(&ctx.dupfilter, fd);
+
+		if (bind(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+			exit_errno("bind failed");
+
+		iface->worker_fds[i] = fd;
+	}
+
+	// the workers must know the sockets before they get events for them
+	workers->dirty = true;
+	workers_publish(&ctx);
+
+	for (unsigned int i = 0; i < workers->count; i++)
+		change_fd(workers->workers[i].efd, iface->worker_fds[i], EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
+}
+
+/**
+ * workers_del_interface - stop the workers from receiving on an interface
+ * @workers: the workers
+ * @iface: the interface, about to be removed from ctx.interfaces
+ *
+ * The sockets are closed once no worker can use them anymore.
+ */
+void workers_del_interface(workers_ctx *workers, struct interface *iface) {
+	for (unsigned int i = 0; i < workers->count; i++) {
+		epoll_ctl(workers->workers[i].efd, EPOLL_CTL_DEL, iface->worker_fds[i], NULL);
+		VECTOR_ADD(workers->close_fds, iface->worker_fds[i]);
+	}
+
+	free(iface->worker_fds);
+	iface->worker_fds = NULL;
+	workers->dirty = true;
+}
+
+static void snapshot_free(struct worker_snapshot *snapshot) {
+	for (size_t i = 0; i < VECTOR_LEN(snapshot->close_fds); i++)
+		close(VECTOR_INDEX(snapshot->close_fds, i));
+
+	for (size_t i = 0; i < snapshot->links_len; i++)
+		free(snapshot->links[i].fds);
+
+	VECTOR_FREE(snapshot->close_fds);
+	free(snapshot->links);
+	free(snapshot->peers);
+	free(snapshot->epochs);
+	free(snapshot);
+}
+
+/** Returns true once no worker can still use the snapshot */
+static bool snapshot_unused(workers_ctx *workers, struct worker_snapshot *snapshot) {
+	for (unsigned int i = 0; i < workers->count; i++) {
+		uint64_t epoch = snapshot->epochs[i];
+
+		if (epoch % 2 && __atomic_load_n(&workers->workers[i].epoch, __ATOMIC_ACQUIRE) == epoch)
+			return false;
+	}
+
+	return true;
+}
+
+static void workers_reclaim(workers_ctx *workers) {
+	struct worker_snapshot **p = &workers->retired;
+
+	while (*p) {
+		struct worker_snapshot *snapshot = *p;
+
+		if (snapshot_unused(workers, snapshot)) {
+			*p = snapshot->next;
+			snapshot_free(snapshot);
+		} else {
+			p = &snapshot->next;
+		}
+	}
+}
+
+static void workers_reclaim_task(__attribute__ ((unused)) void *d) {
+	ctx.workers.reclaim_pending = false;
+	workers_reclaim(&ctx.workers);
+
+	if (ctx.workers.retired) {
+		ctx.workers.reclaim_pending = true;
+		post_task(&ctx.taskqueue_ctx, 0, WORKER_RECLAIM_INTERVAL, workers_reclaim_task, NULL, NULL);
+	}
+}
+
+static struct worker_snapshot *snapshot_build(struct context *ctx) {
+	struct worker_snapshot *snapshot = mmfd_new0(struct worker_snapshot);
+	workers_ctx *workers = &ctx->workers;
+	size_t peers = 0;
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++)
+		peers += VECTOR_LEN(VECTOR_INDEX(ctx->interfaces, i).neighbours);
+
+	snapshot->links = mmfd_new0_array(VECTOR_LEN(ctx->interfaces), struct worker_link);
+	snapshot->peers = mmfd_new0_array(peers, struct sockaddr_in6);
+	snapshot->epochs = mmfd_new0_array(workers->count, uint64_t);
+
+	for (size_t i = 0; i < VECTOR_LEN(ctx->interfaces); i++) {
+		interface *iface = &VECTOR_INDEX(ctx->interfaces, i);
+
+		if (!iface->worker_fds)
+			continue;
+
+		struct worker_link *link = &snapshot->links[snapshot->links_len++];
+
+		link->ifindex = iface->ifindex;
+		link->mcast_threshold = iface->mcast_threshold;
+		if (ctx->fragment)
+			link->room = iface->mtu > DATAGRAM_OVERHEAD ? iface->mtu - DATAGRAM_OVERHEAD : 0;
+		link->fds = mmfd_new_array(workers->count, int);
+		memcpy(link->fds, iface->worker_fds, workers->count * sizeof(int));
+		link->first = snapshot->peers_len;
+		link->count = VECTOR_LEN(iface->neighbours);
+
+		for (size_t j = 0; j < VECTOR_LEN(iface->neighbours); j++)
+			snapshot->peers[snapshot->peers_len++] = VECTOR_INDEX(iface->neighbours, j)->address;
+	}
+
+	return snapshot;
+}
+
+/**
+ * workers_publish - hand the current neighbours and interfaces to the workers
+ * @ctx: the mmfd context
+ *
+ * Does nothing unless something changed since the last call. The replaced
+ * snapshot is freed from a task once every worker is done with it.
+ */
+void workers_publish(struct context *ctx) {
+	workers_ctx *workers = &ctx->workers;
+
+	if (!workers->count || !workers->dirty)
+		return;
+
+	workers->dirty = false;
+	workers->published++;
+
+	struct worker_snapshot *old = __atomic_exchange_n(&workers->snapshot, snapshot_build(ctx), __ATOMIC_SEQ_CST);
+
+	if (!old) {
+		// nothing was running before the first snapshot
+		for (size_t i = 0; i < VECTOR_LEN(workers->close_fds); i++)
+			close(VECTOR_INDEX(workers->close_fds, i));
+		VECTOR_RESIZE(workers->close_fds, 0);
+		return;
+	}
+
+	for (unsigned int i = 0; i < workers->count; i++)
+		old->epochs[i] = __atomic_load_n(&workers->workers[i].epoch, __ATOMIC_SEQ_CST);
+
+	old->close_fds = workers->close_fds;
+	memset(&workers->close_fds, 0, sizeof(workers->close_fds));
+
+	old->next = workers->retired;
+	workers->retired = old;
+
+	if (!workers->reclaim_pending) {
+		workers->reclaim_pending = true;
+		post_task(&ctx->taskqueue_ctx, 0, WORKER_RECLAIM_INTERVAL, workers_reclaim_task, NULL, NULL);
+	}
+}
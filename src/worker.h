@@ -0,0 +1,113 @@
+#pragma once
+
+#include "frag.h"
+#include "seen.h"
+#include "vector.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define WORKER_SEEN_SHARDS 64     /* power of two */
+#define WORKER_RECLAIM_INTERVAL 100 /* milliseconds */
+
+struct context;
+struct interface;
+struct rx_batch;
+struct stats;
+
+typedef VECTOR(int) worker_fd_vector;
+
+/** A mesh interface as the workers see it */
+struct worker_link {
+	int ifindex;
+	int *fds;               /**< one socket per worker */
+	size_t mcast_threshold;
+	size_t room;            /**< largest datagram the link takes, 0 if datagrams are not split up */
+	size_t first;           /**< index of the first neighbour in the snapshot */
+	size_t count;           /**< number of neighbours on this link */
+};
+
+/**
+ * Everything the workers need to forward a packet, built by the main thread
+ * and never changed once it is published. A new snapshot replaces it as a
+ * whole, the old one is freed after every worker has moved on.
+ */
+struct worker_snapshot {
+	struct worker_link *links;
+	size_t links_len;
+	struct sockaddr_in6 *peers;
+	size_t peers_len;
+
+	worker_fd_vector close_fds;   /**< sockets of removed interfaces, closed with the snapshot */
+	uint64_t *epochs;             /**< worker epochs when the snapshot was replaced */
+	struct worker_snapshot *next; /**< in the list of retired snapshots */
+};
+
+/** A duplicate cache shard, each one with its own lock and cache line */
+typedef struct {
+	pthread_mutex_t lock;
+	seen_cache cache;
+} __attribute__((aligned(64))) worker_shard;
+
+struct worker {
+	struct context *ctx;
+	unsigned int index;
+	pthread_t thread;
+	int efd;
+	struct rx_batch *batch;
+	VECTOR(struct mmsghdr) fanout;
+	worker_fd_vector tun_fds;  /**< queues of the tun device this worker reads */
+	uint8_t *tun_buffer;       /**< room for a read from them, super-packets included */
+	struct stats *stats;
+	frag_ctx frag;             /**< fragments of a neighbour always reach the same worker */
+
+	/**
+	 * Odd while the worker handles events, even while it waits for
+	 * them. A snapshot may be freed once the epoch of every worker was
+	 * even or has changed since the snapshot was replaced.
+	 */
+	uint64_t epoch;
+} __attribute__((aligned(64)));
+
+/**
+ * Worker threads for the data plane.
+ *
+ * Every worker owns one SO_REUSEPORT socket per mesh interface and its own
+ * epoll set, the kernel spreads the datagrams of the neighbours over them.
+ * The workers deduplicate against a cache split into shards, relay new
+ * packets to the neighbours in the current snapshot and write them to the
+ * tun device. Workers also read the further queues of a multiqueue tun
+ * device and send the local packets from them. Hellos, the first tun
+ * queue, timers and the control socket stay with the main thread, which
+ * rebuilds the snapshot whenever the neighbours or interfaces change.
+ */
+typedef struct {
+	unsigned int count;            /**< number of workers, 0 if disabled */
+	struct worker *workers;
+	worker_shard *shards;
+	struct worker_snapshot *snapshot;
+	struct worker_snapshot *retired;
+	worker_fd_vector close_fds;    /**< sockets to hand to the next retired snapshot */
+	bool dirty;                    /**< the snapshot is out of date */
+	bool reclaim_pending;
+	unsigned int tun_next;         /**< worker that gets the next tun queue */
+	uint64_t published;
+} workers_ctx;
+
+bool workers_init(workers_ctx *workers, struct context *ctx, unsigned int count, uint64_t window, size_t max_entries, size_t batch_size);
+void workers_start(workers_ctx *workers);
+void workers_add_tun(workers_ctx *workers, int fd);
+void workers_add_interface(workers_ctx *workers, struct interface *iface);
+void workers_del_interface(workers_ctx *workers, struct interface *iface);
+void workers_publish(struct context *ctx);
+bool workers_seen_add(workers_ctx *workers, uint64_t key);
+void workers_expire(workers_ctx *workers);
+void workers_stats(workers_ctx *workers, struct stats *stats, seen_cache *seen);
+
+static inline bool workers_enabled(workers_ctx *workers) {
+	return workers->count > 0;
+}